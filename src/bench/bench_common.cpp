@@ -0,0 +1,266 @@
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <sstream>
+
+#include "vcamshare.h"
+
+static constexpr int GOP_FRAMES = 30;
+
+// Writes an H.264 bitstream by the bit, enough for parameter sets.
+class BitWriter {
+public:
+    void bits(uint32_t value, int count) {
+        for(int i = count - 1; i >= 0; i --) {
+            bit((value >> i) & 1);
+        }
+    }
+
+    void ue(uint32_t value) {
+        uint32_t v = value + 1;
+        int len = 0;
+        while((v >> len) > 1) len ++;
+        bits(0, len);
+        bits(v, len + 1);
+    }
+
+    void se(int32_t value) {
+        ue(value > 0 ? 2 * value - 1 : -2 * value);
+    }
+
+    // Adds the stop bit and the emulation prevention bytes.
+    std::vector<uint8_t> nal(uint8_t header) {
+        bit(1);
+        while(mCount % 8) bit(0);
+
+        std::vector<uint8_t> out = { 0, 0, 0, 1, header };
+        int zeros = 0;
+        for(uint8_t b : mBytes) {
+            if(zeros >= 2 && b <= 3) {
+                out.push_back(3);
+                zeros = 0;
+            }
+            out.push_back(b);
+            zeros = b == 0 ? zeros + 1 : 0;
+        }
+        return out;
+    }
+
+private:
+    void bit(int b) {
+        if(mCount % 8 == 0) mBytes.push_back(0);
+        if(b) mBytes.back() |= 0x80 >> (mCount % 8);
+        mCount ++;
+    }
+
+    std::vector<uint8_t> mBytes;
+    int mCount = 0;
+};
+
+// Baseline SPS and PPS for the size, the muxer only reads them.
+static std::vector<uint8_t> parameterSets(int width, int height) {
+    int mbWidth = (width + 15) / 16;
+    int mbHeight = (height + 15) / 16;
+
+    BitWriter sps;
+    sps.bits(66, 8);            // profile_idc, baseline
+    sps.bits(0xc0, 8);          // constraint_set0/1
+    sps.bits(51, 8);            // level_idc
+    sps.ue(0);                  // seq_parameter_set_id
+    sps.ue(0);                  // log2_max_frame_num_minus4
+    sps.ue(2);                  // pic_order_cnt_type
+    sps.ue(1);                  // max_num_ref_frames
+    sps.bits(0, 1);             // gaps_in_frame_num_value_allowed_flag
+    sps.ue(mbWidth - 1);
+    sps.ue(mbHeight - 1);
+    sps.bits(1, 1);             // frame_mbs_only_flag
+    sps.bits(1, 1);             // direct_8x8_inference_flag
+    bool crop = mbWidth * 16 != width || mbHeight * 16 != height;
+    sps.bits(crop, 1);
+    if(crop) {
+        sps.ue(0);
+        sps.ue((mbWidth * 16 - width) / 2);
+        sps.ue(0);
+        sps.ue((mbHeight * 16 - height) / 2);
+    }
+    sps.bits(0, 1);             // vui_parameters_present_flag
+
+    BitWriter pps;
+    pps.ue(0);                  // pic_parameter_set_id
+    pps.ue(0);                  // seq_parameter_set_id
+    pps.bits(0, 1);             // entropy_coding_mode_flag
+    pps.bits(0, 1);             // bottom_field_pic_order_in_frame_present_flag
+    pps.ue(0);                  // num_slice_groups_minus1
+    pps.ue(0);                  // num_ref_idx_l0_default_active_minus1
+    pps.ue(0);                  // num_ref_idx_l1_default_active_minus1
+    pps.bits(0, 1);             // weighted_pred_flag
+    pps.bits(0, 2);             // weighted_bipred_idc
+    pps.se(0);                  // pic_init_qp_minus26
+    pps.se(0);                  // pic_init_qs_minus26
+    pps.se(0);                  // chroma_qp_index_offset
+    pps.bits(1, 1);             // deblocking_filter_control_present_flag
+    pps.bits(0, 1);             // constrained_intra_pred_flag
+    pps.bits(0, 1);             // redundant_pic_cnt_present_flag
+
+    std::vector<uint8_t> out = sps.nal(0x67);
+    std::vector<uint8_t> ppsNal = pps.nal(0x68);
+    out.insert(out.end(), ppsNal.begin(), ppsNal.end());
+    return out;
+}
+
+// The payload never contains a zero byte, so no start code shows up inside
+// a frame.
+static std::vector<std::vector<uint8_t>> syntheticGop(int width, int height, int fps, int bitRate) {
+    std::vector<uint8_t> header = parameterSets(width, height);
+    int64_t gopBytes = int64_t(bitRate) / 8 * GOP_FRAMES / fps;
+    int pFrameBytes = int(gopBytes / (GOP_FRAMES + 3));
+
+    uint32_t seed = 0x12345678;
+    std::vector<std::vector<uint8_t>> gop;
+    for(int i = 0; i < GOP_FRAMES; i ++) {
+        std::vector<uint8_t> frame;
+        if(i == 0) frame = header;
+        frame.insert(frame.end(), { 0, 0, 0, 1, uint8_t(i == 0 ? 0x65 : 0x41) });
+
+        size_t size = frame.size() + (i == 0 ? 4 * pFrameBytes : pFrameBytes);
+        while(frame.size() < size) {
+            seed = seed * 1664525 + 1013904223;
+            frame.push_back(uint8_t(seed >> 24) | 1);
+        }
+        gop.push_back(std::move(frame));
+    }
+    return gop;
+}
+
+// The decimal text format of the test fixtures, a frame per line.
+static std::vector<std::vector<uint8_t>> loadTextFixture(const std::string &path) {
+    std::vector<std::vector<uint8_t>> frames;
+    std::ifstream source(path);
+    std::string line;
+    while(std::getline(source, line)) {
+        std::vector<uint8_t> frame;
+        std::stringstream values(line);
+        int value;
+        while(values >> value) {
+            frame.push_back(uint8_t(value));
+        }
+        if(!frame.empty()) frames.push_back(std::move(frame));
+    }
+    return frames;
+}
+
+// The value of a "Name:  123 kB" line of /proc/self/status.
+static long procStatus(const char *name) {
+    FILE *file = fopen("/proc/self/status", "r");
+    if(!file) return -1;
+
+    char line[256];
+    long value = -1;
+    size_t len = strlen(name);
+    while(fgets(line, sizeof(line), file)) {
+        if(strncmp(line, name, len) == 0 && line[len] == ':') {
+            value = atol(line + len + 1);
+            break;
+        }
+    }
+    fclose(file);
+    return value;
+}
+
+namespace bench {
+
+    void FrameSource::synthesize(int width, int height, int fps, int bitRate) {
+        mMapped.reset();
+        mOwned = syntheticGop(width, height, fps, bitRate);
+        mFrames.clear();
+        for(auto &frame : mOwned) {
+            mFrames.push_back({ frame.data(), int(frame.size()) });
+        }
+    }
+
+    bool FrameSource::load(const std::string &path) {
+        mOwned.clear();
+        mFrames.clear();
+        mMapped.reset(new vcamshare::FixtureFile());
+        if(mMapped->open(path) || mMapped->open(path + ".vcfx")) {
+            for(auto &frame : mMapped->frames()) {
+                mFrames.push_back({ frame.data, frame.size });
+            }
+        } else {
+            mMapped.reset();
+            mOwned = loadTextFixture(path);
+            for(auto &frame : mOwned) {
+                mFrames.push_back({ frame.data(), int(frame.size()) });
+            }
+        }
+        return !mFrames.empty();
+    }
+
+    std::vector<float> toneChunk() {
+        std::vector<float> tone(AUDIO_CHUNK);
+        for(int i = 0; i < AUDIO_CHUNK; i ++) {
+            tone[i] = 0.25f * sinf(2 * float(M_PI) * 440 * i / AUDIO_SAMPLE_RATE);
+        }
+        return tone;
+    }
+
+    double cpuSeconds() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+            + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+
+    void resetPeakRss() {
+        // Writing 5 sets VmHWM back to the current RSS.
+        FILE *file = fopen("/proc/self/clear_refs", "w");
+        if(!file) return;
+        fputs("5", file);
+        fclose(file);
+    }
+
+    long peakRssKb() {
+        long hwm = procStatus("VmHWM");
+        if(hwm >= 0) return hwm;
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        // Kilobytes on Linux.
+        return usage.ru_maxrss;
+    }
+
+    long currentRssKb() {
+        return procStatus("VmRSS");
+    }
+
+    int threadCount() {
+        return int(procStatus("Threads"));
+    }
+
+    int64_t fileSize(const std::string &path) {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+    }
+
+    void waitForQueues(int hd) {
+        VideoMuxerStats stats;
+        while(videoMuxerGetStats(hd, &stats) && (stats.videoQueueDepth > 0 || stats.audioQueueDepth > 0)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    void waitForQueueBelow(int hd, uint32_t depth) {
+        VideoMuxerStats stats;
+        while(videoMuxerGetStats(hd, &stats) && stats.videoQueueDepth >= depth) {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+}
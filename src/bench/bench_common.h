@@ -0,0 +1,64 @@
+#ifndef VXMT_VCAM_SHARE_BENCH_COMMON
+#define VXMT_VCAM_SHARE_BENCH_COMMON
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+
+#include "fixture_file.h"
+
+// What the benchmark and the soak harness share: frame sources and
+// process measurements, the latter read from /proc on Linux.
+namespace bench {
+
+    static constexpr int AUDIO_SAMPLE_RATE = 44100;
+    static constexpr int AUDIO_CHUNK = 1024;
+    // Frames a producer lets queue up before waiting for its muxer.
+    static constexpr uint32_t MAX_QUEUED_FRAMES = 30;
+
+    struct FrameRef {
+        const uint8_t *data;
+        int size;
+    };
+
+    // Frames to loop over, either generated or read from a fixture.
+    class FrameSource {
+    public:
+        // One GOP sized like a camera at bitRate: IDRs carry the parameter
+        // sets and weigh as much as four P frames.
+        void synthesize(int width, int height, int fps, int bitRate);
+        // Maps a binary fixture (also tried as path.vcfx), or parses a text one.
+        bool load(const std::string &path);
+
+        const std::vector<FrameRef> &frames() {
+            return mFrames;
+        }
+
+    private:
+        std::vector<std::vector<uint8_t>> mOwned;
+        std::unique_ptr<vcamshare::FixtureFile> mMapped;
+        std::vector<FrameRef> mFrames;
+    };
+
+    // A 440 Hz tone, AUDIO_CHUNK samples long.
+    std::vector<float> toneChunk();
+
+    double cpuSeconds();
+    // Starts a new peak on Linux, elsewhere peakRssKb stays the peak of
+    // the whole process.
+    void resetPeakRss();
+    // The highest RSS since the last resetPeakRss.
+    long peakRssKb();
+    long currentRssKb();
+    int threadCount();
+    int64_t fileSize(const std::string &path);
+
+    // Blocks until the muxer thread took every queued frame.
+    void waitForQueues(int hd);
+    // Feeds writeVideoFrames only while the muxer keeps up, so an unpaced
+    // producer doesn't grow the queue without bound.
+    void waitForQueueBelow(int hd, uint32_t depth);
+}
+
+#endif
@@ -0,0 +1,249 @@
+// Throughput of the muxing pipeline, driven through the C API the apps use.
+//
+//   bench [--seconds N] [--filter NAME] [--fixture FILE] [--out DIR] [--json FILE]
+//
+// Every scenario feeds frames as fast as the muxer thread takes them, with
+// at most MAX_QUEUED_FRAMES queued, and waits for it to empty its queues
+// before closing. Each reports its own peak RSS where /proc can reset it.
+// Results go to stdout as a table and, with --json, into a file for
+// tracking regressions between builds. The muxing runs also report how long frames
+// took from writeVideoFrames to the muxer and to the file, as far as the
+// buffers written before the close go.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <functional>
+#include <algorithm>
+
+#include "vcamshare.h"
+#include "faststart.h"
+#include "remuxer.h"
+#include "bench_common.h"
+
+struct Scenario {
+    const char *name;
+    int width;
+    int height;
+    int fps;
+    int bitRate;
+    bool audio;
+};
+
+static const Scenario SCENARIOS[] = {
+    { "1080p30",       1920, 1080, 30, 12000000, true },
+    { "1080p30_video", 1920, 1080, 30, 12000000, false },
+    { "1080p60",       1920, 1080, 60, 20000000, true },
+    { "1440p30",       2560, 1440, 30, 24000000, true },
+    { "4k30",          3840, 2160, 30, 45000000, true },
+    { "4k60",          3840, 2160, 60, 80000000, true },
+};
+
+using namespace bench;
+
+struct Result {
+    std::string name;
+    int64_t frames;
+    int64_t bytes;
+    double seconds;
+    double cpuSeconds;
+    long peakRssKb;
+    VideoMuxerPercentiles toWrite;
+    VideoMuxerPercentiles toDisk;
+    bool ok;
+};
+
+static Result runMuxing(const std::string &name, int width, int height, int fps, bool audio,
+                        const std::vector<FrameRef> &frames, int64_t frameCount,
+                        const std::string &outputPath) {
+    Result result = { name, frameCount, 0, 0, 0, 0, {}, {}, false };
+    remove(outputPath.c_str());
+
+    std::vector<float> tone = toneChunk();
+
+    resetPeakRss();
+    double cpuStart = cpuSeconds();
+    auto start = std::chrono::steady_clock::now();
+
+    int hd = createVideoMuxer(width, height, fps, outputPath.c_str());
+    int64_t samplesDue = 0;
+    for(int64_t i = 0; i < frameCount; i ++) {
+        // Unpaced, the queue would hold most of the run and the peak RSS
+        // would measure it rather than the muxer.
+        waitForQueueBelow(hd, MAX_QUEUED_FRAMES);
+        const FrameRef &frame = frames[i % frames.size()];
+        writeVideoFrames(hd, const_cast<uint8_t *>(frame.data), frame.size);
+
+        if(audio) {
+            // Keep the audio in step with the video clock.
+            samplesDue += AUDIO_SAMPLE_RATE / fps;
+            while(samplesDue >= AUDIO_CHUNK) {
+                writeRawAudioFrames(hd, tone.data(), AUDIO_CHUNK, false);
+                samplesDue -= AUDIO_CHUNK;
+            }
+        }
+    }
+    waitForQueues(hd);
+    VideoMuxerStats stats;
+    if(videoMuxerGetStats(hd, &stats)) {
+        result.toWrite = stats.ingestToWriteLatency;
+        result.toDisk = stats.ingestToDiskLatency;
+    }
+    result.ok = checkVideoMuxerError(hd) == 0;
+    closeVideoMuxer(hd);
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.cpuSeconds = cpuSeconds() - cpuStart;
+    result.peakRssKb = peakRssKb();
+    result.bytes = fileSize(outputPath);
+    result.ok = result.ok && result.bytes > 0;
+    return result;
+}
+
+static Result runFileStep(const std::string &name, const std::string &path,
+                          std::function<bool()> step) {
+    Result result = { name, 0, fileSize(path), 0, 0, 0, {}, {}, false };
+    resetPeakRss();
+    double cpuStart = cpuSeconds();
+    auto start = std::chrono::steady_clock::now();
+
+    result.ok = step();
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.cpuSeconds = cpuSeconds() - cpuStart;
+    result.peakRssKb = peakRssKb();
+    return result;
+}
+
+static void printResult(const Result &r) {
+    double mb = r.bytes / (1024.0 * 1024.0);
+    printf("%-20s %8lld frames %9.1f fps %8.1f MB/s %8.1f us cpu/frame %8ld KB rss%s\n",
+           r.name.c_str(), (long long)r.frames,
+           r.seconds > 0 ? r.frames / r.seconds : 0,
+           r.seconds > 0 ? mb / r.seconds : 0,
+           r.frames > 0 ? r.cpuSeconds * 1e6 / r.frames : 0,
+           r.peakRssKb, r.ok ? "" : "  FAILED");
+    if(r.toDisk.count > 0) {
+        printf("%-20s ingest->write p50 %.2f p99 %.2f max %.2f ms, ingest->disk p50 %.2f p99 %.2f max %.2f ms\n", "",
+               r.toWrite.p50Us / 1000.0, r.toWrite.p99Us / 1000.0, r.toWrite.maxUs / 1000.0,
+               r.toDisk.p50Us / 1000.0, r.toDisk.p99Us / 1000.0, r.toDisk.maxUs / 1000.0);
+    }
+    fflush(stdout);
+}
+
+static bool writeJson(const std::string &path, const std::vector<Result> &results) {
+    FILE *file = fopen(path.c_str(), "w");
+    if(!file) return false;
+
+    fprintf(file, "{\n  \"benchmarks\": [\n");
+    for(size_t i = 0; i < results.size(); i ++) {
+        const Result &r = results[i];
+        fprintf(file, "    {\"name\": \"%s\", \"ok\": %s, \"frames\": %lld, \"bytes\": %lld, "
+                "\"seconds\": %.6f, \"cpu_seconds\": %.6f, \"fps\": %.3f, \"mb_per_s\": %.3f, "
+                "\"cpu_us_per_frame\": %.3f, \"peak_rss_kb\": %ld, "
+                "\"ingest_to_write_us\": {\"p50\": %llu, \"p99\": %llu, \"max\": %llu}, "
+                "\"ingest_to_disk_us\": {\"p50\": %llu, \"p99\": %llu, \"max\": %llu}}%s\n",
+                r.name.c_str(), r.ok ? "true" : "false", (long long)r.frames, (long long)r.bytes,
+                r.seconds, r.cpuSeconds,
+                r.seconds > 0 ? r.frames / r.seconds : 0,
+                r.seconds > 0 ? r.bytes / (1024.0 * 1024.0) / r.seconds : 0,
+                r.frames > 0 ? r.cpuSeconds * 1e6 / r.frames : 0,
+                r.peakRssKb,
+                (unsigned long long)r.toWrite.p50Us, (unsigned long long)r.toWrite.p99Us,
+                (unsigned long long)r.toWrite.maxUs,
+                (unsigned long long)r.toDisk.p50Us, (unsigned long long)r.toDisk.p99Us,
+                (unsigned long long)r.toDisk.maxUs,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    return fclose(file) == 0;
+}
+
+int main(int argc, char **argv) {
+    double seconds = 10;
+    std::string filter;
+    std::string fixture;
+    std::string outDir = "/tmp";
+    std::string jsonPath;
+
+    for(int i = 1; i < argc; i ++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(arg == "--seconds" && hasValue) seconds = atof(argv[++ i]);
+        else if(arg == "--filter" && hasValue) filter = argv[++ i];
+        else if(arg == "--fixture" && hasValue) fixture = argv[++ i];
+        else if(arg == "--out" && hasValue) outDir = argv[++ i];
+        else if(arg == "--json" && hasValue) jsonPath = argv[++ i];
+        else {
+            fprintf(stderr, "usage: %s [--seconds N] [--filter NAME] [--fixture FILE] [--out DIR] [--json FILE]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    // The muxer's own chatter would end up in the timings.
+    videoMuxerSetLogCallback(nullptr, VIDEO_MUXER_LOG_WARNING, nullptr);
+
+    std::vector<Result> results;
+    std::string lastRecording;
+    for(const Scenario &scenario : SCENARIOS) {
+        if(!filter.empty() && std::string(scenario.name).find(filter) == std::string::npos) continue;
+
+        std::string path = outDir + "/bench_" + scenario.name + ".mp4";
+        int64_t frames = int64_t(seconds * scenario.fps);
+        FrameSource source;
+        source.synthesize(scenario.width, scenario.height, scenario.fps, scenario.bitRate);
+        results.push_back(runMuxing(scenario.name, scenario.width, scenario.height, scenario.fps,
+                                    scenario.audio, source.frames(), frames, path));
+        printResult(results.back());
+        if(results.back().ok) lastRecording = path;
+    }
+
+    if(!fixture.empty()) {
+        FrameSource source;
+        if(!source.load(fixture)) {
+            fprintf(stderr, "No frames in %s\n", fixture.c_str());
+        } else {
+            // The fixtures come from a 1080p30 camera and are looped to length.
+            std::string path = outDir + "/bench_fixture.mp4";
+            int64_t frames = std::max<int64_t>(source.frames().size(), int64_t(seconds * 30));
+            results.push_back(runMuxing("fixture", 1920, 1080, 30, false, source.frames(), frames, path));
+            printResult(results.back());
+        }
+    }
+
+    // Post-processing of the last recording: moov relocation and a trim
+    // from the middle, both streaming through the file.
+    if(!lastRecording.empty()) {
+        std::string copy = lastRecording + ".faststart.mp4";
+        std::ifstream src(lastRecording, std::ios::binary);
+        std::ofstream dst(copy, std::ios::binary);
+        dst << src.rdbuf();
+        dst.close();
+
+        results.push_back(runFileStep("faststart", copy, [copy] () {
+            return vcamshare::faststartFile(copy, nullptr);
+        }));
+        printResult(results.back());
+
+        std::string trimmed = lastRecording + ".trim.mp4";
+        results.push_back(runFileStep("trim", lastRecording, [lastRecording, trimmed, seconds] () {
+            return vcamshare::trimFile(lastRecording, trimmed, seconds / 4, seconds * 3 / 4,
+                                       vcamshare::TrimMode::SnapToKeyframe, nullptr);
+        }));
+        printResult(results.back());
+    }
+
+    videoMuxerFlushLog();
+
+    if(!jsonPath.empty() && !writeJson(jsonPath, results)) {
+        fprintf(stderr, "Could not write %s\n", jsonPath.c_str());
+        return 1;
+    }
+    for(const Result &r : results) {
+        if(!r.ok) return 1;
+    }
+    return 0;
+}
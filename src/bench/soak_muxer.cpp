@@ -0,0 +1,249 @@
+// Runs many muxers side by side, the way multi-camera rigs do, and checks
+// that they scale and clean up after themselves.
+//
+//   soak [--max N] [--seconds N] [--fixture FILE] [--out DIR] [--json FILE]
+//        [--max-rss-growth-mb N] [--min-scaling F]
+//
+// Rounds of 1, 2, 4 ... up to --max concurrent muxers each record for
+// --seconds, every muxer fed from a thread of its own as fast as its queue
+// drains. After each round every file is read back and its packets counted
+// against what the muxer reports to have written. The run fails when
+//  - a file is missing, unreadable or short of packets,
+//  - threads are left behind once the muxers are closed,
+//  - the resident size after a round grew more than --max-rss-growth-mb
+//    past the first round,
+//  - total throughput dropped below --min-scaling of the best round so far.
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "vcamshare.h"
+#include "bench_common.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+using namespace bench;
+
+struct MuxerRun {
+    std::string path;
+    int64_t framesWritten;
+    uint64_t packetsOut;
+    int64_t packetsRead;
+    bool error;
+};
+
+struct Round {
+    int muxers;
+    double seconds;
+    int64_t frames;
+    int peakThreads;
+    int threadsAfter;
+    long rssAfterKb;
+    int invalidFiles;
+    std::vector<std::string> failures;
+};
+
+static int64_t countVideoPackets(const std::string &path) {
+    AVFormatContext *ctx = nullptr;
+    if(avformat_open_input(&ctx, path.c_str(), nullptr, nullptr) < 0) return -1;
+
+    int64_t count = 0;
+    AVPacket *pkt = av_packet_alloc();
+    while(av_read_frame(ctx, pkt) >= 0) {
+        if(ctx->streams[pkt->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) count ++;
+        av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    avformat_close_input(&ctx);
+    return count;
+}
+
+static void recordOne(MuxerRun *run, const std::vector<FrameRef> &frames,
+                      std::chrono::steady_clock::time_point deadline) {
+    std::vector<float> tone = toneChunk();
+    int hd = createVideoMuxer(1920, 1080, 30, run->path.c_str());
+
+    int64_t samplesDue = 0;
+    int64_t i = 0;
+    // Whole GOPs, so every file ends on a complete one.
+    while(std::chrono::steady_clock::now() < deadline || i % frames.size() != 0) {
+        waitForQueueBelow(hd, MAX_QUEUED_FRAMES);
+        const FrameRef &frame = frames[i % frames.size()];
+        writeVideoFrames(hd, const_cast<uint8_t *>(frame.data), frame.size);
+        i ++;
+
+        samplesDue += AUDIO_SAMPLE_RATE / 30;
+        while(samplesDue >= AUDIO_CHUNK) {
+            writeRawAudioFrames(hd, tone.data(), AUDIO_CHUNK, false);
+            samplesDue -= AUDIO_CHUNK;
+        }
+    }
+    waitForQueues(hd);
+
+    VideoMuxerStats stats;
+    videoMuxerGetStats(hd, &stats);
+    run->framesWritten = i;
+    run->packetsOut = stats.videoPacketsOut;
+    run->error = checkVideoMuxerError(hd) != 0;
+    closeVideoMuxer(hd);
+}
+
+static Round runRound(int muxers, double seconds, const std::vector<FrameRef> &frames,
+                      const std::string &outDir, int baselineThreads) {
+    Round round = { muxers, 0, 0, 0, 0, 0, 0, {} };
+    std::vector<MuxerRun> runs(muxers);
+    for(int i = 0; i < muxers; i ++) {
+        runs[i].path = outDir + "/soak_" + std::to_string(i) + ".mp4";
+        remove(runs[i].path.c_str());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::milliseconds(int64_t(seconds * 1000));
+
+    std::vector<std::thread> producers;
+    for(int i = 0; i < muxers; i ++) {
+        producers.emplace_back(recordOne, &runs[i], std::cref(frames), deadline);
+    }
+
+    std::atomic<bool> done(false);
+    std::thread sampler([&round, &done] () {
+        while(!done) {
+            round.peakThreads = std::max(round.peakThreads, threadCount());
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    });
+
+    for(auto &producer : producers) {
+        producer.join();
+    }
+    round.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    done = true;
+    sampler.join();
+
+    // Closing hands the trailers to the background worker.
+    videoMuxerFlushLog();
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    round.threadsAfter = threadCount();
+    round.rssAfterKb = currentRssKb();
+
+    for(auto &run : runs) {
+        round.frames += run.framesWritten;
+        run.packetsRead = countVideoPackets(run.path);
+        if(run.error || run.packetsRead <= 0 || uint64_t(run.packetsRead) < run.packetsOut) {
+            round.invalidFiles ++;
+            round.failures.push_back(run.path + ": " + std::to_string(run.packetsRead) + " of "
+                                     + std::to_string(run.packetsOut) + " packets"
+                                     + (run.error ? ", muxer error" : ""));
+        }
+        remove(run.path.c_str());
+    }
+    if(baselineThreads > 0 && round.threadsAfter > baselineThreads) {
+        round.failures.push_back(std::to_string(round.threadsAfter - baselineThreads) + " threads left behind");
+    }
+    return round;
+}
+
+int main(int argc, char **argv) {
+    int maxMuxers = 64;
+    double seconds = 10;
+    std::string fixture;
+    std::string outDir = "/tmp";
+    std::string jsonPath;
+    long maxRssGrowthKb = 64 * 1024;
+    double minScaling = 0.5;
+
+    for(int i = 1; i < argc; i ++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(arg == "--max" && hasValue) maxMuxers = atoi(argv[++ i]);
+        else if(arg == "--seconds" && hasValue) seconds = atof(argv[++ i]);
+        else if(arg == "--fixture" && hasValue) fixture = argv[++ i];
+        else if(arg == "--out" && hasValue) outDir = argv[++ i];
+        else if(arg == "--json" && hasValue) jsonPath = argv[++ i];
+        else if(arg == "--max-rss-growth-mb" && hasValue) maxRssGrowthKb = atol(argv[++ i]) * 1024;
+        else if(arg == "--min-scaling" && hasValue) minScaling = atof(argv[++ i]);
+        else {
+            fprintf(stderr, "usage: %s [--max N] [--seconds N] [--fixture FILE] [--out DIR] [--json FILE]"
+                    " [--max-rss-growth-mb N] [--min-scaling F]\n", argv[0]);
+            return 2;
+        }
+    }
+    if(maxMuxers < 1) maxMuxers = 1;
+    if(maxMuxers > 64) maxMuxers = 64;
+
+    FrameSource source;
+    if(fixture.empty()) {
+        source.synthesize(1920, 1080, 30, 12000000);
+    } else if(!source.load(fixture)) {
+        fprintf(stderr, "No frames in %s\n", fixture.c_str());
+        return 1;
+    }
+
+    videoMuxerSetLogCallback(nullptr, VIDEO_MUXER_LOG_WARNING, nullptr);
+
+    std::vector<Round> rounds;
+    std::vector<int> counts;
+    for(int n = 1; n < maxMuxers; n *= 2) counts.push_back(n);
+    counts.push_back(maxMuxers);
+
+    // The first round starts the process wide threads (logger, background
+    // worker), later rounds are held to what it left behind.
+    int baselineThreads = 0;
+    long baselineRssKb = 0;
+    double bestFps = 0;
+    bool failed = false;
+    for(int n : counts) {
+        Round round = runRound(n, seconds, source.frames(), outDir, baselineThreads);
+        if(rounds.empty()) {
+            baselineThreads = round.threadsAfter;
+            baselineRssKb = round.rssAfterKb;
+        }
+
+        double fps = round.seconds > 0 ? round.frames / round.seconds : 0;
+        if(baselineRssKb > 0 && round.rssAfterKb - baselineRssKb > maxRssGrowthKb) {
+            round.failures.push_back("resident size grew " + std::to_string((round.rssAfterKb - baselineRssKb) / 1024) + " MB");
+        }
+        if(bestFps > 0 && fps < bestFps * minScaling) {
+            round.failures.push_back("throughput collapsed to " + std::to_string(int(fps)) + " fps");
+        }
+        bestFps = std::max(bestFps, fps);
+
+        printf("%3d muxers %10.1f fps total %8.1f fps each %5d threads peak %5d after %8ld KB rss %s\n",
+               n, fps, fps / n, round.peakThreads, round.threadsAfter, round.rssAfterKb,
+               round.failures.empty() ? "ok" : "FAILED");
+        for(auto &failure : round.failures) {
+            printf("    %s\n", failure.c_str());
+        }
+        fflush(stdout);
+
+        failed = failed || !round.failures.empty();
+        rounds.push_back(round);
+    }
+
+    if(!jsonPath.empty()) {
+        FILE *file = fopen(jsonPath.c_str(), "w");
+        if(!file) {
+            fprintf(stderr, "Could not write %s\n", jsonPath.c_str());
+            return 1;
+        }
+        fprintf(file, "{\n  \"soak\": [\n");
+        for(size_t i = 0; i < rounds.size(); i ++) {
+            const Round &r = rounds[i];
+            fprintf(file, "    {\"muxers\": %d, \"ok\": %s, \"seconds\": %.3f, \"frames\": %lld, \"fps\": %.3f, "
+                    "\"peak_threads\": %d, \"threads_after\": %d, \"rss_after_kb\": %ld, \"invalid_files\": %d}%s\n",
+                    r.muxers, r.failures.empty() ? "true" : "false", r.seconds, (long long)r.frames,
+                    r.seconds > 0 ? r.frames / r.seconds : 0, r.peakThreads, r.threadsAfter,
+                    r.rssAfterKb, r.invalidFiles, i + 1 < rounds.size() ? "," : "");
+        }
+        fprintf(file, "  ]\n}\n");
+        fclose(file);
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,90 @@
+#include "background_worker.h"
+#include "logger.h"
+#include "tracer.h"
+
+#if defined(__APPLE__)
+#include <pthread.h>
+#include <sys/qos.h>
+#elif defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static void lowerThreadPriority() {
+#if defined(__APPLE__)
+    pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0);
+#elif defined(__linux__)
+    // The nice value is per thread on Linux and Android.
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+#endif
+}
+
+namespace vcamshare {
+
+    BackgroundWorker &BackgroundWorker::shared() {
+        // Constructed first so it outlives the worker and its last tasks can still log.
+        Logger::shared();
+        static BackgroundWorker worker;
+        return worker;
+    }
+
+    BackgroundWorker &BackgroundWorker::events() {
+        Logger::shared();
+        static BackgroundWorker worker("events");
+        return worker;
+    }
+
+    BackgroundWorker::BackgroundWorker(const char *name) {
+        mStopThread = false;
+        mRunning = false;
+        mThread = std::thread([this, name] () {
+            lowerThreadPriority();
+            VCAM_TRACE_THREAD_NAME(name);
+
+            while(true) {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> l(mMutx);
+                    mCv.wait(l, [this] () { return !mTasks.empty() || mStopThread; });
+                    if(mStopThread) break;
+
+                    task = std::move(mTasks.front());
+                    mTasks.pop();
+                    mRunning = true;
+                }
+
+                task();
+
+                {
+                    std::unique_lock<std::mutex> l(mMutx);
+                    mRunning = false;
+                    mCv.notify_all();
+                }
+            }
+        });
+    }
+
+    BackgroundWorker::~BackgroundWorker() {
+        {
+            std::unique_lock<std::mutex> l(mMutx);
+            mStopThread = true;
+            mCv.notify_all();
+        }
+
+        if(mThread.joinable()) {
+            mThread.join();
+        }
+    }
+
+    void BackgroundWorker::post(std::function<void()> task) {
+        std::unique_lock<std::mutex> l(mMutx);
+        mTasks.push(std::move(task));
+        mCv.notify_all();
+    }
+
+    void BackgroundWorker::drain() {
+        std::unique_lock<std::mutex> l(mMutx);
+        mCv.wait(l, [this] () { return (mTasks.empty() && !mRunning) || mStopThread; });
+    }
+}
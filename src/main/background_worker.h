@@ -0,0 +1,40 @@
+#ifndef VXMT_VCAM_SHARE_BACKGROUND_WORKER
+#define VXMT_VCAM_SHARE_BACKGROUND_WORKER
+
+#include <functional>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace vcamshare {
+
+    // A single low priority thread for work that must not compete with the
+    // capture and muxing threads, e.g. post-processing finished files.
+    // Tasks run in the order they are posted.
+    class BackgroundWorker {
+    public:
+        static BackgroundWorker &shared();
+        // Only delivers the event callbacks, so they aren't held up behind
+        // the post-processing on the shared worker.
+        static BackgroundWorker &events();
+
+        // The name shows in traces.
+        explicit BackgroundWorker(const char *name = "background");
+        ~BackgroundWorker();
+
+        void post(std::function<void()> task);
+        // Blocks until every task posted so far has run.
+        void drain();
+
+    private:
+        std::queue<std::function<void()>> mTasks;
+        std::thread mThread;
+        bool mStopThread;
+        bool mRunning;
+        std::condition_variable mCv;
+        std::mutex mMutx;
+    };
+}
+
+#endif
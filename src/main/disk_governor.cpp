@@ -0,0 +1,196 @@
+#include "disk_governor.h"
+#include "logger.h"
+#include "tracer.h"
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+// Another muxer's file changed this recently may still be written or finalized.
+static constexpr int RECENT_SECONDS = 60;
+// Weight of the newest sample in the bitrate estimate.
+static constexpr double RATE_SMOOTHING = 0.3;
+
+static bool isRecording(const std::string &name) {
+    static const char *const EXTENSIONS[] = { ".mp4", ".mov", ".ts" };
+    for(const char *ext : EXTENSIONS) {
+        size_t len = strlen(ext);
+        if(name.size() > len && name.compare(name.size() - len, len, ext) == 0) return true;
+    }
+    return false;
+}
+
+namespace vcamshare {
+
+    DiskGovernor::Options::Options() {
+        floorBytes = 200 << 20;
+        warnSeconds = 300;
+        sampleMs = 2000;
+    }
+
+    DiskGovernor::DiskGovernor(const std::string &path, const Options &options,
+                               std::shared_ptr<IoBackend> backend,
+                               std::function<uint64_t()> bytesOut) {
+        mPath = path;
+        size_t slash = path.find_last_of('/');
+        mDir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        mOptions = options;
+        mBackend = backend ? backend : IoBackend::system();
+        mBytesOut = bytesOut;
+        mLastBytes = 0;
+        mLastSample = std::chrono::steady_clock::now();
+        mBytesPerSecond = 0;
+        mLastWarning = -1;
+        mFloorReached = false;
+        mFreeBytes = -1;
+        mSecondsLeft = -1;
+        mStopThread = false;
+    }
+
+    DiskGovernor::~DiskGovernor() {
+        stop();
+    }
+
+    void DiskGovernor::setOpenFiles(std::function<std::vector<std::string>()> openFiles) {
+        mOpenFiles = openFiles;
+    }
+
+    void DiskGovernor::start(std::function<void(int64_t)> onLowDisk, std::function<void()> onFloor) {
+        if(mThread.joinable()) return;
+
+        mOnLowDisk = onLowDisk;
+        mOnFloor = onFloor;
+        mStopThread = false;
+        mThread = std::thread([this] () {
+            VCAM_TRACE_THREAD_NAME("disk_governor");
+            std::unique_lock<std::mutex> l(mMutx);
+            while(!mStopThread) {
+                l.unlock();
+                sample();
+                l.lock();
+                mCv.wait_for(l, std::chrono::milliseconds(mOptions.sampleMs), [this] () { return mStopThread; });
+            }
+        });
+    }
+
+    void DiskGovernor::stop() {
+        {
+            std::unique_lock<std::mutex> l(mMutx);
+            mStopThread = true;
+            mCv.notify_all();
+        }
+        if(mThread.joinable()) {
+            mThread.join();
+        }
+    }
+
+    int64_t DiskGovernor::freeBytes() {
+        return mFreeBytes;
+    }
+
+    int64_t DiskGovernor::secondsLeft() {
+        return mSecondsLeft;
+    }
+
+    void DiskGovernor::sample() {
+        auto now = std::chrono::steady_clock::now();
+        uint64_t bytes = mBytesOut ? mBytesOut() : 0;
+        double elapsed = std::chrono::duration<double>(now - mLastSample).count();
+        if(elapsed > 0 && bytes >= mLastBytes) {
+            double rate = (bytes - mLastBytes) / elapsed;
+            if(mBytesPerSecond > 0) {
+                mBytesPerSecond += (rate - mBytesPerSecond) * RATE_SMOOTHING;
+            } else {
+                mBytesPerSecond = rate;
+            }
+        }
+        mLastBytes = bytes;
+        mLastSample = now;
+        if(mFloorReached) return;
+
+        int64_t free = mBackend->freeSpace(mDir);
+        if(free >= 0 && free <= mOptions.floorBytes && !mOptions.reclaimDir.empty()) {
+            reclaim(mOptions.floorBytes * 2);
+            free = mBackend->freeSpace(mDir);
+        }
+        mFreeBytes = free;
+        if(free < 0) return;
+
+        if(free <= mOptions.floorBytes) {
+            mFloorReached = true;
+            mSecondsLeft = 0;
+            logWarning("Only %lld bytes left on %s, finalizing the recording", (long long)free, mDir.c_str());
+            if(mOnLowDisk) mOnLowDisk(0);
+            if(mOnFloor) mOnFloor();
+            return;
+        }
+
+        int64_t left = mBytesPerSecond > 0 ? int64_t((free - mOptions.floorBytes) / mBytesPerSecond) : -1;
+        mSecondsLeft = left;
+        if(left < 0 || left >= mOptions.warnSeconds) {
+            mLastWarning = -1;
+            return;
+        }
+        if(mLastWarning < 0 || (left <= mLastWarning / 2 && left < mLastWarning)) {
+            mLastWarning = left;
+            logWarning("About %llds of recording left on %s", (long long)left, mDir.c_str());
+            if(mOnLowDisk) mOnLowDisk(left);
+        }
+    }
+
+    int64_t DiskGovernor::reclaim(int64_t freeBytes) {
+        if(mOptions.reclaimDir.empty()) return 0;
+
+        DIR *dir = opendir(mOptions.reclaimDir.c_str());
+        if(!dir) return 0;
+
+        // Told apart by inode, the paths may be spelled differently. A
+        // paused or slow recording can leave its file untouched for long.
+        std::vector<std::pair<dev_t, ino_t>> recording;
+        std::vector<std::string> open;
+        if(mOpenFiles) open = mOpenFiles();
+        open.push_back(mPath);
+        for(auto &path : open) {
+            struct stat st;
+            if(stat(path.c_str(), &st) == 0) recording.push_back(std::make_pair(st.st_dev, st.st_ino));
+        }
+
+        struct Candidate {
+            std::string path;
+            time_t mtime;
+            int64_t size;
+        };
+        std::vector<Candidate> candidates;
+        time_t recent = time(nullptr) - RECENT_SECONDS;
+        while(struct dirent *entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if(!isRecording(name)) continue;
+
+            std::string path = mOptions.reclaimDir + "/" + name;
+            struct stat st;
+            if(stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+            if(std::find(recording.begin(), recording.end(), std::make_pair(st.st_dev, st.st_ino)) != recording.end()) continue;
+            if(st.st_mtime > recent) continue;
+            struct stat keep;
+            if(stat((path + ".keep").c_str(), &keep) == 0) continue;
+            candidates.push_back(Candidate{ path, st.st_mtime, int64_t(st.st_size) });
+        }
+        closedir(dir);
+
+        std::sort(candidates.begin(), candidates.end(), [] (const Candidate &a, const Candidate &b) {
+            return a.mtime < b.mtime;
+        });
+
+        int64_t freed = 0;
+        for(auto &candidate : candidates) {
+            if(mBackend->freeSpace(mDir) >= freeBytes) break;
+            if(mBackend->remove(candidate.path) == 0) {
+                logInfo("Deleted %s to make room for the recording", candidate.path.c_str());
+                freed += candidate.size;
+            }
+        }
+        return freed;
+    }
+}
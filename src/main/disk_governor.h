@@ -0,0 +1,92 @@
+#ifndef VXMT_VCAM_SHARE_DISK_GOVERNOR
+#define VXMT_VCAM_SHARE_DISK_GOVERNOR
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+
+#include "io_backend.h"
+
+namespace vcamshare {
+
+    // Watches the free space under a recording on a thread of its own, so
+    // the muxer never waits on statvfs. The time left is predicted from the
+    // rate the recording grows at. Below warnSeconds it warns, again each
+    // time the prediction halves. At floorBytes it first deletes the oldest
+    // recordings in reclaimDir until twice the floor is free, and when that
+    // isn't enough asks for the recording to be finalized while the floor
+    // still leaves room for its trailer.
+    class DiskGovernor {
+    public:
+        struct Options {
+            int64_t floorBytes;
+            int warnSeconds;
+            int sampleMs;
+            // Empty never deletes anything. Only .mp4, .mov and .ts files
+            // are candidates. A file is kept when a <name>.keep file sits
+            // next to it or the recording is writing it. Any other file
+            // changed within the last minute is kept too, it may belong to
+            // another muxer.
+            std::string reclaimDir;
+            Options();
+        };
+
+        // bytesOut gives what the recording has written so far.
+        DiskGovernor(const std::string &path, const Options &options,
+                     std::shared_ptr<IoBackend> backend,
+                     std::function<uint64_t()> bytesOut);
+        ~DiskGovernor();
+
+        // The files the recording has open besides path, such as its
+        // current rotated segment. Called on the governor thread.
+        void setOpenFiles(std::function<std::vector<std::string>()> openFiles);
+
+        // onLowDisk gets the predicted seconds left, 0 right before
+        // onFloor. Both are called on the governor thread, onFloor once.
+        void start(std::function<void(int64_t)> onLowDisk, std::function<void()> onFloor);
+        void stop();
+
+        // One round of what the thread does, for the tests.
+        void sample();
+        // Deletes candidates oldest first until freeBytes is free. Returns
+        // the bytes freed.
+        int64_t reclaim(int64_t freeBytes);
+
+        int64_t freeBytes();
+        // -1 until the rate is known.
+        int64_t secondsLeft();
+
+    private:
+        std::string mPath;
+        std::string mDir;
+        Options mOptions;
+        std::shared_ptr<IoBackend> mBackend;
+        std::function<uint64_t()> mBytesOut;
+        std::function<std::vector<std::string>()> mOpenFiles;
+        std::function<void(int64_t)> mOnLowDisk;
+        std::function<void()> mOnFloor;
+
+        // Only touched by sample().
+        uint64_t mLastBytes;
+        std::chrono::steady_clock::time_point mLastSample;
+        double mBytesPerSecond;
+        int64_t mLastWarning;
+        bool mFloorReached;
+
+        std::atomic<int64_t> mFreeBytes;
+        std::atomic<int64_t> mSecondsLeft;
+
+        std::thread mThread;
+        bool mStopThread;
+        std::condition_variable mCv;
+        std::mutex mMutx;
+    };
+}
+
+#endif
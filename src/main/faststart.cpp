@@ -0,0 +1,318 @@
+#include "faststart.h"
+#include "logger.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <vector>
+
+static constexpr int COPY_BUFFER_SIZE = 1 << 20;
+static constexpr int64_t MAX_MOOV_SIZE = 256 << 20;
+
+static constexpr uint32_t fourcc(const char s[5]) {
+    return (uint32_t(uint8_t(s[0])) << 24) | (uint32_t(uint8_t(s[1])) << 16)
+        | (uint32_t(uint8_t(s[2])) << 8) | uint32_t(uint8_t(s[3]));
+}
+
+static uint32_t readBE32(const uint8_t *p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+static uint64_t readBE64(const uint8_t *p) {
+    return (uint64_t(readBE32(p)) << 32) | readBE32(p + 4);
+}
+
+static void appendBE32(std::vector<uint8_t> &out, uint32_t v) {
+    out.push_back(v >> 24);
+    out.push_back(v >> 16);
+    out.push_back(v >> 8);
+    out.push_back(v);
+}
+
+static void appendBE64(std::vector<uint8_t> &out, uint64_t v) {
+    appendBE32(out, v >> 32);
+    appendBE32(out, v);
+}
+
+static void writeBE32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+namespace {
+    struct Atom {
+        uint32_t type;
+        int64_t offset;
+        int64_t size;
+    };
+
+    // Where the media data ends up once the moov has moved.
+    struct Relocation {
+        int64_t mdatStart;
+        int64_t moovStart, moovEnd;
+        int64_t newMoovSize;
+
+        uint64_t map(uint64_t offset) const {
+            if (offset >= (uint64_t)moovEnd) return offset + newMoovSize - (moovEnd - moovStart);
+            if (offset >= (uint64_t)mdatStart) return offset + newMoovSize;
+            return offset;
+        }
+    };
+}
+
+static bool readAtoms(int fd, int64_t fileSize, std::vector<Atom> &atoms) {
+    int64_t pos = 0;
+    while (pos + 8 <= fileSize) {
+        uint8_t h[16];
+        if (pread(fd, h, 8, pos) != 8) return false;
+
+        int64_t size = readBE32(h);
+        uint32_t type = readBE32(h + 4);
+        if (size == 1) {
+            if (pread(fd, h + 8, 8, pos + 8) != 8) return false;
+            size = readBE64(h + 8);
+        } else if (size == 0) {
+            size = fileSize - pos;
+        }
+
+        if (size < 8 || pos + size > fileSize) return false;
+        atoms.push_back({ type, pos, size });
+        pos += size;
+    }
+    return true;
+}
+
+static bool isContainer(uint32_t type) {
+    return type == fourcc("moov") || type == fourcc("trak") || type == fourcc("mdia")
+        || type == fourcc("minf") || type == fourcc("stbl");
+}
+
+// Copies the atoms in data to out with relocated chunk offsets. stco tables
+// are widened to co64 when toCo64 is set. maxStco receives the largest
+// relocated stco offset so the caller can tell whether 32 bits still fit.
+static bool rewriteAtoms(const uint8_t *data, int64_t len, const Relocation &reloc, bool toCo64,
+                        std::vector<uint8_t> &out, uint64_t &maxStco) {
+    int64_t pos = 0;
+    while (pos + 8 <= len) {
+        const uint8_t *atom = data + pos;
+        int64_t size = readBE32(atom);
+        uint32_t type = readBE32(atom + 4);
+        int header = 8;
+        if (size == 1) {
+            if (pos + 16 > len) return false;
+            size = readBE64(atom + 8);
+            header = 16;
+        } else if (size == 0) {
+            size = len - pos;
+        }
+        if (size < header || pos + size > len) return false;
+
+        if (isContainer(type)) {
+            size_t start = out.size();
+            appendBE32(out, 1);
+            appendBE32(out, type);
+            appendBE64(out, 0);
+            if (!rewriteAtoms(atom + header, size - header, reloc, toCo64, out, maxStco)) return false;
+
+            // Use the short header again when the size allows it.
+            uint64_t newSize = out.size() - start;
+            if (newSize - 8 <= UINT32_MAX) {
+                out.erase(out.begin() + start + 8, out.begin() + start + 16);
+                writeBE32(&out[start], newSize - 8);
+            } else {
+                for (int i = 0; i < 8; i ++) {
+                    out[start + 8 + i] = newSize >> (56 - 8 * i);
+                }
+            }
+        } else if (type == fourcc("stco") || type == fourcc("co64")) {
+            if (size < header + 8) return false;
+            const uint8_t *body = atom + header;
+            uint32_t count = readBE32(body + 4);
+            int entrySize = type == fourcc("stco") ? 4 : 8;
+            if (header + 8 + int64_t(count) * entrySize > size) return false;
+
+            bool co64 = type == fourcc("co64") || toCo64;
+            appendBE32(out, 8 + 8 + count * (co64 ? 8 : 4));
+            appendBE32(out, co64 ? fourcc("co64") : fourcc("stco"));
+            out.insert(out.end(), body, body + 8);
+
+            const uint8_t *entry = body + 8;
+            for (uint32_t i = 0; i < count; i ++, entry += entrySize) {
+                uint64_t offset = reloc.map(entrySize == 4 ? readBE32(entry) : readBE64(entry));
+                if (co64) {
+                    appendBE64(out, offset);
+                } else {
+                    if (offset > maxStco) maxStco = offset;
+                    appendBE32(out, offset);
+                }
+            }
+        } else {
+            out.insert(out.end(), atom, atom + size);
+        }
+        pos += size;
+    }
+    return true;
+}
+
+static bool writeAll(int fd, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+namespace vcamshare {
+
+    bool faststartFile(const std::string &filePath, std::function<void(float)> progress) {
+        int in = open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in < 0) {
+            logError("faststart: failed to open %s", filePath.c_str());
+            return false;
+        }
+
+        struct stat st;
+        std::vector<Atom> atoms;
+        if (fstat(in, &st) != 0 || !readAtoms(in, st.st_size, atoms)) {
+            logError("faststart: not a valid mp4 file %s", filePath.c_str());
+            ::close(in);
+            return false;
+        }
+
+        int moovIdx = -1, mdatIdx = -1;
+        for (size_t i = 0; i < atoms.size(); i ++) {
+            if (atoms[i].type == fourcc("moov") && moovIdx < 0) moovIdx = i;
+            if (atoms[i].type == fourcc("mdat") && mdatIdx < 0) mdatIdx = i;
+        }
+
+        if (moovIdx < 0 || mdatIdx < 0 || moovIdx < mdatIdx) {
+            ::close(in);
+            if (moovIdx < 0) {
+                logError("faststart: no moov in %s", filePath.c_str());
+                return false;
+            }
+            if (progress) progress(1.0f);
+            return true;
+        }
+
+        const Atom &moov = atoms[moovIdx];
+        if (moov.size > MAX_MOOV_SIZE) {
+            logError("faststart: moov too large %lld", (long long)moov.size);
+            ::close(in);
+            return false;
+        }
+
+        std::vector<uint8_t> oldMoov(moov.size);
+        if (pread(in, oldMoov.data(), moov.size, moov.offset) != moov.size) {
+            ::close(in);
+            return false;
+        }
+
+        // The new moov size doesn't depend on the offsets, only on whether
+        // the stco tables have to become co64.
+        Relocation reloc { atoms[mdatIdx].offset, moov.offset, moov.offset + moov.size, 0 };
+        std::vector<uint8_t> newMoov;
+        uint64_t maxStco = 0;
+        bool toCo64 = false;
+        bool ok = rewriteAtoms(oldMoov.data(), oldMoov.size(), reloc, toCo64, newMoov, maxStco);
+        if (ok) {
+            reloc.newMoovSize = newMoov.size();
+            newMoov.clear();
+            maxStco = 0;
+            ok = rewriteAtoms(oldMoov.data(), oldMoov.size(), reloc, toCo64, newMoov, maxStco);
+        }
+        if (ok && maxStco > UINT32_MAX) {
+            toCo64 = true;
+            reloc.newMoovSize = 0;
+            newMoov.clear();
+            ok = rewriteAtoms(oldMoov.data(), oldMoov.size(), reloc, toCo64, newMoov, maxStco);
+            reloc.newMoovSize = newMoov.size();
+            newMoov.clear();
+            ok = ok && rewriteAtoms(oldMoov.data(), oldMoov.size(), reloc, toCo64, newMoov, maxStco);
+        }
+        oldMoov.clear();
+        oldMoov.shrink_to_fit();
+
+        if (!ok) {
+            logError("faststart: malformed moov in %s", filePath.c_str());
+            ::close(in);
+            return false;
+        }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+        std::string tmpPath = filePath + ".faststart";
+        int out = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out < 0) {
+            logError("faststart: failed to create %s", tmpPath.c_str());
+            ::close(in);
+            return false;
+        }
+
+        int64_t total = st.st_size - moov.size + newMoov.size();
+        int64_t done = 0;
+        int lastPercent = -1;
+        std::vector<uint8_t> buffer(COPY_BUFFER_SIZE);
+
+        auto report = [&] () {
+            int percent = total > 0 ? int(done * 100 / total) : 100;
+            if (progress && percent != lastPercent) {
+                lastPercent = percent;
+                progress(percent / 100.0f);
+            }
+        };
+
+        auto copyRange = [&] (int64_t from, int64_t len) {
+            while (len > 0) {
+                ssize_t n = pread(in, buffer.data(), std::min<int64_t>(len, buffer.size()), from);
+                if (n <= 0) {
+                    if (n < 0 && errno == EINTR) continue;
+                    return false;
+                }
+                if (!writeAll(out, buffer.data(), n)) return false;
+                from += n;
+                len -= n;
+                done += n;
+                report();
+            }
+            return true;
+        };
+
+        // Everything in front of the first mdat stays in place, then comes the
+        // moov, then the rest without the old moov.
+        ok = copyRange(0, atoms[mdatIdx].offset);
+        if (ok) {
+            ok = writeAll(out, newMoov.data(), newMoov.size());
+            done += newMoov.size();
+        }
+        if (ok) ok = copyRange(atoms[mdatIdx].offset, moov.offset - atoms[mdatIdx].offset);
+        if (ok) ok = copyRange(moov.offset + moov.size, st.st_size - moov.offset - moov.size);
+        if (ok) ok = fsync(out) == 0;
+
+        ::close(in);
+        ok = ::close(out) == 0 && ok;
+
+        if (ok && rename(tmpPath.c_str(), filePath.c_str()) != 0) {
+            ok = false;
+        }
+        if (!ok) {
+            logError("faststart: failed to rewrite %s: %s", filePath.c_str(), strerror(errno));
+            unlink(tmpPath.c_str());
+            return false;
+        }
+
+        report();
+        return true;
+    }
+}
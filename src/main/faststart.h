@@ -0,0 +1,18 @@
+#ifndef VXMT_VCAM_SHARE_FASTSTART
+#define VXMT_VCAM_SHARE_FASTSTART
+
+#include <string>
+#include <functional>
+
+namespace vcamshare {
+
+    // Moves the moov atom of an mp4 file in front of the media data so that
+    // playback can start before the whole file is downloaded. The chunk
+    // offsets in stco/co64 are patched and the file is rewritten through a
+    // temporary copy with a fixed size buffer, only the moov is kept in memory.
+    // progress receives values in [0, 1]. Files already in faststart layout
+    // are left untouched.
+    bool faststartFile(const std::string &filePath, std::function<void(float)> progress);
+}
+
+#endif
@@ -0,0 +1,413 @@
+#include "file_writer.h"
+#include "logger.h"
+#include "tracer.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/mem.h>
+#include <libavutil/error.h>
+}
+
+// The AVIOContext only needs a small staging buffer, the real batching
+// happens in the FileWriter buffers.
+static constexpr int AVIO_BUFFER_SIZE = 64 * 1024;
+static constexpr size_t BUFFER_ALIGNMENT = 4096;
+
+// Preallocation runs this far ahead of the write position, sized from the
+// observed bitrate.
+static constexpr int PREALLOC_SECONDS = 10;
+static constexpr int64_t PREALLOC_MIN_CHUNK = 8 << 20;
+static constexpr int64_t PREALLOC_MAX_CHUNK = 256 << 20;
+
+namespace vcamshare {
+
+    FileWriter::FileWriter(int bufferSize) {
+        size_t size = bufferSize > 0 ? bufferSize : DEFAULT_BUFFER_SIZE;
+        mBufferSize = (size + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+        mBackend = IoBackend::system();
+        mFd = -1;
+        mSize = 0;
+        mAvio = nullptr;
+        for(auto &buffer : mBuffers) {
+            buffer.data = nullptr;
+            buffer.len = 0;
+            buffer.offset = 0;
+            buffer.sync = false;
+            buffer.frameId = -1;
+        }
+        mTraceFrame = -1;
+        mActive = &mBuffers[0];
+        mPending = nullptr;
+        mStopIOThread = false;
+
+        mPreallocate = false;
+        mAllocated = 0;
+        mSyncPolicy = SyncPolicy::None;
+        mSyncBytes = 0;
+        mBytesSinceSync = 0;
+
+        mErrno = 0;
+        mBytesWritten = 0;
+        mWriteCount = 0;
+        mMinWriteSize = 0;
+        mMaxWriteSize = 0;
+        mTotalFlushLatencyUs = 0;
+        mMaxFlushLatencyUs = 0;
+        mBytesPreallocated = 0;
+        mSyncCount = 0;
+        mMaxSyncLatencyUs = 0;
+    }
+
+    FileWriter::~FileWriter() {
+        close();
+    }
+
+    void FileWriter::setPreallocate(bool preallocate) {
+        mPreallocate = preallocate;
+    }
+
+    void FileWriter::setSyncPolicy(SyncPolicy policy, int64_t syncBytes) {
+        mSyncPolicy = policy;
+        mSyncBytes = syncBytes;
+        if(mSyncPolicy == SyncPolicy::Bytes && mSyncBytes <= 0) {
+            mSyncPolicy = SyncPolicy::None;
+        }
+    }
+
+    void FileWriter::setIoBackend(std::shared_ptr<IoBackend> backend) {
+        mBackend = backend ? backend : IoBackend::system();
+    }
+
+    void FileWriter::setLatencyCallback(LatencyCallback callback) {
+        std::unique_lock<std::mutex> l(mMutx);
+        mLatencyCallback = callback;
+        if(!mLatencyCallback) mIngestMarks.clear();
+    }
+
+    void FileWriter::markIngest(int64_t ingestUs) {
+        if(!mAvio) return;
+
+        int64_t position = avio_tell(mAvio);
+        std::unique_lock<std::mutex> l(mMutx);
+        if(mLatencyCallback) {
+            mIngestMarks.push_back(std::make_pair(position, ingestUs));
+        }
+    }
+
+    bool FileWriter::open(const std::string &filePath) {
+        if(mFd >= 0) return false;
+
+        mFd = mBackend->open(filePath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(mFd < 0) {
+            logError("Failed to open %s: %s", filePath.c_str(), strerror(errno));
+            return false;
+        }
+
+        for(auto &buffer : mBuffers) {
+            void *data = nullptr;
+            if(posix_memalign(&data, BUFFER_ALIGNMENT, mBufferSize) != 0) {
+                logError("Failed to allocate the file buffer.");
+                return false;
+            }
+            buffer.data = static_cast<uint8_t *>(data);
+        }
+
+        uint8_t *avioBuffer = static_cast<uint8_t *>(av_malloc(AVIO_BUFFER_SIZE));
+        if(!avioBuffer) {
+            return false;
+        }
+        mAvio = avio_alloc_context(avioBuffer, AVIO_BUFFER_SIZE, 1, this, nullptr, writePacket, seek);
+        if(!mAvio) {
+            av_free(avioBuffer);
+            return false;
+        }
+
+        mOpenTime = std::chrono::steady_clock::now();
+
+        mStopIOThread = false;
+        mIOThread = std::thread([this] () {
+            VCAM_TRACE_THREAD_NAME("file_io");
+            while(true) {
+                Buffer *buffer = nullptr;
+                {
+                    std::unique_lock<std::mutex> l(mMutx);
+                    mCv.wait(l, [this] () { return mPending != nullptr || mStopIOThread; });
+                    if(!mPending) break;
+                    buffer = mPending;
+                }
+
+                writeBuffer(buffer);
+
+                {
+                    std::unique_lock<std::mutex> l(mMutx);
+                    buffer->len = 0;
+                    mPending = nullptr;
+                    mCv.notify_all();
+                }
+            }
+        });
+
+        return true;
+    }
+
+    bool FileWriter::close() {
+        if(mAvio) {
+            avio_flush(mAvio);
+        }
+
+        if(mIOThread.joinable()) {
+            waitIdle();
+            {
+                std::unique_lock<std::mutex> l(mMutx);
+                mStopIOThread = true;
+                mCv.notify_all();
+            }
+            mIOThread.join();
+        }
+
+        if(mFd >= 0) {
+            // Give back what was preallocated past the end.
+            if(mAllocated > mSize && mBackend->truncate(mFd, mSize) != 0 && mErrno == 0) {
+                mErrno = errno;
+            }
+            if(mSyncPolicy != SyncPolicy::None && mErrno == 0) {
+                sync();
+            }
+            if(mBackend->close(mFd) != 0 && mErrno == 0) {
+                mErrno = errno;
+            }
+            mFd = -1;
+        }
+
+        if(mAvio) {
+            av_freep(&mAvio->buffer);
+            avio_context_free(&mAvio);
+        }
+
+        for(auto &buffer : mBuffers) {
+            free(buffer.data);
+            buffer.data = nullptr;
+            buffer.len = 0;
+        }
+
+        {
+            // What a failed write left behind never reaches the disk.
+            std::unique_lock<std::mutex> l(mMutx);
+            mIngestMarks.clear();
+        }
+
+        return mErrno == 0;
+    }
+
+    AVIOContext *FileWriter::avioContext() {
+        return mAvio;
+    }
+
+    bool FileWriter::hasError() {
+        return mErrno != 0;
+    }
+
+    FileWriter::Stats FileWriter::stats() {
+        Stats s;
+        s.bytesWritten = mBytesWritten;
+        s.writeCount = mWriteCount;
+        s.minWriteSize = mMinWriteSize;
+        s.maxWriteSize = mMaxWriteSize;
+        s.totalFlushLatencyUs = mTotalFlushLatencyUs;
+        s.maxFlushLatencyUs = mMaxFlushLatencyUs;
+        s.bytesPreallocated = mBytesPreallocated;
+        s.syncCount = mSyncCount;
+        s.maxSyncLatencyUs = mMaxSyncLatencyUs;
+        return s;
+    }
+
+    // Hands the active buffer over to the I/O thread, waiting for the previous
+    // one to be written first. Called from the muxing thread only.
+    void FileWriter::submit() {
+        if(mActive->len == 0) return;
+
+        std::unique_lock<std::mutex> l(mMutx);
+        mCv.wait(l, [this] () { return mPending == nullptr; });
+
+        Buffer *next = mActive == &mBuffers[0] ? &mBuffers[1] : &mBuffers[0];
+        next->offset = mActive->offset + mActive->len;
+        next->len = 0;
+        next->sync = false;
+
+        mActive->frameId = mTraceFrame;
+        mPending = mActive;
+        mActive = next;
+        mCv.notify_all();
+    }
+
+    void FileWriter::waitIdle() {
+        submit();
+
+        std::unique_lock<std::mutex> l(mMutx);
+        mCv.wait(l, [this] () { return mPending == nullptr; });
+    }
+
+    bool FileWriter::writeBuffer(Buffer *buffer) {
+        if(mErrno != 0) return false;
+
+        if(mPreallocate) {
+            preallocate(buffer->offset + buffer->len);
+        }
+
+        VCAM_TRACE_SCOPE("pwrite", buffer->frameId);
+        auto start = std::chrono::steady_clock::now();
+
+        size_t done = 0;
+        while(done < buffer->len) {
+            ssize_t n = mBackend->pwrite(mFd, buffer->data + done, buffer->len - done, buffer->offset + done);
+            if(n < 0) {
+                if(errno == EINTR) continue;
+                mErrno = errno;
+                logError("Failed to write file: %s", strerror(errno));
+                return false;
+            }
+            done += n;
+        }
+
+        uint64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+
+        // Only the I/O thread updates the counters.
+        uint64_t size = buffer->len;
+        mBytesWritten += size;
+        mWriteCount ++;
+        if(mMinWriteSize == 0 || size < mMinWriteSize) mMinWriteSize = size;
+        if(size > mMaxWriteSize) mMaxWriteSize = size;
+        mTotalFlushLatencyUs += latency;
+        if(latency > mMaxFlushLatencyUs) mMaxFlushLatencyUs = latency;
+
+        mBytesSinceSync += size;
+        if((mSyncPolicy == SyncPolicy::Fragment && buffer->sync)
+            || (mSyncPolicy == SyncPolicy::Bytes && mBytesSinceSync >= mSyncBytes)) {
+            sync();
+        }
+        reportLatency(buffer->offset + buffer->len);
+        return true;
+    }
+
+    // The muxer appends, so a buffer ending at or past a mark covers it. The
+    // small writes seeking back to patch a header end before any open mark.
+    void FileWriter::reportLatency(int64_t end) {
+        std::unique_lock<std::mutex> l(mMutx);
+        if(mIngestMarks.empty() || mIngestMarks.front().first > end) return;
+
+        int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        while(!mIngestMarks.empty() && mIngestMarks.front().first <= end) {
+            int64_t latency = now - mIngestMarks.front().second;
+            if(mLatencyCallback) mLatencyCallback(latency > 0 ? latency : 0);
+            mIngestMarks.pop_front();
+        }
+    }
+
+    void FileWriter::preallocate(int64_t end) {
+        // Keep at least half a chunk allocated ahead of the writes.
+        int64_t chunk = PREALLOC_MIN_CHUNK;
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - mOpenTime).count();
+        if(elapsed >= 1.0) {
+            int64_t bytesPerSecond = mBytesWritten / elapsed;
+            chunk = std::min(std::max(bytesPerSecond * PREALLOC_SECONDS, PREALLOC_MIN_CHUNK), PREALLOC_MAX_CHUNK);
+        }
+        if(end + chunk / 2 <= mAllocated) return;
+
+        int64_t from = std::max(mAllocated, end);
+        int err = mBackend->allocate(mFd, from, chunk);
+        if(err != 0) {
+            // Not fatal, the write itself reports a full disk.
+            logWarning("Failed to preallocate: %s", strerror(err));
+            mPreallocate = false;
+            return;
+        }
+        mAllocated = from + chunk;
+        mBytesPreallocated += chunk;
+    }
+
+    void FileWriter::sync() {
+        auto start = std::chrono::steady_clock::now();
+        if(mBackend->sync(mFd) != 0) {
+            logError("Failed to sync file: %s", strerror(errno));
+        }
+        uint64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+
+        mBytesSinceSync = 0;
+        mSyncCount ++;
+        if(latency > mMaxSyncLatencyUs) mMaxSyncLatencyUs = latency;
+    }
+
+    int FileWriter::writePacket(void *opaque, uint8_t *buf, int size) {
+        FileWriter *w = static_cast<FileWriter *>(opaque);
+        if(w->mErrno != 0) {
+            return AVERROR(w->mErrno);
+        }
+
+        int remain = size;
+        while(remain > 0) {
+            Buffer *active = w->mActive;
+            size_t n = w->mBufferSize - active->len;
+            if(n > (size_t)remain) n = remain;
+
+            memcpy(active->data + active->len, buf, n);
+            active->len += n;
+            buf += n;
+            remain -= n;
+
+            if(active->len == w->mBufferSize) {
+                w->submit();
+            }
+        }
+
+        int64_t end = w->mActive->offset + w->mActive->len;
+        if(end > w->mSize) w->mSize = end;
+        return size;
+    }
+
+    void FileWriter::setTraceFrame(int64_t frameId) {
+        mTraceFrame = frameId;
+    }
+
+    void FileWriter::markSyncPoint() {
+        if(mSyncPolicy != SyncPolicy::Fragment || !mAvio) return;
+
+        avio_flush(mAvio);
+        // An empty buffer keeps the flag for the next one.
+        mActive->sync = true;
+        submit();
+    }
+
+    int64_t FileWriter::seek(void *opaque, int64_t offset, int whence) {
+        FileWriter *w = static_cast<FileWriter *>(opaque);
+        int64_t pos = w->mActive->offset + w->mActive->len;
+
+        if(whence == AVSEEK_SIZE) {
+            return w->mSize;
+        }
+
+        int64_t target;
+        switch(whence & ~AVSEEK_FORCE) {
+            case SEEK_SET: target = offset; break;
+            case SEEK_CUR: target = pos + offset; break;
+            case SEEK_END: target = w->mSize + offset; break;
+            default: return AVERROR(EINVAL);
+        }
+
+        if(target < 0) return AVERROR(EINVAL);
+        if(target == pos) return pos;
+
+        // Buffers are contiguous, so a seek starts a new one.
+        w->submit();
+        w->mActive->offset = target;
+        return target;
+    }
+}
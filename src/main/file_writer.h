@@ -0,0 +1,141 @@
+#ifndef VXMT_VCAM_SHARE_FILE_WRITER
+#define VXMT_VCAM_SHARE_FILE_WRITER
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+
+#include "io_backend.h"
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+namespace vcamshare {
+
+    // Buffered output for the muxer. The AVIOContext returned by avioContext()
+    // copies muxed bytes into a large aligned buffer; full buffers are handed
+    // to an I/O thread which writes them with pwrite, so a slow flash write
+    // doesn't stall av_interleaved_write_frame until both buffers are busy.
+    class FileWriter {
+    public:
+        enum class SyncPolicy {
+            None,       // leave it to the kernel and close()
+            Bytes,      // fdatasync every syncBytes written
+            Fragment    // fdatasync at each sync point marked with markSyncPoint()
+        };
+
+        struct Stats {
+            uint64_t bytesWritten;
+            uint64_t writeCount;
+            uint64_t minWriteSize;
+            uint64_t maxWriteSize;
+            uint64_t totalFlushLatencyUs;
+            uint64_t maxFlushLatencyUs;
+            uint64_t bytesPreallocated;
+            uint64_t syncCount;
+            uint64_t maxSyncLatencyUs;
+        };
+
+        // Gets the time from a mark to the write of the buffer that holds it.
+        typedef std::function<void(uint64_t latencyUs)> LatencyCallback;
+
+        static constexpr int DEFAULT_BUFFER_SIZE = 1 << 20;
+
+        FileWriter(int bufferSize);
+        ~FileWriter();
+
+        // Both take effect on open().
+        void setPreallocate(bool preallocate);
+        void setSyncPolicy(SyncPolicy policy, int64_t syncBytes);
+        // Null goes back to the system calls. Takes effect on open() too.
+        void setIoBackend(std::shared_ptr<IoBackend> backend);
+        // Called on the I/O thread, can be changed or cleared at any time.
+        void setLatencyCallback(LatencyCallback callback);
+
+        // Marks the bytes written through the AVIOContext so far with the
+        // steady clock time in microseconds they came in at. Only kept while
+        // there is a latency callback.
+        void markIngest(int64_t ingestUs);
+
+        // Hands everything muxed so far to the I/O thread, which syncs it
+        // after the write. Does nothing unless the policy is Fragment.
+        void markSyncPoint();
+
+        // The frame id the buffers handed to the I/O thread from here on
+        // show with in the trace.
+        void setTraceFrame(int64_t frameId);
+
+        bool open(const std::string &filePath);
+        bool close();
+
+        AVIOContext *avioContext();
+        bool hasError();
+        Stats stats();
+
+    private:
+        struct Buffer {
+            uint8_t *data;
+            size_t len;
+            int64_t offset;
+            bool sync;
+            int64_t frameId;
+        };
+
+        static int writePacket(void *opaque, uint8_t *buf, int size);
+        static int64_t seek(void *opaque, int64_t offset, int whence);
+
+        void submit();
+        void waitIdle();
+        bool writeBuffer(Buffer *buffer);
+        void preallocate(int64_t end);
+        void sync();
+        void reportLatency(int64_t end);
+
+        std::shared_ptr<IoBackend> mBackend;
+        int mFd;
+        size_t mBufferSize;
+        Buffer mBuffers[2];
+        Buffer *mActive;
+        Buffer *mPending;
+        int64_t mSize;
+        int64_t mTraceFrame;
+
+        bool mPreallocate;
+        int64_t mAllocated;
+        SyncPolicy mSyncPolicy;
+        int64_t mSyncBytes;
+        int64_t mBytesSinceSync;
+        std::chrono::steady_clock::time_point mOpenTime;
+
+        AVIOContext *mAvio;
+
+        std::thread mIOThread;
+        bool mStopIOThread;
+        std::condition_variable mCv;
+        std::mutex mMutx;
+
+        // Write position and ingest time, guarded by mMutx.
+        std::deque<std::pair<int64_t, int64_t>> mIngestMarks;
+        LatencyCallback mLatencyCallback;
+
+        std::atomic<int> mErrno;
+        std::atomic<uint64_t> mBytesWritten;
+        std::atomic<uint64_t> mWriteCount;
+        std::atomic<uint64_t> mMinWriteSize;
+        std::atomic<uint64_t> mMaxWriteSize;
+        std::atomic<uint64_t> mTotalFlushLatencyUs;
+        std::atomic<uint64_t> mMaxFlushLatencyUs;
+        std::atomic<uint64_t> mBytesPreallocated;
+        std::atomic<uint64_t> mSyncCount;
+        std::atomic<uint64_t> mMaxSyncLatencyUs;
+    };
+}
+
+#endif
@@ -0,0 +1,69 @@
+#include "io_backend.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/statvfs.h>
+
+namespace vcamshare {
+
+    IoBackend::~IoBackend() {
+    }
+
+    std::shared_ptr<IoBackend> IoBackend::system() {
+        static std::shared_ptr<IoBackend> backend(new PosixIoBackend());
+        return backend;
+    }
+
+    int PosixIoBackend::open(const std::string &filePath, int flags, mode_t mode) {
+        return ::open(filePath.c_str(), flags, mode);
+    }
+
+    ssize_t PosixIoBackend::pwrite(int fd, const void *buf, size_t len, int64_t offset) {
+        return ::pwrite(fd, buf, len, offset);
+    }
+
+    int PosixIoBackend::allocate(int fd, int64_t offset, int64_t len) {
+#if defined(__APPLE__)
+        fstore_t store = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, len, 0 };
+        if (fcntl(fd, F_PREALLOCATE, &store) == -1) {
+            store.fst_flags = F_ALLOCATEALL;
+            if (fcntl(fd, F_PREALLOCATE, &store) == -1) {
+                return errno;
+            }
+        }
+        return 0;
+#elif defined(__linux__)
+        // Keep the size so a crash doesn't leave zeros at the end of the file.
+        return fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, len) == 0 ? 0 : errno;
+#else
+        return ENOTSUP;
+#endif
+    }
+
+    int PosixIoBackend::sync(int fd) {
+#ifdef __APPLE__
+        return fsync(fd);
+#else
+        return fdatasync(fd);
+#endif
+    }
+
+    int PosixIoBackend::truncate(int fd, int64_t size) {
+        return ftruncate(fd, size);
+    }
+
+    int PosixIoBackend::close(int fd) {
+        return ::close(fd);
+    }
+
+    int64_t PosixIoBackend::freeSpace(const std::string &path) {
+        struct statvfs st;
+        if (statvfs(path.c_str(), &st) != 0) return -1;
+        return int64_t(st.f_bavail) * st.f_frsize;
+    }
+
+    int PosixIoBackend::remove(const std::string &filePath) {
+        return ::remove(filePath.c_str());
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef VXMT_VCAM_SHARE_IO_BACKEND
+#define VXMT_VCAM_SHARE_IO_BACKEND
+
+#include <string>
+#include <memory>
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace vcamshare {
+
+    // The file operations a FileWriter needs, so the storage under a
+    // recording can be swapped for one that misbehaves on purpose. Each call
+    // returns what the system call does, -1 with errno set on failure,
+    // except allocate which returns the error itself. Calls come from the
+    // muxer and I/O threads of every writer sharing the backend.
+    class IoBackend {
+    public:
+        virtual ~IoBackend();
+
+        virtual int open(const std::string &filePath, int flags, mode_t mode) = 0;
+        // May write less than len, the caller carries on from there.
+        virtual ssize_t pwrite(int fd, const void *buf, size_t len, int64_t offset) = 0;
+        // Reserves [offset, offset + len) without changing the file size.
+        virtual int allocate(int fd, int64_t offset, int64_t len) = 0;
+        virtual int sync(int fd) = 0;
+        virtual int truncate(int fd, int64_t size) = 0;
+        virtual int close(int fd) = 0;
+        // Bytes an unprivileged writer can still use on the file system
+        // holding path, -1 if it can't be told.
+        virtual int64_t freeSpace(const std::string &path) = 0;
+        virtual int remove(const std::string &filePath) = 0;
+
+        // The plain system calls, used when no backend is set.
+        static std::shared_ptr<IoBackend> system();
+    };
+
+    class PosixIoBackend : public IoBackend {
+    public:
+        int open(const std::string &filePath, int flags, mode_t mode) override;
+        ssize_t pwrite(int fd, const void *buf, size_t len, int64_t offset) override;
+        int allocate(int fd, int64_t offset, int64_t len) override;
+        int sync(int fd) override;
+        int truncate(int fd, int64_t size) override;
+        int close(int fd) override;
+        int64_t freeSpace(const std::string &path) override;
+        int remove(const std::string &filePath) override;
+    };
+}
+
+#endif
@@ -0,0 +1,153 @@
+#include "logger.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <chrono>
+
+// Messages wait at most this long for the drain thread.
+static constexpr int DRAIN_INTERVAL_MS = 20;
+
+namespace vcamshare {
+
+    Logger &Logger::shared() {
+        static Logger logger;
+        return logger;
+    }
+
+    Logger::Logger() {
+        for(uint64_t i = 0; i < CAPACITY; i ++) {
+            mSlots[i].sequence = i;
+        }
+        mHead = 0;
+        mTail = 0;
+        mLevel = int(LogLevel::Info);
+        mDropped = 0;
+        mStopThread = false;
+
+        mThread = std::thread([this] () {
+            while(true) {
+                {
+                    std::unique_lock<std::mutex> l(mMutx);
+                    // Loggers never notify, waking up on a timer keeps them lock free.
+                    mCv.wait_for(l, std::chrono::milliseconds(DRAIN_INTERVAL_MS), [this] () { return mStopThread; });
+                    if(mStopThread) break;
+                }
+                drain();
+            }
+        });
+    }
+
+    Logger::~Logger() {
+        {
+            std::unique_lock<std::mutex> l(mMutx);
+            mStopThread = true;
+            mCv.notify_all();
+        }
+        if(mThread.joinable()) {
+            mThread.join();
+        }
+        drain();
+    }
+
+    void Logger::setLevel(LogLevel level) {
+        mLevel = int(level);
+    }
+
+    void Logger::setSink(Sink sink) {
+        flush();
+        std::unique_lock<std::mutex> l(mSinkMutx);
+        mSink = sink;
+    }
+
+    void Logger::log(LogLevel level, const char *format, ...) {
+        va_list args;
+        va_start(args, format);
+        vlog(level, format, args);
+        va_end(args);
+    }
+
+    // A bounded multi-producer queue: a slot is free for the writer whose
+    // position matches its sequence, and readable once the sequence moved
+    // one past that.
+    void Logger::vlog(LogLevel level, const char *format, va_list args) {
+        if(int(level) < mLevel.load(std::memory_order_relaxed)) return;
+
+        uint64_t pos = mHead.load(std::memory_order_relaxed);
+        Slot *slot;
+        while(true) {
+            slot = &mSlots[pos % CAPACITY];
+            uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+            if(sequence == pos) {
+                if(mHead.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if(sequence < pos) {
+                mDropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = mHead.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->level = level;
+        vsnprintf(slot->message, MESSAGE_SIZE, format, args);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+    }
+
+    void Logger::flush() {
+        drain();
+    }
+
+    uint64_t Logger::droppedCount() {
+        return mDropped;
+    }
+
+    void Logger::drain() {
+        std::unique_lock<std::mutex> drainLock(mDrainMutx);
+        Sink sink;
+        {
+            std::unique_lock<std::mutex> l(mSinkMutx);
+            sink = mSink;
+        }
+
+        while(true) {
+            Slot &slot = mSlots[mTail % CAPACITY];
+            if(slot.sequence.load(std::memory_order_acquire) != mTail + 1) break;
+
+            if(sink) {
+                sink(slot.level, slot.message);
+            } else {
+                FILE *out = slot.level >= LogLevel::Warning ? stderr : stdout;
+                fputs(slot.message, out);
+                fputc('\n', out);
+            }
+            slot.sequence.store(mTail + CAPACITY, std::memory_order_release);
+            mTail ++;
+        }
+    }
+
+    void logDebug(const char *format, ...) {
+        va_list args;
+        va_start(args, format);
+        Logger::shared().vlog(LogLevel::Debug, format, args);
+        va_end(args);
+    }
+
+    void logInfo(const char *format, ...) {
+        va_list args;
+        va_start(args, format);
+        Logger::shared().vlog(LogLevel::Info, format, args);
+        va_end(args);
+    }
+
+    void logWarning(const char *format, ...) {
+        va_list args;
+        va_start(args, format);
+        Logger::shared().vlog(LogLevel::Warning, format, args);
+        va_end(args);
+    }
+
+    void logError(const char *format, ...) {
+        va_list args;
+        va_start(args, format);
+        Logger::shared().vlog(LogLevel::Error, format, args);
+        va_end(args);
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef VXMT_VCAM_SHARE_LOGGER
+#define VXMT_VCAM_SHARE_LOGGER
+
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stdint.h>
+#include <stdarg.h>
+
+#if defined(__GNUC__)
+#define VCAM_PRINTF_FORMAT(f, a) __attribute__((format(printf, f, a)))
+#else
+#define VCAM_PRINTF_FORMAT(f, a)
+#endif
+
+namespace vcamshare {
+
+    enum class LogLevel { Debug = 0, Info, Warning, Error };
+
+    // Messages are formatted into a fixed ring of slots by the thread that
+    // logs them and handed to the sink on a thread of their own, so a slow
+    // console never holds up the muxer. Logging takes no lock and doesn't
+    // allocate; when the ring is full the message is dropped and counted.
+    class Logger {
+    public:
+        static constexpr int CAPACITY = 256;
+        static constexpr int MESSAGE_SIZE = 256;
+
+        // Without a sink, warnings and errors go to stderr, the rest to stdout.
+        typedef std::function<void(LogLevel, const char *)> Sink;
+
+        static Logger &shared();
+
+        Logger();
+        ~Logger();
+
+        void setLevel(LogLevel level);
+        void setSink(Sink sink);
+
+        void log(LogLevel level, const char *format, ...) VCAM_PRINTF_FORMAT(3, 4);
+        void vlog(LogLevel level, const char *format, va_list args);
+        // Hands every message logged so far to the sink before returning.
+        void flush();
+        uint64_t droppedCount();
+
+    private:
+        struct Slot {
+            std::atomic<uint64_t> sequence;
+            LogLevel level;
+            char message[MESSAGE_SIZE];
+        };
+
+        void drain();
+
+        Slot mSlots[CAPACITY];
+        std::atomic<uint64_t> mHead;
+        uint64_t mTail;
+        std::atomic<int> mLevel;
+        std::atomic<uint64_t> mDropped;
+
+        Sink mSink;
+        std::mutex mSinkMutx;
+        std::mutex mDrainMutx;
+
+        std::thread mThread;
+        bool mStopThread;
+        std::condition_variable mCv;
+        std::mutex mMutx;
+    };
+
+    void logDebug(const char *format, ...) VCAM_PRINTF_FORMAT(1, 2);
+    void logInfo(const char *format, ...) VCAM_PRINTF_FORMAT(1, 2);
+    void logWarning(const char *format, ...) VCAM_PRINTF_FORMAT(1, 2);
+    void logError(const char *format, ...) VCAM_PRINTF_FORMAT(1, 2);
+}
+
+#endif
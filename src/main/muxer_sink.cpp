@@ -0,0 +1,563 @@
+#include "muxer_sink.h"
+#include "logger.h"
+#include "tracer.h"
+#include "faststart.h"
+#include "background_worker.h"
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/avstring.h>
+#include <libavutil/error.h>
+}
+
+static const char *const HLS_PLAYLIST_NAME = "index.m3u8";
+// Write buffers hold whole TS packets and stay page aligned.
+static constexpr int TS_BLOCK_SIZE = 188 * 1024;
+// The longest wait before a file that took no frame is tried again.
+static constexpr int RETRY_MAX_SECONDS = 4;
+
+namespace vcamshare {
+
+    MuxerSink::Options::Options() {
+        format = Format::Auto;
+        hlsSegmentSeconds = 2;
+        hlsListSize = 0;
+        hlsFmp4 = true;
+        tsPcrPeriodMs = 0;
+        tsPatPeriodMs = 0;
+        ioBufferSize = FileWriter::DEFAULT_BUFFER_SIZE;
+        preallocate = false;
+        syncPolicy = FileWriter::SyncPolicy::None;
+        syncBytes = 0;
+        fastStart = false;
+        rotateSeconds = 0;
+        rotateBytes = 0;
+        maxSeconds = 0;
+        maxRecoveries = 0;
+    }
+
+    MuxerSink::MuxerSink(const std::string &filePath, const Options &options) {
+        mFilePath = filePath;
+        mOptions = options;
+        mVideoEnc = nullptr;
+        mAudioEnc = nullptr;
+        mCtx = nullptr;
+        mVideoSt = nullptr;
+        mAudioSt = nullptr;
+        mSegmentIndex = 0;
+        mStartDts = AV_NOPTS_VALUE;
+        mVideoBase = 0;
+        mAudioBase = 0;
+        mHeaderWritten = false;
+        mFrameWritten = false;
+        mHeaderBytes = 0;
+        mLastVideoDts = AV_NOPTS_VALUE;
+        mRetryDts = AV_NOPTS_VALUE;
+        mRetryDelay = 0;
+        mRecoveries = 0;
+        mErrorCount = 0;
+        mError = false;
+        mFinished = false;
+    }
+
+    MuxerSink::~MuxerSink() {
+        close();
+    }
+
+    void MuxerSink::attach(AVCodecContext *videoEnc, AVCodecContext *audioEnc) {
+        mVideoEnc = videoEnc;
+        mAudioEnc = audioEnc;
+    }
+
+    bool MuxerSink::isOpen() {
+        return mCtx != nullptr;
+    }
+
+    bool MuxerSink::isFinished() {
+        return mFinished;
+    }
+
+    bool MuxerSink::hasError() {
+        return mError;
+    }
+
+    std::string MuxerSink::openFilePath() {
+        std::unique_lock<std::mutex> l(mPathMutx);
+        return mOpenPath;
+    }
+
+    int64_t MuxerSink::errorCount() {
+        return mErrorCount;
+    }
+
+    void MuxerSink::close() {
+        closeOutput(false);
+    }
+
+    void MuxerSink::finish() {
+        closeOutput(true);
+        mFinished = true;
+    }
+
+    void MuxerSink::setLatencyCallback(FileWriter::LatencyCallback callback) {
+        mLatencyCallback = callback;
+        if(mFileWriter) mFileWriter->setLatencyCallback(callback);
+    }
+
+    bool MuxerSink::writePacket(const AVPacket *pkt, bool video, int64_t ingestUs, int64_t frameId) {
+        if(mError || mFinished || !mVideoEnc || (!video && !mAudioEnc)) return false;
+
+        bool keyframe = video && (pkt->flags & AV_PKT_FLAG_KEY);
+        if(video) mLastVideoDts = pkt->dts;
+        if(!mCtx) {
+            // Every file starts with an IDR.
+            if(!keyframe) return false;
+            if(mRetryDts != AV_NOPTS_VALUE && pkt->dts < mRetryDts) return false;
+
+            if(!openOutput(segmentPath(mSegmentIndex))) {
+                logError("Failed to open Muxer!");
+                closeOutput(false);
+                fail(AVERROR(EIO));
+                return false;
+            }
+            // A file opened after an error carries on from the first one.
+            if(mStartDts == AV_NOPTS_VALUE) mStartDts = pkt->dts;
+            startSegment(pkt->dts);
+        } else if(keyframe) {
+            if(mOptions.maxSeconds > 0 && secondsSince(pkt->dts, mStartDts) >= mOptions.maxSeconds) {
+                closeOutput(true);
+                mFinished = true;
+                return false;
+            }
+            if(shouldRotate(pkt->dts)) {
+                rotate(pkt->dts);
+                if(!mCtx) return false;
+            } else if(mFileWriter) {
+                // Plain files get no fragment markers from the muxer, so
+                // the GOP this IDR ends is the unit synced to disk.
+                mFileWriter->markSyncPoint();
+            }
+        }
+
+        // Audio from before the IDR that opened the file has no video to go with.
+        if(!video && pkt->dts < mAudioBase) return false;
+
+        AVCodecContext *enc = video ? mVideoEnc : mAudioEnc;
+        AVStream *st = video ? mVideoSt : mAudioSt;
+
+        // Shares the packet buffer with the other sinks.
+        AVPacket *out = av_packet_clone(pkt);
+        if(!out) return false;
+
+        int64_t base = video ? mVideoBase : mAudioBase;
+        out->dts -= base;
+        out->pts -= base;
+        av_packet_rescale_ts(out, enc->time_base, st->time_base);
+        out->stream_index = st->index;
+
+        int ret;
+        {
+            VCAM_TRACE_SCOPE(video ? "write_video" : "write_audio", frameId);
+            if(mFileWriter) mFileWriter->setTraceFrame(frameId);
+            ret = av_interleaved_write_frame(mCtx, out);
+        }
+        av_packet_free(&out);
+
+        if(ret == 0) {
+            mFrameWritten = true;
+            if(ingestUs >= 0 && mFileWriter) mFileWriter->markIngest(ingestUs);
+        } else {
+            char mess[256];
+            av_strerror(ret, mess, 256);
+            logError("Failed to write %s: %s", mOutputPath.c_str(), mess);
+            fail(ret);
+        }
+        return ret == 0;
+    }
+
+    // With a recovery left, the damaged file gets its trailer if it still
+    // can and the next IDR opens a new one. Otherwise the error sticks. A
+    // file none of whose frames reached the disk is removed and its path is
+    // tried again, that takes no recovery.
+    void MuxerSink::fail(int code) {
+        mErrorCount ++;
+        notify(Event::Error, mOutputPath, code);
+
+        if(mOptions.maxRecoveries == 0) {
+            mError = true;
+            return;
+        }
+
+        bool held = holdsFrames();
+        if(held) {
+            if(mRecoveries >= mOptions.maxRecoveries) {
+                mError = true;
+                return;
+            }
+            mRecoveries ++;
+            logWarning("Recovering, %s is closed and the next IDR starts a new file", mOutputPath.c_str());
+            closeOutput(true);
+            mSegmentIndex ++;
+            mRetryDelay = 0;
+        } else {
+            logWarning("%s holds no frame, it is removed and tried again", mOutputPath.c_str());
+            std::string filePath = mOutputPath;
+            // Buffered frames that never reached the disk don't get a trailer.
+            mFrameWritten = false;
+            closeOutput(false);
+            removeOutput(filePath);
+        }
+
+        // A full disk won't have room by the next IDR, and a path that
+        // can't take a single frame won't either. Each wait is twice the
+        // last, up to RETRY_MAX_SECONDS.
+        if(!held || code == AVERROR(ENOSPC)) {
+            mRetryDelay = mRetryDelay == 0 ? 1 : std::min(mRetryDelay * 2, RETRY_MAX_SECONDS);
+            if(mLastVideoDts != AV_NOPTS_VALUE) {
+                mRetryDts = mLastVideoDts + (int64_t)(mRetryDelay / av_q2d(mVideoEnc->time_base));
+            }
+            logWarning("Next attempt in %d s", mRetryDelay);
+        }
+    }
+
+    // Whether any frame made it to the disk rather than only into the
+    // buffer of the file writer.
+    bool MuxerSink::holdsFrames() {
+        if(!mFrameWritten) return false;
+        return !mFileWriter || (int64_t)mFileWriter->stats().bytesWritten > mHeaderBytes;
+    }
+
+    void MuxerSink::removeOutput(const std::string &filePath) {
+        // HLS segments and callback output have no single file to remove.
+        if(mOptions.format == Format::Hls || mOptions.onData) return;
+
+        auto backend = mOptions.ioBackend ? mOptions.ioBackend : IoBackend::system();
+        if(backend->remove(filePath) != 0 && errno != ENOENT) {
+            logWarning("Failed to remove %s: %s", filePath.c_str(), strerror(errno));
+        }
+    }
+
+    void MuxerSink::notify(Event event, const std::string &filePath, int64_t value) {
+        if(!mOptions.onEvent) return;
+
+        auto callback = mOptions.onEvent;
+        BackgroundWorker::events().post([callback, event, filePath, value] () {
+            callback(event, filePath, value);
+        });
+    }
+
+    // Each file starts its timestamps at zero, the audio offset follows the
+    // video so both streams stay in sync.
+    void MuxerSink::startSegment(int64_t videoDts) {
+        mVideoBase = videoDts;
+        if(mAudioEnc) {
+            mAudioBase = av_rescale_q(videoDts, mVideoEnc->time_base, mAudioEnc->time_base);
+        }
+    }
+
+    bool MuxerSink::addStream(AVStream **st, AVCodecContext *enc) {
+        *st = avformat_new_stream(mCtx, NULL);
+        if (!*st) {
+            logError("Could not allocate stream");
+            return false;
+        }
+        (*st)->id = mCtx->nb_streams-1;
+        (*st)->time_base = enc->time_base;
+
+        int ret = avcodec_parameters_from_context((*st)->codecpar, enc);
+
+        if (ret < 0) {
+            logError("Could not copy the stream parameters");
+            return false;
+        }
+
+        return true;
+    }
+
+    bool MuxerSink::openOutput(const std::string &filePath) {
+        int ret;
+
+        logInfo("video file: %s", filePath.c_str());
+        mFrameWritten = false;
+        mOutputPath = filePath;
+
+        const char *formatName = nullptr;
+        if (mOptions.onData) {
+            if (mOptions.format == Format::Hls) {
+                logError("HLS can't be written to a callback.");
+                return false;
+            }
+            formatName = mOptions.format == Format::MpegTs ? "mpegts" : "mp4";
+        } else if (mOptions.format == Format::Hls) {
+            // The path names a directory holding the playlist and the segments.
+            if (mkdir(filePath.c_str(), 0755) != 0 && errno != EEXIST) {
+                logError("Failed to create %s", filePath.c_str());
+                return false;
+            }
+            formatName = "hls";
+            mOutputPath = filePath + "/" + HLS_PLAYLIST_NAME;
+        } else if (mOptions.format == Format::MpegTs) {
+            formatName = "mpegts";
+        }
+
+        {
+            std::unique_lock<std::mutex> l(mPathMutx);
+            mOpenPath = mOutputPath;
+        }
+
+        avformat_alloc_output_context2(&mCtx, NULL, formatName, mOutputPath.c_str());
+        if (!mCtx) {
+            logError("Failed to open file: %s", mOutputPath.c_str());
+            return false;
+        }
+
+        if(!addStream(&mVideoSt, mVideoEnc) || (mAudioEnc && !addStream(&mAudioSt, mAudioEnc))) {
+            return false;
+        }
+
+        av_dump_format(mCtx, 0, mOutputPath.c_str(), 1);
+
+        if (mOptions.onData) {
+            mStreamWriter = std::unique_ptr<StreamWriter>(new StreamWriter(mOptions.onData));
+            if (!mStreamWriter->open()) {
+                logError("Could not open output context.");
+                return false;
+            }
+            mCtx->pb = mStreamWriter->avioContext();
+            mCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+        } else if (!(mCtx->oformat->flags & AVFMT_NOFILE)) {
+            if (mOptions.ioBufferSize > 0) {
+                int bufferSize = mOptions.ioBufferSize;
+                if (mOptions.format == Format::MpegTs) {
+                    bufferSize = (bufferSize + TS_BLOCK_SIZE - 1) / TS_BLOCK_SIZE * TS_BLOCK_SIZE;
+                }
+                mFileWriter = std::unique_ptr<FileWriter>(new FileWriter(bufferSize));
+                mFileWriter->setIoBackend(mOptions.ioBackend);
+                mFileWriter->setPreallocate(mOptions.preallocate);
+                mFileWriter->setSyncPolicy(mOptions.syncPolicy, mOptions.syncBytes);
+                mFileWriter->setLatencyCallback(mLatencyCallback);
+                if (!mFileWriter->open(filePath)) {
+                    logError("Could not open output context.");
+                    return false;
+                }
+                mCtx->pb = mFileWriter->avioContext();
+                mCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+            } else {
+                ret = avio_open(&mCtx->pb, filePath.c_str(), AVIO_FLAG_WRITE);
+                if (ret < 0) {
+                    logError("Could not open output context.");
+                    return false;
+                }
+            }
+        }
+
+        AVDictionary *opts = formatOptions(filePath);
+        ret = avformat_write_header(mCtx, &opts);
+        logInfo("Header written: %d", ret);
+
+        AVDictionaryEntry *unused = nullptr;
+        while ((unused = av_dict_get(opts, "", unused, AV_DICT_IGNORE_SUFFIX))) {
+            logWarning("Unused muxer option: %s", unused->key);
+        }
+        av_dict_free(&opts);
+
+        if (ret < 0) {
+            char mess[256];
+            av_strerror(ret, mess, 256);
+            logError("%s", mess);
+            return false;
+        }
+
+        mHeaderWritten = true;
+        mHeaderBytes = mCtx->pb ? avio_tell(mCtx->pb) : 0;
+        notify(Event::FileOpened, mOutputPath, 0);
+        return true;
+    }
+
+    AVDictionary *MuxerSink::formatOptions(const std::string &filePath) {
+        AVDictionary *opts = nullptr;
+
+        if (mOptions.onData && mOptions.format != Format::MpegTs) {
+            // A fragment per GOP, each one decodable on its own without
+            // seeking back to patch the header.
+            av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        } else if (mOptions.format == Format::Hls) {
+            const char *ext = mOptions.hlsFmp4 ? "m4s" : "ts";
+            std::string segmentName = filePath + "/segment_%05d." + ext;
+
+            av_dict_set_int(&opts, "hls_time", mOptions.hlsSegmentSeconds, 0);
+            av_dict_set_int(&opts, "hls_list_size", mOptions.hlsListSize, 0);
+            // An event playlist keeps every segment so the player can seek
+            // back to the start of the recording.
+            if (mOptions.hlsListSize == 0) {
+                av_dict_set(&opts, "hls_playlist_type", "event", 0);
+            }
+            // Segments are renamed into place, a reader never sees half of one.
+            av_dict_set(&opts, "hls_flags", "independent_segments+temp_file", 0);
+            av_dict_set(&opts, "hls_segment_type", mOptions.hlsFmp4 ? "fmp4" : "mpegts", 0);
+            av_dict_set(&opts, "hls_segment_filename", segmentName.c_str(), 0);
+            if (mOptions.hlsFmp4) {
+                av_dict_set(&opts, "hls_fmp4_init_filename", "init.mp4", 0);
+            }
+        } else if (mOptions.format == Format::MpegTs) {
+            if (mOptions.tsPcrPeriodMs > 0) {
+                av_dict_set_int(&opts, "pcr_period", mOptions.tsPcrPeriodMs, 0);
+            }
+            if (mOptions.tsPatPeriodMs > 0) {
+                std::string period = std::to_string(mOptions.tsPatPeriodMs) + "ms";
+                av_dict_set(&opts, "pat_period", period.c_str(), 0);
+                av_dict_set(&opts, "sdt_period", period.c_str(), 0);
+            }
+        }
+
+        return opts;
+    }
+
+    // Writes the trailer and releases an output that is no longer fed. It only
+    // touches the given context, so it can run on the background worker while
+    // the sink carries on with the next file.
+    static void finalizeOutput(AVFormatContext *ctx,
+                               std::shared_ptr<FileWriter> writer,
+                               std::shared_ptr<StreamWriter> stream,
+                               const std::string &filePath,
+                               bool writeTrailer,
+                               bool fastStart,
+                               std::function<void(const std::string &, float)> progress,
+                               MuxerSink::EventCallback onEvent) {
+        bool finalized = false;
+        if(ctx && writeTrailer) {
+            int rs = av_write_trailer(ctx);
+            logInfo("trailer written: %d", rs);
+            finalized = rs == 0;
+        }
+        bool isMp4 = ctx && av_match_name(ctx->oformat->name, "mp4,mov,ipod");
+
+        /* close output */
+        if (writer) {
+            if (!writer->close()) {
+                logError("Failed to flush %s", filePath.c_str());
+                finalized = false;
+            }
+            auto stats = writer->stats();
+            logInfo("file written: %llu bytes, %llu writes (%llu-%llu bytes), flush latency max %lluus, %llu syncs (max %lluus)",
+                (unsigned long long)stats.bytesWritten, (unsigned long long)stats.writeCount,
+                (unsigned long long)stats.minWriteSize, (unsigned long long)stats.maxWriteSize,
+                (unsigned long long)stats.maxFlushLatencyUs,
+                (unsigned long long)stats.syncCount, (unsigned long long)stats.maxSyncLatencyUs);
+
+            if (ctx) {
+                ctx->pb = nullptr;
+            }
+        } else if (stream) {
+            if (!stream->close()) {
+                finalized = false;
+            }
+            logInfo("stream written: %lld bytes, %lld fragments",
+                (long long)stream->bytesWritten(), (long long)stream->fragmentCount());
+
+            if (ctx) {
+                ctx->pb = nullptr;
+            }
+        } else if (ctx && !(ctx->oformat->flags & AVFMT_NOFILE)) {
+            avio_closep(&ctx->pb);
+        }
+
+        if(ctx) {
+            avformat_free_context(ctx);
+        }
+
+        if(onEvent) {
+            BackgroundWorker::events().post([onEvent, filePath, finalized] () {
+                onEvent(MuxerSink::Event::FileFinalized, filePath, finalized ? 1 : 0);
+            });
+        }
+
+        if(finalized && isMp4 && fastStart && !stream) {
+            BackgroundWorker::shared().post([filePath, progress] () {
+                bool ok = faststartFile(filePath, [&filePath, &progress] (float p) {
+                    if(progress) progress(filePath, p);
+                });
+                if(!ok && progress) progress(filePath, -1);
+            });
+        }
+    }
+
+    void MuxerSink::closeOutput(bool async) {
+        std::shared_ptr<FileWriter> writer(mFileWriter.release());
+        std::shared_ptr<StreamWriter> stream(mStreamWriter.release());
+        AVFormatContext *ctx = mCtx;
+        std::string filePath = mOutputPath;
+        bool writeTrailer = mFrameWritten && !mError;
+        bool fastStart = mOptions.fastStart;
+        auto progress = mOptions.fastStartProgress;
+        // Only a file that was reported opened is reported finalized.
+        auto onEvent = mHeaderWritten ? mOptions.onEvent : nullptr;
+
+        mCtx = nullptr;
+        mVideoSt = nullptr;
+        mAudioSt = nullptr;
+        mHeaderWritten = false;
+        {
+            std::unique_lock<std::mutex> l(mPathMutx);
+            mOpenPath.clear();
+        }
+        if(!ctx && !writer && !stream) return;
+
+        if(async) {
+            // The owner of the callback may be gone by the time the worker gets to it.
+            if(writer) writer->setLatencyCallback(nullptr);
+            BackgroundWorker::shared().post([ctx, writer, stream, filePath, writeTrailer, fastStart, progress, onEvent] () {
+                finalizeOutput(ctx, writer, stream, filePath, writeTrailer, fastStart, progress, onEvent);
+            });
+        } else {
+            finalizeOutput(ctx, writer, stream, filePath, writeTrailer, fastStart, progress, onEvent);
+        }
+    }
+
+    std::string MuxerSink::segmentPath(int index) {
+        if(index == 0) return mFilePath;
+
+        // rec.mp4 -> rec_1.mp4
+        size_t slash = mFilePath.find_last_of('/');
+        size_t dot = mFilePath.find_last_of('.');
+        if(dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+            dot = mFilePath.size();
+        }
+        return mFilePath.substr(0, dot) + "_" + std::to_string(index) + mFilePath.substr(dot);
+    }
+
+    double MuxerSink::secondsSince(int64_t videoDts, int64_t since) {
+        return (videoDts - since) * av_q2d(mVideoEnc->time_base);
+    }
+
+    bool MuxerSink::shouldRotate(int64_t videoDts) {
+        // The hls muxer does its own segmenting, a stream has no files to rotate.
+        if(!mCtx || mOptions.format == Format::Hls || mOptions.onData) return false;
+
+        if(mOptions.rotateSeconds > 0 && secondsSince(videoDts, mVideoBase) >= mOptions.rotateSeconds) {
+            return true;
+        }
+        if(mOptions.rotateBytes > 0 && mCtx->pb && avio_tell(mCtx->pb) >= mOptions.rotateBytes) {
+            return true;
+        }
+        return false;
+    }
+
+    // Called with the IDR that starts the next file. The finished file is
+    // finalized on the background worker.
+    void MuxerSink::rotate(int64_t videoDts) {
+        closeOutput(true);
+
+        mSegmentIndex ++;
+        if(!openOutput(segmentPath(mSegmentIndex))) {
+            logError("Failed to open the next segment.");
+            closeOutput(false);
+            fail(AVERROR(EIO));
+            return;
+        }
+        startSegment(videoDts);
+    }
+}
@@ -0,0 +1,161 @@
+#ifndef VXMT_VCAM_SHARE_MUXER_SINK
+#define VXMT_VCAM_SHARE_MUXER_SINK
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <functional>
+
+#include "file_writer.h"
+#include "stream_writer.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+namespace vcamshare {
+
+    // One output of a VideoMuxer: a file, a series of rotated files, an HLS
+    // directory or a byte stream handed to a callback. The muxer hands every
+    // packet to each of its sinks. A sink opens at the first IDR it sees and
+    // keeps its own error state, so a failing output doesn't stop the others.
+    class MuxerSink {
+    public:
+        enum class Format {
+            Auto,   // picked from the file extension
+            Hls,    // playlist and segments in the directory given as the path
+            MpegTs  // append only, readable without a trailer
+        };
+
+        enum class Event {
+            Error,          // value is the AVERROR code
+            FileOpened,
+            FileFinalized,  // value is 1 when the file was closed cleanly, 0 if damaged
+            LowDisk         // value is the predicted seconds of recording left
+        };
+        // Gets the event, the file it concerns and a value depending on the
+        // event. Delivered in order on a thread of their own, never on the
+        // muxer thread.
+        typedef std::function<void(Event, const std::string &, int64_t)> EventCallback;
+
+        struct Options {
+            Format format;
+            int hlsSegmentSeconds, hlsListSize;
+            bool hlsFmp4;
+            int tsPcrPeriodMs, tsPatPeriodMs;
+
+            // Deliver the output to this callback instead of writing the
+            // path, which only names the stream in the logs. Auto writes
+            // fragmented mp4, MpegTs works too, there's no rotation. Called
+            // on the muxer thread, the tail of a removed sink is delivered on
+            // the background worker.
+            StreamWriter::DataCallback onData;
+
+            int ioBufferSize;
+            // Where the FileWriter puts the files, null for the system
+            // calls. HLS and ioBufferSize 0 go through avio_open instead.
+            std::shared_ptr<IoBackend> ioBackend;
+            bool preallocate;
+            FileWriter::SyncPolicy syncPolicy;
+            int64_t syncBytes;
+
+            bool fastStart;
+            std::function<void(const std::string &, float)> fastStartProgress;
+
+            int rotateSeconds;
+            int64_t rotateBytes;
+            // Stop at the first IDR after this long, 0 records until closed.
+            int maxSeconds;
+
+            EventCallback onEvent;
+            // After a failed write or open, finalize what the damaged file
+            // holds and start a new one, named like a rotated file, at the
+            // next IDR. Up to this many times, 0 keeps the first error. A
+            // file that got no frame to disk is removed and retried with a
+            // growing wait, it doesn't count.
+            int maxRecoveries;
+
+            Options();
+        };
+
+        MuxerSink(const std::string &filePath, const Options &options);
+        ~MuxerSink();
+
+        // The encoders the packets come from, needed before the first packet.
+        // Without audioEnc the files only get a video stream.
+        void attach(AVCodecContext *videoEnc, AVCodecContext *audioEnc);
+
+        // pkt carries the encoder time base and is left untouched, the sink
+        // writes its own reference to the packet data. ingestUs, when known,
+        // is the MuxerStats::nowUs() the frame was queued at, frameId the id
+        // it carries in the trace.
+        bool writePacket(const AVPacket *pkt, bool video, int64_t ingestUs = -1, int64_t frameId = -1);
+        // Finalizes the current file on the background worker and takes no
+        // more packets, like reaching maxSeconds.
+        void finish();
+        // Gets the time from ingest to the file write of every packet written
+        // with one. Only the files written directly report it; a file being
+        // finalized on the background worker no longer does.
+        void setLatencyCallback(FileWriter::LatencyCallback callback);
+        void close();
+
+        bool isOpen();
+        bool isFinished();
+        // The file being written, empty between files. Safe from any thread.
+        std::string openFilePath();
+        // Only once no recovery is left.
+        bool hasError();
+        // Every failure, recovered from or not.
+        int64_t errorCount();
+
+    private:
+        bool openOutput(const std::string &filePath);
+        AVDictionary *formatOptions(const std::string &filePath);
+        bool addStream(AVStream **st, AVCodecContext *enc);
+        void closeOutput(bool async);
+        void fail(int code);
+        bool holdsFrames();
+        void removeOutput(const std::string &filePath);
+        void notify(Event event, const std::string &filePath, int64_t value);
+        void startSegment(int64_t videoDts);
+
+        std::string segmentPath(int index);
+        double secondsSince(int64_t videoDts, int64_t since);
+        bool shouldRotate(int64_t videoDts);
+        void rotate(int64_t videoDts);
+
+        std::string mFilePath;
+        std::string mOutputPath;
+        std::string mOpenPath;
+        std::mutex mPathMutx;
+        Options mOptions;
+
+        AVCodecContext *mVideoEnc;
+        AVCodecContext *mAudioEnc;
+        AVFormatContext *mCtx;
+        AVStream *mVideoSt;
+        AVStream *mAudioSt;
+        std::unique_ptr<FileWriter> mFileWriter;
+        std::unique_ptr<StreamWriter> mStreamWriter;
+        FileWriter::LatencyCallback mLatencyCallback;
+
+        int mSegmentIndex;
+        int64_t mStartDts;
+        int64_t mVideoBase, mAudioBase;
+        bool mHeaderWritten;
+        bool mFrameWritten;
+        int64_t mHeaderBytes;
+        int64_t mLastVideoDts;
+        // A failed file is tried again from the first IDR at or after this.
+        int64_t mRetryDts;
+        int mRetryDelay;
+        int mRecoveries;
+        std::atomic<int64_t> mErrorCount;
+        std::atomic<bool> mError;
+        std::atomic<bool> mFinished;
+    };
+}
+
+#endif
@@ -0,0 +1,135 @@
+#include "muxer_stats.h"
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+namespace vcamshare {
+
+    static uint64_t load(const std::atomic<uint64_t> &counter) {
+        return counter.load(std::memory_order_relaxed);
+    }
+
+    static void raise(std::atomic<uint64_t> &maximum, uint64_t value) {
+        uint64_t current = maximum.load(std::memory_order_relaxed);
+        while(value > current && !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    LatencyHistogram::LatencyHistogram() {
+        mCount = 0;
+        mTotalUs = 0;
+        mMaxUs = 0;
+        for(auto &bucket : mBuckets) {
+            bucket = 0;
+        }
+    }
+
+    void LatencyHistogram::record(uint64_t us) {
+        int index = 0;
+        while(index < BUCKETS - 1 && (us >> (index + 1)) > 0) {
+            index ++;
+        }
+        mBuckets[index].fetch_add(1, std::memory_order_relaxed);
+        mCount.fetch_add(1, std::memory_order_relaxed);
+        mTotalUs.fetch_add(us, std::memory_order_relaxed);
+        raise(mMaxUs, us);
+    }
+
+    LatencyHistogram::Snapshot LatencyHistogram::snapshot() {
+        Snapshot s;
+        s.count = load(mCount);
+        s.totalUs = load(mTotalUs);
+        s.maxUs = load(mMaxUs);
+        for(int i = 0; i < BUCKETS; i ++) {
+            s.buckets[i] = load(mBuckets[i]);
+        }
+        return s;
+    }
+
+    LatencyWindow::LatencyWindow() {
+        mCount = 0;
+        mMaxUs = 0;
+        for(auto &sample : mSamples) {
+            sample = 0;
+        }
+    }
+
+    void LatencyWindow::record(uint64_t us) {
+        uint64_t index = mCount.fetch_add(1, std::memory_order_relaxed) % WINDOW;
+        mSamples[index].store(uint32_t(std::min<uint64_t>(us, UINT32_MAX)), std::memory_order_relaxed);
+        raise(mMaxUs, us);
+    }
+
+    LatencyWindow::Snapshot LatencyWindow::snapshot() {
+        Snapshot s;
+        s.count = load(mCount);
+        s.maxUs = load(mMaxUs);
+        s.p50Us = s.p99Us = 0;
+
+        size_t n = std::min<uint64_t>(s.count, WINDOW);
+        if(n == 0) return s;
+        std::vector<uint32_t> samples(n);
+        for(size_t i = 0; i < n; i ++) {
+            samples[i] = mSamples[i].load(std::memory_order_relaxed);
+        }
+        std::sort(samples.begin(), samples.end());
+        s.p50Us = samples[(n - 1) * 50 / 100];
+        s.p99Us = samples[(n - 1) * 99 / 100];
+        return s;
+    }
+
+    MuxerStats::MuxerStats() {
+        videoFramesIn = videoBytesIn = videoFramesDropped = 0;
+        audioFramesIn = audioBytesIn = audioFramesDropped = 0;
+        videoPacketsOut = videoBytesOut = 0;
+        audioPacketsOut = audioBytesOut = 0;
+        writeErrors = 0;
+        proxyPacketsDropped = 0;
+        videoQueueDepth = videoQueueHighWater = 0;
+        audioQueueDepth = audioQueueHighWater = 0;
+        avDriftMs = 0;
+    }
+
+    int64_t MuxerStats::nowUs() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void MuxerStats::add(std::atomic<uint64_t> &counter, uint64_t value) {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void MuxerStats::setDepth(std::atomic<uint32_t> &depth, std::atomic<uint32_t> &highWater, uint32_t value) {
+        depth.store(value, std::memory_order_relaxed);
+        uint32_t current = highWater.load(std::memory_order_relaxed);
+        while(value > current && !highWater.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    MuxerStats::Snapshot MuxerStats::snapshot() {
+        Snapshot s;
+        s.videoFramesIn = load(videoFramesIn);
+        s.videoBytesIn = load(videoBytesIn);
+        s.videoFramesDropped = load(videoFramesDropped);
+        s.audioFramesIn = load(audioFramesIn);
+        s.audioBytesIn = load(audioBytesIn);
+        s.audioFramesDropped = load(audioFramesDropped);
+        s.videoPacketsOut = load(videoPacketsOut);
+        s.videoBytesOut = load(videoBytesOut);
+        s.audioPacketsOut = load(audioPacketsOut);
+        s.audioBytesOut = load(audioBytesOut);
+        s.writeErrors = load(writeErrors);
+        s.proxyPacketsDropped = load(proxyPacketsDropped);
+        s.videoQueueDepth = videoQueueDepth.load(std::memory_order_relaxed);
+        s.videoQueueHighWater = videoQueueHighWater.load(std::memory_order_relaxed);
+        s.audioQueueDepth = audioQueueDepth.load(std::memory_order_relaxed);
+        s.audioQueueHighWater = audioQueueHighWater.load(std::memory_order_relaxed);
+        s.avDriftMs = avDriftMs.load(std::memory_order_relaxed);
+        s.encodeLatency = encodeLatency.snapshot();
+        s.writeLatency = writeLatency.snapshot();
+        s.ingestToWrite = ingestToWrite.snapshot();
+        s.ingestToDisk = ingestToDisk.snapshot();
+        s.thumbnailsOverBudget = 0;
+        return s;
+    }
+}
@@ -0,0 +1,107 @@
+#ifndef VXMT_VCAM_SHARE_MUXER_STATS
+#define VXMT_VCAM_SHARE_MUXER_STATS
+
+#include <atomic>
+#include <stdint.h>
+
+namespace vcamshare {
+
+    // Counts latencies into power of two buckets of microseconds: bucket i
+    // holds [2^i, 2^(i+1)), bucket 0 also takes 0, the last one everything
+    // above. Safe to record from one thread while another reads.
+    class LatencyHistogram {
+    public:
+        static constexpr int BUCKETS = 20;
+
+        struct Snapshot {
+            uint64_t count;
+            uint64_t totalUs;
+            uint64_t maxUs;
+            uint64_t buckets[BUCKETS];
+        };
+
+        LatencyHistogram();
+        void record(uint64_t us);
+        Snapshot snapshot();
+
+    private:
+        std::atomic<uint64_t> mCount;
+        std::atomic<uint64_t> mTotalUs;
+        std::atomic<uint64_t> mMaxUs;
+        std::atomic<uint64_t> mBuckets[BUCKETS];
+    };
+
+    // Keeps the last WINDOW latencies for percentiles, the count and the
+    // maximum cover everything recorded. Safe to record from any thread.
+    class LatencyWindow {
+    public:
+        static constexpr int WINDOW = 4096;
+
+        struct Snapshot {
+            uint64_t count;
+            uint64_t p50Us;
+            uint64_t p99Us;
+            uint64_t maxUs;
+        };
+
+        LatencyWindow();
+        void record(uint64_t us);
+        Snapshot snapshot();
+
+    private:
+        std::atomic<uint64_t> mCount;
+        std::atomic<uint64_t> mMaxUs;
+        std::atomic<uint32_t> mSamples[WINDOW];
+    };
+
+    // Counters a VideoMuxer keeps about itself. Every field is updated with
+    // relaxed atomics, reading them never blocks the muxer.
+    struct MuxerStats {
+        struct Snapshot {
+            uint64_t videoFramesIn, videoBytesIn, videoFramesDropped;
+            uint64_t audioFramesIn, audioBytesIn, audioFramesDropped;
+            uint64_t videoPacketsOut, videoBytesOut;
+            uint64_t audioPacketsOut, audioBytesOut;
+            uint64_t writeErrors;
+            uint64_t proxyPacketsDropped;
+            uint32_t videoQueueDepth, videoQueueHighWater;
+            uint32_t audioQueueDepth, audioQueueHighWater;
+            // Audio ahead of video is positive.
+            int64_t avDriftMs;
+            LatencyHistogram::Snapshot encodeLatency;
+            LatencyHistogram::Snapshot writeLatency;
+            LatencyWindow::Snapshot ingestToWrite;
+            LatencyWindow::Snapshot ingestToDisk;
+            // Filled in by the VideoMuxer from its Thumbnailer.
+            uint64_t thumbnailsOverBudget;
+        };
+
+        MuxerStats();
+        Snapshot snapshot();
+
+        // Microseconds on the steady clock, what frames are tagged with at enqueue.
+        static int64_t nowUs();
+        static void add(std::atomic<uint64_t> &counter, uint64_t value);
+        // Sets the depth and raises the high water mark with it.
+        static void setDepth(std::atomic<uint32_t> &depth, std::atomic<uint32_t> &highWater, uint32_t value);
+
+        std::atomic<uint64_t> videoFramesIn, videoBytesIn, videoFramesDropped;
+        std::atomic<uint64_t> audioFramesIn, audioBytesIn, audioFramesDropped;
+        std::atomic<uint64_t> videoPacketsOut, videoBytesOut;
+        std::atomic<uint64_t> audioPacketsOut, audioBytesOut;
+        std::atomic<uint64_t> writeErrors;
+        // Packets the proxy transcoder skipped to keep up.
+        std::atomic<uint64_t> proxyPacketsDropped;
+        std::atomic<uint32_t> videoQueueDepth, videoQueueHighWater;
+        std::atomic<uint32_t> audioQueueDepth, audioQueueHighWater;
+        std::atomic<int64_t> avDriftMs;
+        LatencyHistogram encodeLatency;
+        LatencyHistogram writeLatency;
+        // From writeVideoFrames to the packet being taken by the primary
+        // output, and to the write of the file buffer holding it.
+        LatencyWindow ingestToWrite;
+        LatencyWindow ingestToDisk;
+    };
+}
+
+#endif
@@ -0,0 +1,82 @@
+#include "packet_ring.h"
+
+namespace vcamshare {
+
+    PacketRing::PacketRing(int seconds, int64_t maxBytes, AVRational timeBase) {
+        mSeconds = seconds < 0 ? 0 : seconds;
+        mMaxBytes = maxBytes < 0 ? 0 : maxBytes;
+        mBytes = 0;
+        mLastVideoDts = 0;
+        mTimeBase = timeBase;
+    }
+
+    PacketRing::~PacketRing() {
+        clear();
+    }
+
+    void PacketRing::push(const AVPacket *pkt, bool video) {
+        Entry entry = { nullptr, video };
+        bool keyframe = video && (pkt->flags & AV_PKT_FLAG_KEY);
+
+        // Nothing before the first IDR can be decoded.
+        if(mEntries.empty() && !keyframe) return;
+
+        entry.pkt = av_packet_clone(pkt);
+        if(!entry.pkt) return;
+
+        if(keyframe) {
+            mGopStarts.push_back(pkt->dts);
+        }
+        if(video) {
+            mLastVideoDts = pkt->dts;
+        }
+        mEntries.push_back(entry);
+        mBytes += pkt->size;
+
+        // Drop a GOP only when the next one still reaches back far enough.
+        while(mGopStarts.size() > 1
+            && (mLastVideoDts - mGopStarts[1]) * av_q2d(mTimeBase) >= mSeconds) {
+            dropOldestGop();
+        }
+        while(mMaxBytes > 0 && mBytes > mMaxBytes && mGopStarts.size() > 1) {
+            dropOldestGop();
+        }
+    }
+
+    void PacketRing::forEach(std::function<void(const AVPacket *, bool)> handler) {
+        for(auto &entry : mEntries) {
+            handler(entry.pkt, entry.video);
+        }
+    }
+
+    void PacketRing::clear() {
+        for(auto &entry : mEntries) {
+            av_packet_free(&entry.pkt);
+        }
+        mEntries.clear();
+        mGopStarts.clear();
+        mBytes = 0;
+    }
+
+    int64_t PacketRing::bytes() {
+        return mBytes;
+    }
+
+    double PacketRing::seconds() {
+        if(mGopStarts.empty()) return 0;
+        return (mLastVideoDts - mGopStarts.front()) * av_q2d(mTimeBase);
+    }
+
+    bool PacketRing::isKeyframe(const Entry &entry) {
+        return entry.video && (entry.pkt->flags & AV_PKT_FLAG_KEY);
+    }
+
+    void PacketRing::dropOldestGop() {
+        do {
+            mBytes -= mEntries.front().pkt->size;
+            av_packet_free(&mEntries.front().pkt);
+            mEntries.pop_front();
+        } while(!mEntries.empty() && !isKeyframe(mEntries.front()));
+        mGopStarts.pop_front();
+    }
+}
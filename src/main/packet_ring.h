@@ -0,0 +1,53 @@
+#ifndef VXMT_VCAM_SHARE_PACKET_RING
+#define VXMT_VCAM_SHARE_PACKET_RING
+
+#include <deque>
+#include <functional>
+#include <stdint.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+namespace vcamshare {
+
+    // Keeps the encoded packets of the last few seconds, cut at GOP
+    // boundaries so the oldest packet is always an IDR. The packets are
+    // references to the buffers the muxer already holds, nothing is copied.
+    class PacketRing {
+    public:
+        // Holds at least seconds of video when the GOPs allow it, and never
+        // more than maxBytes of payload beyond the current GOP. maxBytes 0
+        // only bounds by time. timeBase is the one of the video packets.
+        PacketRing(int seconds, int64_t maxBytes, AVRational timeBase);
+        ~PacketRing();
+
+        // pkt uses the encoder time base and is left untouched.
+        void push(const AVPacket *pkt, bool video);
+        // Oldest first, audio and video in the order they were pushed.
+        void forEach(std::function<void(const AVPacket *, bool)> handler);
+        void clear();
+
+        int64_t bytes();
+        double seconds();
+
+    private:
+        struct Entry {
+            AVPacket *pkt;
+            bool video;
+        };
+
+        bool isKeyframe(const Entry &entry);
+        void dropOldestGop();
+
+        std::deque<Entry> mEntries;
+        std::deque<int64_t> mGopStarts;
+        int mSeconds;
+        int64_t mMaxBytes;
+        int64_t mBytes;
+        int64_t mLastVideoDts;
+        AVRational mTimeBase;
+    };
+}
+
+#endif
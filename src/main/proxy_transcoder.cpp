@@ -0,0 +1,270 @@
+#include "proxy_transcoder.h"
+#include "logger.h"
+
+extern "C" {
+#include <libavutil/error.h>
+}
+
+// The proxy is small, a modest buffer batches its writes well enough.
+static constexpr int PROXY_IO_BUFFER_SIZE = 256 * 1024;
+
+namespace vcamshare {
+
+    ProxyTranscoder::Options::Options() {
+        width = 480;
+        bitRate = 600000;
+        maxQueuedPackets = 60;
+    }
+
+    ProxyTranscoder::ProxyTranscoder(const std::string &filePath, const Options &options) {
+        mFilePath = filePath;
+        mOptions = options;
+        mDecoder = nullptr;
+        mEncoder = nullptr;
+        mSws = nullptr;
+        mFrame = nullptr;
+        mScaled = nullptr;
+        mOutPkt = nullptr;
+        mCtx = nullptr;
+        mSt = nullptr;
+        mHeaderWritten = false;
+        mOpened = false;
+        mSkipToIdr = false;
+        mQueued = 0;
+        mDropped = 0;
+        mError = false;
+    }
+
+    ProxyTranscoder::~ProxyTranscoder() {
+        close();
+    }
+
+    bool ProxyTranscoder::open(const AVCodecContext *videoEnc) {
+        if(mOpened) return false;
+
+        std::shared_ptr<AVCodecParameters> par(avcodec_parameters_alloc(), [] (AVCodecParameters *p) {
+            avcodec_parameters_free(&p);
+        });
+        if(!par || avcodec_parameters_from_context(par.get(), videoEnc) < 0) {
+            return false;
+        }
+
+        mOpened = true;
+        AVRational timeBase = videoEnc->time_base;
+        mWorker.post([this, par, timeBase] () {
+            if(!setup(par.get(), timeBase)) {
+                logError("Failed to open the proxy %s", mFilePath.c_str());
+                mError = true;
+            }
+        });
+        return true;
+    }
+
+    bool ProxyTranscoder::push(const AVPacket *pkt) {
+        if(!mOpened || mError) return true;
+
+        bool keyframe = pkt->flags & AV_PKT_FLAG_KEY;
+        if(keyframe) {
+            mSkipToIdr = false;
+        }
+        if(!mSkipToIdr && mQueued >= mOptions.maxQueuedPackets) {
+            // The frames up to the next IDR can't be decoded without this one.
+            mSkipToIdr = true;
+        }
+        if(mSkipToIdr) {
+            mDropped ++;
+            return false;
+        }
+
+        std::shared_ptr<AVPacket> ref(av_packet_clone(pkt), [] (AVPacket *p) {
+            av_packet_free(&p);
+        });
+        if(!ref) return true;
+
+        mQueued ++;
+        mWorker.post([this, ref] () {
+            if(!mError) transcode(ref.get());
+            mQueued --;
+        });
+        return true;
+    }
+
+    void ProxyTranscoder::close() {
+        if(!mOpened) return;
+        mOpened = false;
+
+        mWorker.post([this] () {
+            finish();
+        });
+        mWorker.drain();
+
+        if(mDropped > 0) {
+            logInfo("proxy dropped %lld packets to keep up", (long long)mDropped.load());
+        }
+    }
+
+    int64_t ProxyTranscoder::droppedPackets() {
+        return mDropped;
+    }
+
+    bool ProxyTranscoder::hasError() {
+        return mError;
+    }
+
+    bool ProxyTranscoder::setup(const AVCodecParameters *par, AVRational timeBase) {
+        const AVCodec *decoder = avcodec_find_decoder(par->codec_id);
+        const AVCodec *encoder = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+        if(!decoder || !encoder) {
+            logError("The proxy needs the H.264 decoder and the MPEG-4 encoder");
+            return false;
+        }
+
+        mDecoder = avcodec_alloc_context3(decoder);
+        if(!mDecoder || avcodec_parameters_to_context(mDecoder, par) < 0) {
+            return false;
+        }
+        mDecoder->time_base = timeBase;
+        mDecoder->pkt_timebase = timeBase;
+        mDecoder->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        // The drift this causes within a GOP is invisible at proxy size.
+        mDecoder->skip_loop_filter = AVDISCARD_ALL;
+        if(avcodec_open2(mDecoder, decoder, NULL) < 0) {
+            return false;
+        }
+
+        int width = mOptions.width > 0 && mOptions.width < par->width ? mOptions.width : par->width;
+        int height = int(int64_t(width) * par->height / par->width);
+        width = (width + 1) & ~1;
+        height = (height + 1) & ~1;
+
+        avformat_alloc_output_context2(&mCtx, NULL, NULL, mFilePath.c_str());
+        if(!mCtx) {
+            return false;
+        }
+
+        mEncoder = avcodec_alloc_context3(encoder);
+        if(!mEncoder) {
+            return false;
+        }
+        mEncoder->width = width;
+        mEncoder->height = height;
+        mEncoder->pix_fmt = AV_PIX_FMT_YUV420P;
+        mEncoder->time_base = timeBase;
+        mEncoder->bit_rate = mOptions.bitRate;
+        // A keyframe every second or so keeps scrubbing cheap.
+        mEncoder->gop_size = timeBase.num > 0 ? timeBase.den / timeBase.num : 30;
+        mEncoder->max_b_frames = 0;
+        mEncoder->thread_count = 1;
+        if(mCtx->oformat->flags & AVFMT_GLOBALHEADER) {
+            mEncoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        }
+        if(avcodec_open2(mEncoder, encoder, NULL) < 0) {
+            return false;
+        }
+
+        mSt = avformat_new_stream(mCtx, NULL);
+        if(!mSt || avcodec_parameters_from_context(mSt->codecpar, mEncoder) < 0) {
+            return false;
+        }
+        mSt->time_base = mEncoder->time_base;
+
+        mFileWriter = std::unique_ptr<FileWriter>(new FileWriter(PROXY_IO_BUFFER_SIZE));
+        if(!mFileWriter->open(mFilePath)) {
+            return false;
+        }
+        mCtx->pb = mFileWriter->avioContext();
+        mCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+        if(avformat_write_header(mCtx, NULL) < 0) {
+            return false;
+        }
+        mHeaderWritten = true;
+
+        mFrame = av_frame_alloc();
+        mScaled = av_frame_alloc();
+        mOutPkt = av_packet_alloc();
+        if(!mFrame || !mScaled || !mOutPkt) {
+            return false;
+        }
+        mScaled->format = AV_PIX_FMT_YUV420P;
+        mScaled->width = width;
+        mScaled->height = height;
+        return av_frame_get_buffer(mScaled, 0) >= 0;
+    }
+
+    void ProxyTranscoder::transcode(const AVPacket *pkt) {
+        int ret = avcodec_send_packet(mDecoder, pkt);
+        while(ret >= 0) {
+            ret = avcodec_receive_frame(mDecoder, mFrame);
+            if(ret < 0) break;
+
+            mSws = sws_getCachedContext(mSws, mFrame->width, mFrame->height, (AVPixelFormat)mFrame->format,
+                                        mScaled->width, mScaled->height, AV_PIX_FMT_YUV420P,
+                                        SWS_FAST_BILINEAR, NULL, NULL, NULL);
+            if(!mSws || av_frame_make_writable(mScaled) < 0) {
+                mError = true;
+                break;
+            }
+            sws_scale(mSws, mFrame->data, mFrame->linesize, 0, mFrame->height,
+                      mScaled->data, mScaled->linesize);
+            mScaled->pts = mFrame->best_effort_timestamp;
+            av_frame_unref(mFrame);
+
+            if(!encode(mScaled)) {
+                mError = true;
+                break;
+            }
+        }
+    }
+
+    bool ProxyTranscoder::encode(AVFrame *frame) {
+        int ret = avcodec_send_frame(mEncoder, frame);
+        while(ret >= 0) {
+            ret = avcodec_receive_packet(mEncoder, mOutPkt);
+            if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return true;
+            if(ret < 0) break;
+
+            av_packet_rescale_ts(mOutPkt, mEncoder->time_base, mSt->time_base);
+            mOutPkt->stream_index = mSt->index;
+            ret = av_interleaved_write_frame(mCtx, mOutPkt);
+        }
+        if(ret < 0) {
+            char mess[256];
+            av_strerror(ret, mess, 256);
+            logError("Proxy encoding failed: %s", mess);
+            return false;
+        }
+        return true;
+    }
+
+    void ProxyTranscoder::finish() {
+        if(mEncoder && mHeaderWritten && !mError) {
+            transcode(nullptr);
+            encode(nullptr);
+        }
+        if(mHeaderWritten) {
+            av_write_trailer(mCtx);
+        }
+        if(mFileWriter) {
+            if(!mFileWriter->close()) mError = true;
+            if(mCtx) mCtx->pb = nullptr;
+            mFileWriter.reset();
+        }
+        if(mCtx) {
+            avformat_free_context(mCtx);
+            mCtx = nullptr;
+        }
+        mSt = nullptr;
+        mHeaderWritten = false;
+
+        if(mDecoder) avcodec_free_context(&mDecoder);
+        if(mEncoder) avcodec_free_context(&mEncoder);
+        if(mSws) {
+            sws_freeContext(mSws);
+            mSws = nullptr;
+        }
+        if(mFrame) av_frame_free(&mFrame);
+        if(mScaled) av_frame_free(&mScaled);
+        if(mOutPkt) av_packet_free(&mOutPkt);
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef VXMT_VCAM_SHARE_PROXY_TRANSCODER
+#define VXMT_VCAM_SHARE_PROXY_TRANSCODER
+
+#include <string>
+#include <memory>
+#include <atomic>
+
+#include "background_worker.h"
+#include "file_writer.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+}
+
+namespace vcamshare {
+
+    // Writes a small MPEG-4 Part 2 copy of the recording for scrubbing on
+    // slow devices. The H.264 packets are decoded, scaled and re-encoded on
+    // a low priority thread of its own. push() never waits: when that
+    // thread falls behind, whole GOPs are dropped until it catches up.
+    class ProxyTranscoder {
+    public:
+        struct Options {
+            int width;          // the height follows the aspect ratio
+            int bitRate;
+            int maxQueuedPackets;
+            Options();
+        };
+
+        ProxyTranscoder(const std::string &filePath, const Options &options);
+        ~ProxyTranscoder();
+
+        // videoEnc describes the packets that will be pushed.
+        bool open(const AVCodecContext *videoEnc);
+        // pkt uses the time base of videoEnc and is left untouched. Returns
+        // false when it was dropped to catch up.
+        bool push(const AVPacket *pkt);
+        // Transcodes what is queued and finishes the file.
+        void close();
+
+        int64_t droppedPackets();
+        bool hasError();
+
+    private:
+        bool setup(const AVCodecParameters *par, AVRational timeBase);
+        void transcode(const AVPacket *pkt);
+        bool encode(AVFrame *frame);
+        void finish();
+
+        std::string mFilePath;
+        Options mOptions;
+        BackgroundWorker mWorker;
+
+        // Only touched on mWorker.
+        AVCodecContext *mDecoder;
+        AVCodecContext *mEncoder;
+        SwsContext *mSws;
+        AVFrame *mFrame;
+        AVFrame *mScaled;
+        AVPacket *mOutPkt;
+        AVFormatContext *mCtx;
+        AVStream *mSt;
+        std::unique_ptr<FileWriter> mFileWriter;
+        bool mHeaderWritten;
+
+        bool mOpened;
+        bool mSkipToIdr;
+        std::atomic<int> mQueued;
+        std::atomic<int64_t> mDropped;
+        std::atomic<bool> mError;
+    };
+}
+
+#endif
@@ -0,0 +1,368 @@
+#include "remuxer.h"
+#include "logger.h"
+#include "file_writer.h"
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <string.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/error.h>
+#include <libavutil/common.h>
+}
+
+namespace vcamshare {
+
+    namespace {
+        // Owns both contexts of a stream copy.
+        struct RemuxContext {
+            AVFormatContext *in;
+            AVFormatContext *out;
+            std::unique_ptr<FileWriter> writer;
+            std::vector<int> streamMap;
+
+            RemuxContext() : in(nullptr), out(nullptr) {}
+            ~RemuxContext() {
+                if (writer) {
+                    writer->close();
+                    if (out) out->pb = nullptr;
+                }
+                if (out) avformat_free_context(out);
+                if (in) avformat_close_input(&in);
+            }
+        };
+    }
+
+    static bool openInput(RemuxContext &ctx, const std::string &inputPath) {
+        int ret = avformat_open_input(&ctx.in, inputPath.c_str(), NULL, NULL);
+        if (ret < 0) {
+            char mess[256];
+            av_strerror(ret, mess, 256);
+            logError("Could not open %s: %s", inputPath.c_str(), mess);
+            return false;
+        }
+
+        // MPEG-TS only carries the codec parameters in the packets.
+        if (avformat_find_stream_info(ctx.in, NULL) < 0) {
+            logError("Could not read stream info of %s", inputPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    static bool openOutput(RemuxContext &ctx, const std::string &outputPath) {
+        avformat_alloc_output_context2(&ctx.out, NULL, NULL, outputPath.c_str());
+        if (!ctx.out) {
+            logError("Could not create %s", outputPath.c_str());
+            return false;
+        }
+
+        ctx.streamMap.assign(ctx.in->nb_streams, -1);
+        for (unsigned i = 0; i < ctx.in->nb_streams; i ++) {
+            AVCodecParameters *par = ctx.in->streams[i]->codecpar;
+            if (par->codec_type != AVMEDIA_TYPE_VIDEO && par->codec_type != AVMEDIA_TYPE_AUDIO) {
+                continue;
+            }
+
+            AVStream *st = avformat_new_stream(ctx.out, NULL);
+            if (!st || avcodec_parameters_copy(st->codecpar, par) < 0) {
+                return false;
+            }
+            st->codecpar->codec_tag = 0;
+            st->time_base = ctx.in->streams[i]->time_base;
+            ctx.streamMap[i] = st->index;
+        }
+
+        if (!(ctx.out->oformat->flags & AVFMT_NOFILE)) {
+            ctx.writer = std::unique_ptr<FileWriter>(new FileWriter(FileWriter::DEFAULT_BUFFER_SIZE));
+            if (!ctx.writer->open(outputPath)) {
+                return false;
+            }
+            ctx.out->pb = ctx.writer->avioContext();
+            ctx.out->flags |= AVFMT_FLAG_CUSTOM_IO;
+        }
+
+        int ret = avformat_write_header(ctx.out, NULL);
+        if (ret < 0) {
+            char mess[256];
+            av_strerror(ret, mess, 256);
+            logError("Could not write header of %s: %s", outputPath.c_str(), mess);
+            return false;
+        }
+        return true;
+    }
+
+    // Which packets to copy and how to move them, in AV_TIME_BASE units.
+    struct CopyRange {
+        int64_t shift;      // subtracted from every timestamp
+        int64_t audioStart; // earlier audio is dropped
+        int64_t end;        // packets from here on are dropped
+    };
+
+    // endTime, when given, receives the end of the last packet written in
+    // output time, AV_TIME_BASE units.
+    static bool copyPackets(RemuxContext &ctx, const CopyRange &range,
+                            std::function<void(float)> progress, int64_t *endTime) {
+        int64_t inputSize = avio_size(ctx.in->pb);
+        bool timed = range.end != INT64_MAX;
+        int lastPercent = -1;
+        bool ok = true;
+
+        // A bounded copy stops once every stream has passed the end.
+        int running = 0;
+        for (int index : ctx.streamMap) {
+            if (index >= 0) running ++;
+        }
+        std::vector<bool> finished(ctx.in->nb_streams, false);
+
+        AVPacket *pkt = av_packet_alloc();
+        while (ok && running > 0 && av_read_frame(ctx.in, pkt) >= 0) {
+            int outIndex = ctx.streamMap[pkt->stream_index];
+            AVStream *inSt = ctx.in->streams[pkt->stream_index];
+            int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+            int64_t t = ts == AV_NOPTS_VALUE ? range.shift : av_rescale_q(ts, inSt->time_base, AV_TIME_BASE_Q);
+
+            if (outIndex >= 0 && t >= range.end) {
+                if (!finished[pkt->stream_index]) {
+                    finished[pkt->stream_index] = true;
+                    running --;
+                }
+                outIndex = -1;
+            }
+            if (outIndex >= 0 && inSt->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && t < range.audioStart) {
+                outIndex = -1;
+            }
+
+            if (outIndex >= 0) {
+                AVStream *outSt = ctx.out->streams[outIndex];
+                int64_t offset = av_rescale_q(range.shift, AV_TIME_BASE_Q, inSt->time_base);
+
+                if (pkt->pts != AV_NOPTS_VALUE) pkt->pts -= offset;
+                if (pkt->dts != AV_NOPTS_VALUE) pkt->dts -= offset;
+                av_packet_rescale_ts(pkt, inSt->time_base, outSt->time_base);
+                pkt->stream_index = outIndex;
+                pkt->pos = -1;
+
+                if (endTime) {
+                    // pkt is in the output time base by now.
+                    int64_t duration = av_rescale_q(pkt->duration, outSt->time_base, AV_TIME_BASE_Q);
+                    *endTime = std::max(*endTime, t - range.shift + std::max<int64_t>(duration, 1));
+                }
+
+                if (progress) {
+                    int percent = lastPercent;
+                    if (timed) {
+                        percent = int(av_clip64((t - range.shift) * 100 / (range.end - range.shift), 0, 100));
+                    } else if (inputSize > 0) {
+                        percent = int(avio_tell(ctx.in->pb) * 100 / inputSize);
+                    }
+                    if (percent != lastPercent) {
+                        lastPercent = percent;
+                        progress(percent / 100.0f);
+                    }
+                }
+
+                ok = av_interleaved_write_frame(ctx.out, pkt) == 0;
+            }
+            av_packet_unref(pkt);
+        }
+        av_packet_free(&pkt);
+        return ok;
+    }
+
+    static bool finishOutput(RemuxContext &ctx) {
+        bool ok = av_write_trailer(ctx.out) == 0;
+        if (ctx.writer) {
+            ok = ctx.writer->close() && ok;
+        }
+        return ok;
+    }
+
+    bool remuxFile(const std::string &inputPath, const std::string &outputPath,
+                   std::function<void(float)> progress) {
+        RemuxContext ctx;
+        if (!openInput(ctx, inputPath) || !openOutput(ctx, outputPath)) {
+            return false;
+        }
+
+        CopyRange range;
+        range.shift = ctx.in->start_time == AV_NOPTS_VALUE ? 0 : ctx.in->start_time;
+        range.audioStart = INT64_MIN;
+        range.end = INT64_MAX;
+
+        if (!copyPackets(ctx, range, progress, nullptr) || !finishOutput(ctx)) {
+            logError("Failed to remux %s", inputPath.c_str());
+            return false;
+        }
+        if (progress) progress(1.0f);
+        return true;
+    }
+
+    bool trimFile(const std::string &inputPath, const std::string &outputPath,
+                  double startSeconds, double endSeconds, TrimMode mode,
+                  std::function<void(float)> progress) {
+        RemuxContext ctx;
+        if (!openInput(ctx, inputPath)) {
+            return false;
+        }
+
+        int64_t fileStart = ctx.in->start_time == AV_NOPTS_VALUE ? 0 : ctx.in->start_time;
+        int64_t start = fileStart + int64_t(std::max(startSeconds, 0.0) * AV_TIME_BASE);
+        int64_t end = endSeconds > 0 ? fileStart + int64_t(endSeconds * AV_TIME_BASE) : INT64_MAX;
+        if (end <= start) {
+            logError("Empty trim range %g-%g", startSeconds, endSeconds);
+            return false;
+        }
+
+        // Seeking the video lands every stream on the IDR at or before start.
+        int64_t keyframe = start;
+        int videoIndex = av_find_best_stream(ctx.in, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        if (videoIndex >= 0) {
+            AVStream *st = ctx.in->streams[videoIndex];
+            int64_t ts = av_rescale_q(start, AV_TIME_BASE_Q, st->time_base);
+            if (av_seek_frame(ctx.in, videoIndex, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+                logError("Could not seek %s", inputPath.c_str());
+                return false;
+            }
+            const AVIndexEntry *entry = avformat_index_get_entry_from_timestamp(st, ts, AVSEEK_FLAG_BACKWARD);
+            if (entry) {
+                keyframe = av_rescale_q(entry->timestamp, st->time_base, AV_TIME_BASE_Q);
+            }
+        } else if (av_seek_frame(ctx.in, -1, start, AVSEEK_FLAG_BACKWARD) < 0) {
+            logError("Could not seek %s", inputPath.c_str());
+            return false;
+        }
+
+        if (!openOutput(ctx, outputPath)) {
+            return false;
+        }
+
+        CopyRange range;
+        range.end = end;
+        if (mode == TrimMode::EditList) {
+            // The frames before start get negative timestamps, which the mov
+            // muxer turns into an edit list.
+            range.shift = start;
+            range.audioStart = start;
+        } else {
+            range.shift = keyframe;
+            range.audioStart = keyframe;
+        }
+
+        if (!copyPackets(ctx, range, progress, nullptr) || !finishOutput(ctx)) {
+            logError("Failed to trim %s", inputPath.c_str());
+            return false;
+        }
+        if (progress) progress(1.0f);
+        return true;
+    }
+
+    // The audio and video streams of a file, in order.
+    static std::vector<AVStream *> mediaStreams(AVFormatContext *ctx) {
+        std::vector<AVStream *> streams;
+        for (unsigned i = 0; i < ctx->nb_streams; i ++) {
+            AVMediaType type = ctx->streams[i]->codecpar->codec_type;
+            if (type == AVMEDIA_TYPE_VIDEO || type == AVMEDIA_TYPE_AUDIO) {
+                streams.push_back(ctx->streams[i]);
+            }
+        }
+        return streams;
+    }
+
+    static bool sameParameters(const AVCodecParameters *a, const AVCodecParameters *b) {
+        return a->codec_type == b->codec_type
+            && a->codec_id == b->codec_id
+            && a->width == b->width
+            && a->height == b->height
+            && a->sample_rate == b->sample_rate
+            && a->channels == b->channels
+            && a->extradata_size == b->extradata_size
+            && (a->extradata_size == 0 || memcmp(a->extradata, b->extradata, a->extradata_size) == 0);
+    }
+
+    bool concatFiles(const std::vector<std::string> &inputPaths, const std::string &outputPath,
+                     std::function<void(float)> progress) {
+        if (inputPaths.empty()) return false;
+
+        // Only the headers are read here, a mismatch fails before anything
+        // is written.
+        int64_t totalSize = 0;
+        std::vector<int64_t> sizes;
+        AVFormatContext *first = nullptr;
+        for (const std::string &path : inputPaths) {
+            AVFormatContext *in = nullptr;
+            if (avformat_open_input(&in, path.c_str(), NULL, NULL) < 0) {
+                logError("Could not open %s", path.c_str());
+                if (first) avformat_close_input(&first);
+                return false;
+            }
+            sizes.push_back(std::max<int64_t>(avio_size(in->pb), 0));
+            totalSize += sizes.back();
+
+            if (!first) {
+                first = in;
+                continue;
+            }
+
+            auto expected = mediaStreams(first);
+            auto streams = mediaStreams(in);
+            bool compatible = expected.size() == streams.size();
+            for (size_t i = 0; compatible && i < streams.size(); i ++) {
+                compatible = sameParameters(expected[i]->codecpar, streams[i]->codecpar);
+            }
+            avformat_close_input(&in);
+
+            if (!compatible) {
+                logError("%s doesn't match the parameters of %s", path.c_str(), inputPaths[0].c_str());
+                avformat_close_input(&first);
+                return false;
+            }
+        }
+        avformat_close_input(&first);
+
+        RemuxContext ctx;
+        int64_t offset = 0;
+        int64_t done = 0;
+        bool ok = true;
+        for (size_t i = 0; ok && i < inputPaths.size(); i ++) {
+            if (ctx.in) avformat_close_input(&ctx.in);
+            if (!openInput(ctx, inputPaths[i])) {
+                return false;
+            }
+            if (i == 0) {
+                if (!openOutput(ctx, outputPath)) return false;
+            } else {
+                ctx.streamMap.assign(ctx.in->nb_streams, -1);
+                auto streams = mediaStreams(ctx.in);
+                for (size_t k = 0; k < streams.size(); k ++) {
+                    ctx.streamMap[streams[k]->index] = k;
+                }
+            }
+
+            // Each file continues where the longest stream of the previous one ended.
+            CopyRange range;
+            int64_t fileStart = ctx.in->start_time == AV_NOPTS_VALUE ? 0 : ctx.in->start_time;
+            range.shift = fileStart - offset;
+            range.audioStart = INT64_MIN;
+            range.end = INT64_MAX;
+
+            int64_t size = sizes[i];
+            int64_t end = offset;
+            ok = copyPackets(ctx, range, [&progress, done, size, totalSize] (float p) {
+                if (progress && totalSize > 0) progress((done + p * size) / float(totalSize));
+            }, &end);
+            offset = end;
+            done += size;
+        }
+
+        ok = ok && finishOutput(ctx);
+        if (!ok) {
+            logError("Failed to concatenate into %s", outputPath.c_str());
+            return false;
+        }
+        if (progress) progress(1.0f);
+        return true;
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef VXMT_VCAM_SHARE_REMUXER
+#define VXMT_VCAM_SHARE_REMUXER
+
+#include <string>
+#include <vector>
+#include <functional>
+
+namespace vcamshare {
+
+    // Copies the audio and video packets of inputPath into a new container
+    // picked from the extension of outputPath, without decoding, e.g. to
+    // turn an MPEG-TS recording into mp4 once it is finished. Timestamps
+    // are shifted to start at zero. progress receives values in [0, 1].
+    bool remuxFile(const std::string &inputPath, const std::string &outputPath,
+                   std::function<void(float)> progress);
+
+    enum class TrimMode {
+        // Start at the IDR before startSeconds, the clip may begin early.
+        SnapToKeyframe,
+        // Also copy from that IDR but hide the frames before startSeconds
+        // with an edit list, for mp4 and mov outputs.
+        EditList
+    };
+
+    // Stream copy of [startSeconds, endSeconds) of inputPath, endSeconds
+    // <= 0 copies to the end. Reads and writes packet by packet, memory
+    // doesn't grow with the clip length.
+    bool trimFile(const std::string &inputPath, const std::string &outputPath,
+                  double startSeconds, double endSeconds, TrimMode mode,
+                  std::function<void(float)> progress);
+
+    // Joins recordings of the same session, e.g. the files of a rotation,
+    // into outputPath by stream copy. Every input needs the same streams
+    // with the same codec parameters (SPS/PPS included), which is checked
+    // from the headers before anything is written. Each file's timestamps
+    // continue where the previous file ended.
+    bool concatFiles(const std::vector<std::string> &inputPaths, const std::string &outputPath,
+                     std::function<void(float)> progress);
+}
+
+#endif
@@ -0,0 +1,83 @@
+#include "stream_writer.h"
+#include <iostream>
+
+extern "C" {
+#include <libavutil/mem.h>
+}
+
+// Chunks reach the callback at fragment boundaries or when this fills up.
+static constexpr int AVIO_BUFFER_SIZE = 64 * 1024;
+
+namespace vcamshare {
+
+    StreamWriter::StreamWriter(DataCallback onData) {
+        mOnData = onData;
+        mAvio = nullptr;
+        mBoundary = false;
+        mBytesWritten = 0;
+        mFragmentCount = 0;
+    }
+
+    StreamWriter::~StreamWriter() {
+        close();
+    }
+
+    bool StreamWriter::open() {
+        if(mAvio || !mOnData) return false;
+
+        uint8_t *avioBuffer = static_cast<uint8_t *>(av_malloc(AVIO_BUFFER_SIZE));
+        if(!avioBuffer) {
+            return false;
+        }
+        mAvio = avio_alloc_context(avioBuffer, AVIO_BUFFER_SIZE, 1, this, nullptr, writePacket, nullptr);
+        if(!mAvio) {
+            av_free(avioBuffer);
+            return false;
+        }
+        // avio calls this instead of writePacket and flushes at every marker.
+        mAvio->write_data_type = writeDataType;
+        return true;
+    }
+
+    bool StreamWriter::close() {
+        if(mAvio) {
+            avio_flush(mAvio);
+            bool ok = mAvio->error == 0;
+            av_freep(&mAvio->buffer);
+            avio_context_free(&mAvio);
+            return ok;
+        }
+        return true;
+    }
+
+    AVIOContext *StreamWriter::avioContext() {
+        return mAvio;
+    }
+
+    uint64_t StreamWriter::bytesWritten() {
+        return mBytesWritten;
+    }
+
+    uint64_t StreamWriter::fragmentCount() {
+        return mFragmentCount;
+    }
+
+    int StreamWriter::writePacket(void *opaque, uint8_t *buf, int size) {
+        StreamWriter *w = static_cast<StreamWriter *>(opaque);
+        w->mOnData(buf, size, w->mBoundary);
+        w->mBoundary = false;
+        w->mBytesWritten += size;
+        return size;
+    }
+
+    int StreamWriter::writeDataType(void *opaque, uint8_t *buf, int size,
+                                    enum AVIODataMarkerType type, int64_t) {
+        StreamWriter *w = static_cast<StreamWriter *>(opaque);
+        // avio only passes the marker with the first chunk of a fragment.
+        if(type == AVIO_DATA_MARKER_SYNC_POINT || type == AVIO_DATA_MARKER_BOUNDARY_POINT) {
+            w->mBoundary = true;
+            w->mFragmentCount ++;
+        }
+        return writePacket(opaque, buf, size);
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef VXMT_VCAM_SHARE_STREAM_WRITER
+#define VXMT_VCAM_SHARE_STREAM_WRITER
+
+#include <functional>
+#include <atomic>
+#include <stdint.h>
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+namespace vcamshare {
+
+    // Output for the muxer that hands the muxed bytes to a callback instead
+    // of a file. The AVIOContext can't seek, so the muxer has to write a
+    // streamable format such as fragmented mp4 or MPEG-TS.
+    class StreamWriter {
+    public:
+        // isFragmentBoundary is set on the chunk that starts a new fragment,
+        // the chunks before the first one hold the stream header. data is
+        // only valid during the call.
+        typedef std::function<void(const uint8_t *data, int len, bool isFragmentBoundary)> DataCallback;
+
+        StreamWriter(DataCallback onData);
+        ~StreamWriter();
+
+        bool open();
+        // Hands the buffered bytes to the callback and releases the context.
+        bool close();
+
+        AVIOContext *avioContext();
+        uint64_t bytesWritten();
+        uint64_t fragmentCount();
+
+    private:
+        static int writePacket(void *opaque, uint8_t *buf, int size);
+        static int writeDataType(void *opaque, uint8_t *buf, int size,
+                                 enum AVIODataMarkerType type, int64_t time);
+
+        DataCallback mOnData;
+        AVIOContext *mAvio;
+        bool mBoundary;
+
+        std::atomic<uint64_t> mBytesWritten;
+        std::atomic<uint64_t> mFragmentCount;
+    };
+}
+
+#endif
@@ -0,0 +1,283 @@
+#include "thumbnailer.h"
+#include "logger.h"
+#include <stdio.h>
+#include <chrono>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/error.h>
+}
+
+static constexpr double MAX_GOP_SECONDS = 60;
+
+namespace vcamshare {
+
+    Thumbnailer::Options::Options() {
+        width = 320;
+        height = 0;
+        quality = 5;
+        budgetMs = 0;
+    }
+
+    Thumbnailer::Thumbnailer(const Options &options) {
+        mOptions = options;
+        mDecoder = nullptr;
+        mEncoder = nullptr;
+        mSws = nullptr;
+        mFrame = nullptr;
+        mScaled = nullptr;
+        mJpeg = nullptr;
+        mOverBudget = 0;
+    }
+
+    Thumbnailer::~Thumbnailer() {
+        close();
+    }
+
+    bool Thumbnailer::open(const AVCodecParameters *par) {
+        close();
+
+        const AVCodec *codec = avcodec_find_decoder(par->codec_id);
+        if (!codec) {
+            logError("No decoder for %s", avcodec_get_name(par->codec_id));
+            return false;
+        }
+        mDecoder = avcodec_alloc_context3(codec);
+        if (!mDecoder || avcodec_parameters_to_context(mDecoder, par) < 0) {
+            return false;
+        }
+        // Runs next to the recording, one core is plenty for a single frame.
+        mDecoder->thread_count = 1;
+        mDecoder->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        // Deblocking doesn't survive the downscale anyway.
+        mDecoder->skip_loop_filter = AVDISCARD_ALL;
+        if (avcodec_open2(mDecoder, codec, NULL) < 0) {
+            logError("Could not open the thumbnail decoder");
+            return false;
+        }
+
+        mFrame = av_frame_alloc();
+        mScaled = av_frame_alloc();
+        mJpeg = av_packet_alloc();
+        return mFrame && mScaled && mJpeg;
+    }
+
+    void Thumbnailer::close() {
+        if (mDecoder) avcodec_free_context(&mDecoder);
+        if (mEncoder) avcodec_free_context(&mEncoder);
+        if (mSws) {
+            sws_freeContext(mSws);
+            mSws = nullptr;
+        }
+        if (mFrame) av_frame_free(&mFrame);
+        if (mScaled) av_frame_free(&mScaled);
+        if (mJpeg) av_packet_free(&mJpeg);
+    }
+
+    int Thumbnailer::overBudgetCount() {
+        return mOverBudget;
+    }
+
+    bool Thumbnailer::writeJpeg(const AVPacket *idr, const std::string &path) {
+        if (!mDecoder) return false;
+
+        auto start = std::chrono::steady_clock::now();
+        auto overBudget = [this, &start] () {
+            if (mOptions.budgetMs <= 0) return false;
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            return elapsed > mOptions.budgetMs;
+        };
+
+        // The budget is checked between the steps, a step itself can't be cut short.
+        bool ok = decode(idr) && !overBudget() && scale() && !overBudget() && encode(path);
+        if (!ok && overBudget()) {
+            mOverBudget ++;
+            logWarning("Thumbnail %s dropped, over the budget of %dms", path.c_str(), mOptions.budgetMs);
+        }
+        return ok;
+    }
+
+    bool Thumbnailer::decode(const AVPacket *idr) {
+        // Every thumbnail starts from a clean decoder, no reference frames needed.
+        avcodec_flush_buffers(mDecoder);
+        av_frame_unref(mFrame);
+
+        int ret = avcodec_send_packet(mDecoder, idr);
+        if (ret >= 0) {
+            // Drain, so the frame comes out without waiting for more packets.
+            ret = avcodec_send_packet(mDecoder, NULL);
+        }
+        if (ret >= 0) {
+            ret = avcodec_receive_frame(mDecoder, mFrame);
+        }
+        if (ret < 0) {
+            char mess[256];
+            av_strerror(ret, mess, 256);
+            logError("Could not decode the thumbnail frame: %s", mess);
+            return false;
+        }
+        return true;
+    }
+
+    bool Thumbnailer::scale() {
+        int width = mOptions.width > 0 ? mOptions.width : mFrame->width;
+        int height = mOptions.height > 0 ? mOptions.height
+            : int(int64_t(width) * mFrame->height / mFrame->width);
+        // 4:2:0 needs even sizes.
+        width = (width + 1) & ~1;
+        height = (height + 1) & ~1;
+
+        mSws = sws_getCachedContext(mSws, mFrame->width, mFrame->height, (AVPixelFormat)mFrame->format,
+                                    width, height, AV_PIX_FMT_YUVJ420P, SWS_BILINEAR, NULL, NULL, NULL);
+        if (!mSws) {
+            logError("Could not create the thumbnail scaler");
+            return false;
+        }
+
+        if (mScaled->width != width || mScaled->height != height) {
+            av_frame_unref(mScaled);
+            mScaled->format = AV_PIX_FMT_YUVJ420P;
+            mScaled->width = width;
+            mScaled->height = height;
+            if (av_frame_get_buffer(mScaled, 0) < 0) {
+                return false;
+            }
+        }
+        if (av_frame_make_writable(mScaled) < 0) {
+            return false;
+        }
+
+        sws_scale(mSws, mFrame->data, mFrame->linesize, 0, mFrame->height,
+                  mScaled->data, mScaled->linesize);
+        return true;
+    }
+
+    bool Thumbnailer::encode(const std::string &path) {
+        if (mEncoder && (mEncoder->width != mScaled->width || mEncoder->height != mScaled->height)) {
+            avcodec_free_context(&mEncoder);
+        }
+        if (!mEncoder) {
+            const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+            if (!codec) {
+                logError("No MJPEG encoder");
+                return false;
+            }
+            mEncoder = avcodec_alloc_context3(codec);
+            if (!mEncoder) return false;
+            mEncoder->width = mScaled->width;
+            mEncoder->height = mScaled->height;
+            mEncoder->pix_fmt = AV_PIX_FMT_YUVJ420P;
+            mEncoder->time_base = (AVRational){ 1, 1 };
+            mEncoder->flags |= AV_CODEC_FLAG_QSCALE;
+            mEncoder->global_quality = FF_QP2LAMBDA * mOptions.quality;
+            if (avcodec_open2(mEncoder, codec, NULL) < 0) {
+                logError("Could not open the MJPEG encoder");
+                avcodec_free_context(&mEncoder);
+                return false;
+            }
+        }
+
+        mScaled->pts = 0;
+        mScaled->quality = mEncoder->global_quality;
+        int ret = avcodec_send_frame(mEncoder, mScaled);
+        if (ret >= 0) {
+            ret = avcodec_receive_packet(mEncoder, mJpeg);
+        }
+        if (ret < 0) {
+            logError("Could not encode the thumbnail");
+            return false;
+        }
+
+        std::string tmpPath = path + ".tmp";
+        FILE *file = fopen(tmpPath.c_str(), "wb");
+        bool ok = file && fwrite(mJpeg->data, 1, mJpeg->size, file) == size_t(mJpeg->size);
+        if (file && fclose(file) != 0) ok = false;
+        av_packet_unref(mJpeg);
+
+        if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+            logError("Could not write %s", path.c_str());
+            remove(tmpPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    std::string thumbnailPath(const std::string &outputDir, double seconds) {
+        return outputDir + "/thumb_" + std::to_string(int64_t(seconds * 1000)) + ".jpg";
+    }
+
+    int thumbnailsFromFile(const std::string &inputPath, const std::string &outputDir,
+                           double intervalSeconds, const Thumbnailer::Options &options,
+                           std::function<void(const std::string &, double)> onThumbnail) {
+        AVFormatContext *in = nullptr;
+        if (avformat_open_input(&in, inputPath.c_str(), NULL, NULL) < 0) {
+            logError("Could not open %s", inputPath.c_str());
+            return -1;
+        }
+        int videoIndex = -1;
+        if (avformat_find_stream_info(in, NULL) >= 0) {
+            videoIndex = av_find_best_stream(in, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        }
+
+        Thumbnailer thumbnailer(options);
+        if (videoIndex < 0 || !thumbnailer.open(in->streams[videoIndex]->codecpar)) {
+            avformat_close_input(&in);
+            return -1;
+        }
+
+        AVStream *st = in->streams[videoIndex];
+        int64_t start = in->start_time == AV_NOPTS_VALUE ? 0 : in->start_time;
+        if (intervalSeconds <= 0) intervalSeconds = 1;
+
+        int64_t duration = in->duration;
+        if (duration == AV_NOPTS_VALUE && st->duration != AV_NOPTS_VALUE) {
+            duration = av_rescale_q(st->duration, st->time_base, AV_TIME_BASE_Q);
+        }
+
+        int written = 0;
+        int64_t lastKeyframe = AV_NOPTS_VALUE;
+        double repeatedSeconds = 0;
+        AVPacket *pkt = av_packet_alloc();
+        for (int i = 0; ; i ++) {
+            double at = i * intervalSeconds;
+            if (duration != AV_NOPTS_VALUE && at * AV_TIME_BASE >= duration) break;
+            // Without a duration, the end shows as the same IDR coming back
+            // for longer than any GOP lasts.
+            if (repeatedSeconds > MAX_GOP_SECONDS) break;
+
+            // The index takes the seek straight to the IDR at or before the target.
+            int64_t ts = av_rescale_q(start + int64_t(at * AV_TIME_BASE), AV_TIME_BASE_Q, st->time_base);
+            if (av_seek_frame(in, videoIndex, ts, AVSEEK_FLAG_BACKWARD) < 0) break;
+
+            bool found = false;
+            while (av_read_frame(in, pkt) >= 0) {
+                if (pkt->stream_index == videoIndex && (pkt->flags & AV_PKT_FLAG_KEY)) {
+                    found = true;
+                    break;
+                }
+                av_packet_unref(pkt);
+            }
+            if (!found) break;
+
+            // Intervals shorter than the GOP land on the same IDR again.
+            int64_t keyframe = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+            if (keyframe == lastKeyframe) {
+                repeatedSeconds += intervalSeconds;
+            } else {
+                lastKeyframe = keyframe;
+                repeatedSeconds = 0;
+                double seconds = (keyframe - av_rescale_q(start, AV_TIME_BASE_Q, st->time_base)) * av_q2d(st->time_base);
+                std::string path = thumbnailPath(outputDir, seconds);
+                if (thumbnailer.writeJpeg(pkt, path)) {
+                    written ++;
+                    if (onThumbnail) onThumbnail(path, seconds);
+                }
+            }
+            av_packet_unref(pkt);
+        }
+        av_packet_free(&pkt);
+        avformat_close_input(&in);
+        return written;
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef VXMT_VCAM_SHARE_THUMBNAILER
+#define VXMT_VCAM_SHARE_THUMBNAILER
+
+#include <string>
+#include <functional>
+#include <atomic>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+}
+
+namespace vcamshare {
+
+    // Turns single IDR packets into JPEG files: decode on one thread without
+    // the loop filter, scale with swscale, encode with MJPEG. Nothing but
+    // IDRs is ever decoded, so the cost doesn't depend on the GOP.
+    class Thumbnailer {
+    public:
+        struct Options {
+            int width;      // 0 keeps the video width
+            int height;     // 0 follows the aspect ratio
+            int quality;    // JPEG qscale, 2 (best) to 31
+            int budgetMs;   // give up on a thumbnail taking longer, 0 for no limit
+            Options();
+        };
+
+        Thumbnailer(const Options &options);
+        ~Thumbnailer();
+
+        // par describes the video the packets come from, SPS/PPS included.
+        bool open(const AVCodecParameters *par);
+        void close();
+
+        // Writes the JPEG next to path and renames it into place, so a
+        // reader never sees half a file.
+        bool writeJpeg(const AVPacket *idr, const std::string &path);
+
+        // Thumbnails dropped over budgetMs, safe from any thread.
+        int overBudgetCount();
+
+    private:
+        bool decode(const AVPacket *idr);
+        bool scale();
+        bool encode(const std::string &path);
+
+        Options mOptions;
+        AVCodecContext *mDecoder;
+        AVCodecContext *mEncoder;
+        SwsContext *mSws;
+        AVFrame *mFrame;
+        AVFrame *mScaled;
+        AVPacket *mJpeg;
+        std::atomic<int> mOverBudget;
+    };
+
+    // Writes a thumbnail about every intervalSeconds of inputPath into
+    // outputDir as thumb_<milliseconds>.jpg. Seeks through the keyframe
+    // index and reads only the IDR packets it decodes. Returns the number
+    // of thumbnails written, -1 if the file can't be read.
+    int thumbnailsFromFile(const std::string &inputPath, const std::string &outputDir,
+                           double intervalSeconds, const Thumbnailer::Options &options,
+                           std::function<void(const std::string &, double)> onThumbnail);
+
+    std::string thumbnailPath(const std::string &outputDir, double seconds);
+}
+
+#endif
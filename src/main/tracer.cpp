@@ -0,0 +1,155 @@
+#include "tracer.h"
+#include <stdio.h>
+#include <chrono>
+#include <algorithm>
+
+namespace vcamshare {
+
+    Tracer &Tracer::shared() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    Tracer::Tracer() {
+        mEnabled = false;
+        mNextTid = 0;
+        mEpoch = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void Tracer::setEnabled(bool enabled) {
+        mEnabled = enabled;
+    }
+
+    uint64_t Tracer::nowUs() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count() - mEpoch;
+    }
+
+    // A thread that ends leaves its buffer behind, so the events outlive it
+    // until they are dumped or cleared.
+    struct Tracer::ThreadSlot {
+        const char *name;
+        ThreadBuffer *buffer;
+
+        ThreadSlot() : name(nullptr), buffer(nullptr) {
+        }
+
+        ~ThreadSlot() {
+            if(buffer) {
+                std::unique_lock<std::mutex> l(buffer->mutx);
+                buffer->exited = true;
+            }
+        }
+    };
+
+    Tracer::ThreadSlot &Tracer::threadSlot() {
+        static thread_local ThreadSlot slot;
+        return slot;
+    }
+
+    Tracer::ThreadBuffer *Tracer::threadBuffer() {
+        ThreadSlot &slot = threadSlot();
+        if(!slot.buffer) {
+            std::shared_ptr<ThreadBuffer> created(new ThreadBuffer());
+            created->name = slot.name;
+            created->next = 0;
+            created->wrapped = false;
+            created->exited = false;
+            created->events.resize(EVENTS_PER_THREAD);
+
+            std::unique_lock<std::mutex> l(mBuffersMutx);
+            created->tid = ++ mNextTid;
+            mBuffers.push_back(created);
+            slot.buffer = created.get();
+        }
+        return slot.buffer;
+    }
+
+    void Tracer::record(const char *name, uint64_t startUs, uint64_t durationUs, int64_t frame) {
+        // A scope that began before tracing was turned off still ends here.
+        if(!enabled() && !threadSlot().buffer) return;
+        ThreadBuffer *buffer = threadBuffer();
+        std::unique_lock<std::mutex> l(buffer->mutx);
+        buffer->events[buffer->next] = { name, startUs, durationUs, frame };
+        if(++ buffer->next == buffer->events.size()) {
+            buffer->next = 0;
+            buffer->wrapped = true;
+        }
+    }
+
+    void Tracer::setThreadName(const char *name) {
+        ThreadSlot &slot = threadSlot();
+        slot.name = name;
+        if(slot.buffer) {
+            std::unique_lock<std::mutex> l(slot.buffer->mutx);
+            slot.buffer->name = name;
+        }
+    }
+
+    bool Tracer::dump(const std::string &filePath) {
+        FILE *file = fopen(filePath.c_str(), "w");
+        if(!file) return false;
+
+        std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+        {
+            std::unique_lock<std::mutex> l(mBuffersMutx);
+            buffers = mBuffers;
+        }
+
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        bool first = true;
+        for(auto &buffer : buffers) {
+            // Copied out so the thread isn't held up by the file writes.
+            std::vector<Event> events;
+            const char *name;
+            {
+                std::unique_lock<std::mutex> l(buffer->mutx);
+                name = buffer->name;
+                if(buffer->wrapped) {
+                    events.insert(events.end(), buffer->events.begin() + buffer->next, buffer->events.end());
+                }
+                events.insert(events.end(), buffer->events.begin(), buffer->events.begin() + buffer->next);
+            }
+
+            if(name) {
+                fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                        first ? "" : ",\n", buffer->tid, name);
+                first = false;
+            }
+            for(auto &event : events) {
+                fprintf(file, "%s{\"ph\":\"X\",\"name\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%llu,\"dur\":%llu",
+                        first ? "" : ",\n", event.name, buffer->tid,
+                        (unsigned long long)event.startUs, (unsigned long long)event.durationUs);
+                if(event.frame >= 0) {
+                    fprintf(file, ",\"args\":{\"frame\":%lld}", (long long)event.frame);
+                }
+                fputc('}', file);
+                first = false;
+            }
+        }
+        fprintf(file, "\n]}\n");
+        dropExited();
+        return fclose(file) == 0;
+    }
+
+    void Tracer::clear() {
+        dropExited();
+        std::unique_lock<std::mutex> l(mBuffersMutx);
+        for(auto &buffer : mBuffers) {
+            std::unique_lock<std::mutex> bl(buffer->mutx);
+            buffer->next = 0;
+            buffer->wrapped = false;
+        }
+    }
+
+    // Every FileWriter runs a thread per file, their buffers would pile up.
+    void Tracer::dropExited() {
+        std::unique_lock<std::mutex> l(mBuffersMutx);
+        auto end = std::remove_if(mBuffers.begin(), mBuffers.end(), [] (const std::shared_ptr<ThreadBuffer> &buffer) {
+            std::unique_lock<std::mutex> bl(buffer->mutx);
+            return buffer->exited;
+        });
+        mBuffers.erase(end, mBuffers.end());
+    }
+}
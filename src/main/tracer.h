@@ -0,0 +1,114 @@
+#ifndef VXMT_VCAM_SHARE_TRACER
+#define VXMT_VCAM_SHARE_TRACER
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+
+namespace vcamshare {
+
+    // Records how long each stage of the pipeline takes, per frame and per
+    // thread, and writes them as Chrome trace events that Perfetto and
+    // chrome://tracing open. Every thread appends to a buffer of its own
+    // that keeps the latest EVENTS_PER_THREAD events. A thread only gets one
+    // with its first event while enabled, and the buffer of a thread that
+    // ended is freed once dumped or cleared. Does nothing until enabled, and
+    // the VCAM_TRACE macros compile to nothing without VCAMSHARE_TRACE.
+    class Tracer {
+    public:
+        static constexpr size_t EVENTS_PER_THREAD = 1 << 16;
+
+        static Tracer &shared();
+
+        void setEnabled(bool enabled);
+        bool enabled() {
+            return mEnabled.load(std::memory_order_relaxed);
+        }
+
+        // name must be a string literal, only the pointer is kept. frame is
+        // the id writeVideoFrames or writeRawAudioFrames counted the frame
+        // as, -1 for none.
+        void record(const char *name, uint64_t startUs, uint64_t durationUs, int64_t frame);
+        // Shown instead of the thread number in the trace.
+        void setThreadName(const char *name);
+        uint64_t nowUs();
+
+        // Writes the recorded events as trace event JSON, false if the file
+        // can't be written.
+        bool dump(const std::string &filePath);
+        void clear();
+
+    private:
+        struct Event {
+            const char *name;
+            uint64_t startUs;
+            uint64_t durationUs;
+            int64_t frame;
+        };
+
+        struct ThreadBuffer {
+            int tid;
+            const char *name;
+            std::vector<Event> events;
+            size_t next;
+            bool wrapped;
+            bool exited;
+            // Only contended while dumping.
+            std::mutex mutx;
+        };
+        struct ThreadSlot;
+
+        Tracer();
+        static ThreadSlot &threadSlot();
+        ThreadBuffer *threadBuffer();
+        void dropExited();
+
+        std::atomic<bool> mEnabled;
+        std::vector<std::shared_ptr<ThreadBuffer>> mBuffers;
+        std::mutex mBuffersMutx;
+        int mNextTid;
+        int64_t mEpoch;
+    };
+
+    // Times the enclosing scope as one event.
+    class TraceScope {
+    public:
+        TraceScope(const char *name, int64_t frame) {
+            Tracer &tracer = Tracer::shared();
+            mName = tracer.enabled() ? name : nullptr;
+            if(mName) {
+                mFrame = frame;
+                mStartUs = tracer.nowUs();
+            }
+        }
+
+        ~TraceScope() {
+            if(mName) {
+                Tracer &tracer = Tracer::shared();
+                tracer.record(mName, mStartUs, tracer.nowUs() - mStartUs, mFrame);
+            }
+        }
+
+    private:
+        const char *mName;
+        uint64_t mStartUs;
+        int64_t mFrame;
+    };
+}
+
+#define VCAM_TRACE_CONCAT_(a, b) a##b
+#define VCAM_TRACE_CONCAT(a, b) VCAM_TRACE_CONCAT_(a, b)
+
+#ifdef VCAMSHARE_TRACE
+#define VCAM_TRACE_SCOPE(name, frame) \
+    vcamshare::TraceScope VCAM_TRACE_CONCAT(traceScope, __LINE__)(name, frame)
+#define VCAM_TRACE_THREAD_NAME(name) vcamshare::Tracer::shared().setThreadName(name)
+#else
+#define VCAM_TRACE_SCOPE(name, frame) do {} while(0)
+#define VCAM_TRACE_THREAD_NAME(name) do { (void)(name); } while(0)
+#endif
+
+#endif
@@ -1,25 +1,45 @@
 #include "vcamshare.h"
 #include "video_muxer.h"
+#include "faststart.h"
+#include "remuxer.h"
+#include "logger.h"
+#include "tracer.h"
 #include <map>
 #include <memory>
-#include <iostream>
+#include <mutex>
+#include <string.h>
+
+// The C API is called from any thread, several muxers at once, so the
+// handles are only looked up and changed under gMutx.
+static std::mutex gMutx;
 
 static int gHandler = 1;
 
-static std::map<int, std::unique_ptr<vcamshare::VideoMuxer>> gVideoMuxers;
+static std::map<int, std::shared_ptr<vcamshare::VideoMuxer>> gVideoMuxers;
+
+// The muxer behind hd, null if there is none. A call still using it when
+// another thread closes the handle keeps it alive until it returns, the
+// last one out closes it.
+static std::shared_ptr<vcamshare::VideoMuxer> findMuxer(int hd) {
+    std::lock_guard<std::mutex> lock(gMutx);
+    auto it = gVideoMuxers.find(hd);
+    return it != gVideoMuxers.end() ? it->second : nullptr;
+}
 
 int createVideoMuxer(int w, int h, int videoFrameRate, const char* filePath) {
-    auto p = std::unique_ptr<vcamshare::VideoMuxer>(new vcamshare::VideoMuxer(w, h, videoFrameRate, filePath));
+    auto p = std::make_shared<vcamshare::VideoMuxer>(w, h, videoFrameRate, filePath);
 
-    gVideoMuxers[gHandler] = std::move(p);
+    std::lock_guard<std::mutex> lock(gMutx);
     auto hd = gHandler;
     gHandler ++;
+    gVideoMuxers[hd] = std::move(p);
     return hd;
 }
 
 int checkVideoMuxerError(int hd) {
-    if(gVideoMuxers[hd]) {
-        if(gVideoMuxers[hd]->hasError()) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        if(muxer->hasError()) {
             return 1;
         }
     }
@@ -28,66 +48,442 @@ int checkVideoMuxerError(int hd) {
 
 
 void closeVideoMuxer(int hd) {
-    gVideoMuxers[hd] = nullptr;
+    std::shared_ptr<vcamshare::VideoMuxer> muxer;
+    {
+        std::lock_guard<std::mutex> lock(gMutx);
+        auto it = gVideoMuxers.find(hd);
+        if(it == gVideoMuxers.end()) return;
+        muxer = std::move(it->second);
+        gVideoMuxers.erase(it);
+    }
+    // Closing waits for the file to be finished, not while holding gMutx.
+    // A call still in flight on the handle closes it when it returns.
+    muxer.reset();
 }
 
 int writeVideoFrames(int hd, uint8_t * const data, int len) {
-    if(gVideoMuxers[hd]) {
-        return gVideoMuxers[hd]->writeVideoFrames(data, len) ? 1 : 0;
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        return muxer->writeVideoFrames(data, len) ? 1 : 0;
     } else {
-        std::cerr << "muxer not found!" << std::endl;
+        vcamshare::logError("muxer not found!");
     }
     return 0;
 }
 
 int writeRawAudioFrames(int hd, float * const data, int len, bool isMute) {
-    if(gVideoMuxers[hd]) {
-        return gVideoMuxers[hd]->writeRawAudioFrames(data, len, isMute) ? 1 : 0;
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        return muxer->writeRawAudioFrames(data, len, isMute) ? 1 : 0;
     } else {
-        std::cerr << "muxer not found!" << std::endl;
+        vcamshare::logError("muxer not found!");
     }
     return 0;
 }
 
 void syncAudioDts(int hd) {
-    if(gVideoMuxers[hd]) {
-        return gVideoMuxers[hd]->syncAudioDts();
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        return muxer->syncAudioDts();
     } else {
-        std::cerr << "muxer not found!" << std::endl;
+        vcamshare::logError("muxer not found!");
     }
 }
 
 int writeAudioFrames(int hd, uint8_t * const data, int len) {
-    if(gVideoMuxers[hd]) {
-        return gVideoMuxers[hd]->writeAudioFrames(data, len) ? 1 : 0;
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        return muxer->writeAudioFrames(data, len) ? 1 : 0;
     } else {
-        std::cerr << "muxer not found!" << std::endl;
+        vcamshare::logError("muxer not found!");
     }
     return 0;
 }
 
 int videoMuxerIsOpen(int hd) {
-    if(gVideoMuxers[hd]) {
-        return gVideoMuxers[hd]->isOpen() ? 1 : 0;
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        return muxer->isOpen() ? 1 : 0;
     }
     return 0;
 }
 
 int videoMuxerGetAudioSampleRate(int hd) {
-    if(gVideoMuxers[hd]) {
-        return gVideoMuxers[hd]->audioSampleRate();
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        return muxer->audioSampleRate();
     }
     return 0;
 }
 
 void videoMuxerPause(int hd) {
-    if(gVideoMuxers[hd]) {
-        gVideoMuxers[hd]->pause();
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        muxer->pause();
     }
 }
 
 void videoMuxerResume(int hd) {
-    if(gVideoMuxers[hd]) {
-        gVideoMuxers[hd]->resume();
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        muxer->resume();
+    }
+}
+
+void videoMuxerSetResumeFromCachedGop(int hd, int enable) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        muxer->setResumeFromCachedGop(enable != 0);
+    }
+}
+
+void videoMuxerSetKeyframeRequestCallback(int hd, VideoMuxerKeyframeRequestCallback cb, void *userData) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        std::function<void()> request;
+        if(cb) {
+            request = [cb, userData] () {
+                cb(userData);
+            };
+        }
+        muxer->setKeyframeRequestCallback(request);
+    }
+}
+
+void videoMuxerSetIOBufferSize(int hd, int bytes) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        muxer->setIOBufferSize(bytes);
+    }
+}
+
+void videoMuxerSetPreallocate(int hd, int enable) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        muxer->setPreallocate(enable != 0);
+    }
+}
+
+void videoMuxerSetSyncPolicy(int hd, int policy, int syncBytes) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        auto p = vcamshare::FileWriter::SyncPolicy::None;
+        if(policy == VideoMuxerSyncBytes) {
+            p = vcamshare::FileWriter::SyncPolicy::Bytes;
+        } else if(policy == VideoMuxerSyncFragment) {
+            p = vcamshare::FileWriter::SyncPolicy::Fragment;
+        }
+        muxer->setSyncPolicy(p, syncBytes);
+    }
+}
+
+void videoMuxerSetFastStart(int hd, int enable, VideoMuxerProgressCallback cb, void *userData) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        std::function<void(const std::string &, float)> progress;
+        if(cb) {
+            progress = [cb, userData] (const std::string &filePath, float p) {
+                cb(filePath.c_str(), p, userData);
+            };
+        }
+        muxer->setFastStart(enable != 0, progress);
+    }
+}
+
+int videoFileFastStart(const char *filePath, VideoMuxerProgressCallback cb, void *userData) {
+    std::string path = filePath;
+    bool ok = vcamshare::faststartFile(path, [cb, userData, &path] (float p) {
+        if(cb) cb(path.c_str(), p, userData);
+    });
+    if(!ok && cb) cb(filePath, -1, userData);
+    return ok ? 1 : 0;
+}
+
+void videoMuxerSetRotation(int hd, int seconds, int64_t bytes) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        muxer->setRotation(seconds, bytes);
+    }
+}
+
+void videoMuxerSetHlsOutput(int hd, int segmentSeconds, int listSize, int fmp4) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        muxer->setHlsOutput(segmentSeconds, listSize, fmp4 != 0);
+    }
+}
+
+void videoMuxerSetMpegTsOutput(int hd, int pcrPeriodMs, int patPeriodMs) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        muxer->setMpegTsOutput(pcrPeriodMs, patPeriodMs);
+    }
+}
+
+int videoFileRemux(const char *inputPath, const char *outputPath, VideoMuxerProgressCallback cb, void *userData) {
+    std::string path = outputPath;
+    bool ok = vcamshare::remuxFile(inputPath, path, [cb, userData, &path] (float p) {
+        if(cb) cb(path.c_str(), p, userData);
+    });
+    if(!ok && cb) cb(outputPath, -1, userData);
+    return ok ? 1 : 0;
+}
+int videoFileTrim(const char *inputPath, const char *outputPath, double startSeconds, double endSeconds,
+                  int exactStart, VideoMuxerProgressCallback cb, void *userData) {
+    std::string path = outputPath;
+    auto mode = exactStart ? vcamshare::TrimMode::EditList : vcamshare::TrimMode::SnapToKeyframe;
+    bool ok = vcamshare::trimFile(inputPath, path, startSeconds, endSeconds, mode, [cb, userData, &path] (float p) {
+        if(cb) cb(path.c_str(), p, userData);
+    });
+    if(!ok && cb) cb(outputPath, -1, userData);
+    return ok ? 1 : 0;
+}
+
+int videoFileConcat(const char **inputPaths, int count, const char *outputPath,
+                    VideoMuxerProgressCallback cb, void *userData) {
+    std::vector<std::string> inputs(inputPaths, inputPaths + (count > 0 ? count : 0));
+    std::string path = outputPath;
+    bool ok = vcamshare::concatFiles(inputs, path, [cb, userData, &path] (float p) {
+        if(cb) cb(path.c_str(), p, userData);
+    });
+    if(!ok && cb) cb(outputPath, -1, userData);
+    return ok ? 1 : 0;
+}
+
+int videoMuxerAddFileSink(int hd, const char *filePath, int maxSeconds) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        auto options = muxer->options();
+        options.format = vcamshare::MuxerSink::Format::Auto;
+        options.rotateSeconds = 0;
+        options.rotateBytes = 0;
+        options.maxSeconds = maxSeconds < 0 ? 0 : maxSeconds;
+        return muxer->addSink(filePath, options);
+    }
+    return -1;
+}
+
+int videoMuxerAddHlsSink(int hd, const char *dirPath, int segmentSeconds, int listSize, int fmp4) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        auto options = muxer->options();
+        options.format = vcamshare::MuxerSink::Format::Hls;
+        options.hlsSegmentSeconds = segmentSeconds > 0 ? segmentSeconds : 2;
+        options.hlsListSize = listSize < 0 ? 0 : listSize;
+        options.hlsFmp4 = fmp4 != 0;
+        options.fastStart = false;
+        options.rotateSeconds = 0;
+        options.rotateBytes = 0;
+        options.maxSeconds = 0;
+        return muxer->addSink(dirPath, options);
+    }
+    return -1;
+}
+
+int videoMuxerAddCallbackSink(int hd, VideoMuxerDataCallback cb, int mpegts, void *userData) {
+    auto muxer = findMuxer(hd);
+    if(muxer && cb) {
+        vcamshare::MuxerSink::Options options;
+        options.format = mpegts ? vcamshare::MuxerSink::Format::MpegTs : vcamshare::MuxerSink::Format::Auto;
+        options.onData = [cb, userData] (const uint8_t *data, int len, bool isFragmentBoundary) {
+            cb(data, len, isFragmentBoundary ? 1 : 0, userData);
+        };
+        return muxer->addSink("callback", options);
+    }
+    return -1;
+}
+
+void videoMuxerRemoveSink(int hd, int sinkId) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        muxer->removeSink(sinkId);
+    }
+}
+
+int videoMuxerSinkHasError(int hd, int sinkId) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        return muxer->sinkHasError(sinkId) ? 1 : 0;
+    }
+    return 0;
+}
+
+void videoMuxerSetPreEventBuffer(int hd, int seconds, int64_t maxBytes) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        muxer->setPreEventBuffer(seconds, maxBytes);
+    }
+}
+
+void videoMuxerTriggerRecording(int hd) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        muxer->triggerRecording();
+    }
+}
+
+static std::function<void(const std::string &, double)> thumbnailCallback(VideoMuxerThumbnailCallback cb, void *userData) {
+    std::function<void(const std::string &, double)> onThumbnail;
+    if(cb) {
+        onThumbnail = [cb, userData] (const std::string &path, double seconds) {
+            cb(path.c_str(), seconds, userData);
+        };
+    }
+    return onThumbnail;
+}
+
+void videoMuxerSetThumbnails(int hd, const char *dirPath, double intervalSeconds, int width, int budgetMs,
+                             VideoMuxerThumbnailCallback cb, void *userData) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        vcamshare::Thumbnailer::Options options;
+        options.width = width;
+        options.budgetMs = budgetMs;
+        muxer->setThumbnails(dirPath, intervalSeconds, options, thumbnailCallback(cb, userData));
     }
-}
\ No newline at end of file
+}
+
+int videoFileThumbnails(const char *filePath, const char *dirPath, double intervalSeconds, int width, int budgetMs,
+                        VideoMuxerThumbnailCallback cb, void *userData) {
+    vcamshare::Thumbnailer::Options options;
+    options.width = width;
+    options.budgetMs = budgetMs;
+    return vcamshare::thumbnailsFromFile(filePath, dirPath, intervalSeconds, options, thumbnailCallback(cb, userData));
+}
+
+void videoMuxerSetTimeLapse(int hd, int keepEveryNthIdr, int playbackFps) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        muxer->setTimeLapse(keepEveryNthIdr, playbackFps);
+    }
+}
+
+void videoMuxerSetProxy(int hd, const char *proxyPath, int width, int bitRate) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        vcamshare::ProxyTranscoder::Options options;
+        if(width > 0) options.width = width;
+        if(bitRate > 0) options.bitRate = bitRate;
+        muxer->setProxy(proxyPath, options);
+    }
+}
+
+static void copyLatency(const vcamshare::LatencyHistogram::Snapshot &from, VideoMuxerLatency *to) {
+    to->count = from.count;
+    to->totalUs = from.totalUs;
+    to->maxUs = from.maxUs;
+    for(int i = 0; i < VIDEO_MUXER_LATENCY_BUCKETS && i < vcamshare::LatencyHistogram::BUCKETS; i ++) {
+        to->buckets[i] = from.buckets[i];
+    }
+}
+
+static void copyPercentiles(const vcamshare::LatencyWindow::Snapshot &from, VideoMuxerPercentiles *to) {
+    to->count = from.count;
+    to->p50Us = from.p50Us;
+    to->p99Us = from.p99Us;
+    to->maxUs = from.maxUs;
+}
+
+int videoMuxerGetStats(int hd, VideoMuxerStats *stats) {
+    auto muxer = findMuxer(hd);
+    if(!muxer || !stats) return 0;
+
+    auto s = muxer->stats();
+    memset(stats, 0, sizeof(VideoMuxerStats));
+    stats->videoFramesIn = s.videoFramesIn;
+    stats->videoBytesIn = s.videoBytesIn;
+    stats->videoFramesDropped = s.videoFramesDropped;
+    stats->audioFramesIn = s.audioFramesIn;
+    stats->audioBytesIn = s.audioBytesIn;
+    stats->audioFramesDropped = s.audioFramesDropped;
+    stats->videoPacketsOut = s.videoPacketsOut;
+    stats->videoBytesOut = s.videoBytesOut;
+    stats->audioPacketsOut = s.audioPacketsOut;
+    stats->audioBytesOut = s.audioBytesOut;
+    stats->videoQueueDepth = s.videoQueueDepth;
+    stats->videoQueueHighWater = s.videoQueueHighWater;
+    stats->audioQueueDepth = s.audioQueueDepth;
+    stats->audioQueueHighWater = s.audioQueueHighWater;
+    stats->avDriftMs = s.avDriftMs;
+    stats->writeErrors = s.writeErrors;
+    copyLatency(s.encodeLatency, &stats->encodeLatency);
+    copyLatency(s.writeLatency, &stats->writeLatency);
+    copyPercentiles(s.ingestToWrite, &stats->ingestToWriteLatency);
+    copyPercentiles(s.ingestToDisk, &stats->ingestToDiskLatency);
+    stats->thumbnailsOverBudget = s.thumbnailsOverBudget;
+    stats->proxyPacketsDropped = s.proxyPacketsDropped;
+    return 1;
+}
+
+void videoMuxerSetLogCallback(VideoMuxerLogCallback cb, int minLevel, void *userData) {
+    auto &logger = vcamshare::Logger::shared();
+    if(minLevel < VIDEO_MUXER_LOG_DEBUG) minLevel = VIDEO_MUXER_LOG_DEBUG;
+    if(minLevel > VIDEO_MUXER_LOG_ERROR) minLevel = VIDEO_MUXER_LOG_ERROR;
+    logger.setLevel(vcamshare::LogLevel(minLevel));
+    if(cb) {
+        logger.setSink([cb, userData] (vcamshare::LogLevel level, const char *message) {
+            cb(int(level), message, userData);
+        });
+    } else {
+        logger.setSink(nullptr);
+    }
+}
+
+void videoMuxerFlushLog(void) {
+    vcamshare::Logger::shared().flush();
+}
+
+int videoMuxerSetTracing(int enable) {
+#ifdef VCAMSHARE_TRACE
+    vcamshare::Tracer::shared().setEnabled(enable != 0);
+    return 1;
+#else
+    (void)enable;
+    return 0;
+#endif
+}
+
+int videoMuxerDumpTrace(const char *jsonPath) {
+    auto &tracer = vcamshare::Tracer::shared();
+    if(!tracer.dump(jsonPath)) return 0;
+    tracer.clear();
+    return 1;
+}
+
+void videoMuxerSetMaxQueuedFrames(int hd, int frames) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        muxer->setMaxQueuedFrames(frames);
+    }
+}
+
+void videoMuxerSetEventCallback(int hd, VideoMuxerEventCallback cb, void *userData) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        vcamshare::MuxerSink::EventCallback onEvent;
+        if(cb) {
+            onEvent = [cb, userData] (vcamshare::MuxerSink::Event event, const std::string &filePath, int64_t value) {
+                cb(int(event), filePath.c_str(), value, userData);
+            };
+        }
+        muxer->setEventCallback(onEvent);
+    }
+}
+
+void videoMuxerSetRecovery(int hd, int maxRecoveries) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        muxer->setRecovery(maxRecoveries);
+    }
+}
+
+void videoMuxerSetDiskGovernor(int hd, int64_t floorBytes, int warnSeconds, const char *reclaimDir) {
+    auto muxer = findMuxer(hd);
+    if(muxer) {
+        vcamshare::DiskGovernor::Options options;
+        options.floorBytes = floorBytes > 0 ? floorBytes : 0;
+        if(warnSeconds > 0) options.warnSeconds = warnSeconds;
+        options.reclaimDir = reclaimDir ? reclaimDir : "";
+        muxer->setDiskGovernor(options);
+    }
+}
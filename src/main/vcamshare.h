@@ -2,6 +2,9 @@
 #define VXMT_VCAM_SHARE_PUBLIC
 #include "stdint.h"
 
+// Muxers can be created, used and closed from any thread, several at once.
+// A handle used while it is being closed is closed once that call returns,
+// calls after the close find no muxer.
 #ifdef __cplusplus
 extern "C"
 #endif
@@ -57,5 +60,350 @@ extern "C"
 #endif
 void videoMuxerResume(int hd);
 
+// While paused keep the frames since the latest IDR, so resume continues
+// from that IDR without waiting for the camera's next one. The file then
+// includes up to one GOP from before the resume.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerSetResumeFromCachedGop(int hd, int enable);
+
+typedef void (*VideoMuxerKeyframeRequestCallback)(void *userData);
+
+// Called on resume when frames are dropped until the next IDR, e.g. to
+// ask the encoder for a keyframe right away.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerSetKeyframeRequestCallback(int hd, VideoMuxerKeyframeRequestCallback cb, void *userData);
+
+// Size in bytes of the write buffers, e.g. 1-4 MiB. 0 writes through avio_open.
+// Call before the first frame.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerSetIOBufferSize(int hd, int bytes);
+
+// Preallocate file space ahead of the writes to limit fragmentation and
+// detect a full disk early. Needs the write buffers.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerSetPreallocate(int hd, int enable);
+
+enum VideoMuxerSyncPolicy {
+    VideoMuxerSyncNone = 0,
+    VideoMuxerSyncBytes = 1,    // fdatasync every syncBytes
+    VideoMuxerSyncFragment = 2  // fdatasync at each keyframe, once per GOP
+};
+
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerSetSyncPolicy(int hd, int policy, int syncBytes);
+
+// progress is in [0, 1], -1 when the operation failed.
+typedef void (*VideoMuxerProgressCallback)(const char *filePath, float progress, void *userData);
+
+// Relocate the moov of each finished file to the front on a low priority
+// thread so the file can be played while it downloads.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerSetFastStart(int hd, int enable, VideoMuxerProgressCallback cb, void *userData);
+
+// Same for an existing mp4 file, runs on the calling thread. Returns 1 on success.
+#ifdef __cplusplus
+extern "C"
+#endif
+int videoFileFastStart(const char *filePath, VideoMuxerProgressCallback cb, void *userData);
+
+// Split the recording into files of about seconds or bytes (0 disables
+// either), cut at the next IDR. The first file uses the given path, the
+// next ones append _1, _2, ... to its name.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerSetRotation(int hd, int seconds, int64_t bytes);
+
+// Record as HLS: filePath of createVideoMuxer names a directory that gets
+// index.m3u8 and fMP4 (fmp4 = 1) or TS segments of segmentSeconds.
+// listSize 0 keeps every segment listed, otherwise the playlist rolls.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerSetHlsOutput(int hd, int segmentSeconds, int listSize, int fmp4);
+
+// Record MPEG-TS: every byte written is playable, nothing is lost on a
+// crash and there is no finalization cost. 0 keeps the muxer defaults for
+// the PCR and PAT/PMT intervals.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerSetMpegTsOutput(int hd, int pcrPeriodMs, int patPeriodMs);
+
+// Copy the streams of a file into the container given by the extension of
+// outputPath without re-encoding, e.g. a finished .ts recording into .mp4.
+// Runs on the calling thread. Returns 1 on success.
+#ifdef __cplusplus
+extern "C"
+#endif
+int videoFileRemux(const char *inputPath, const char *outputPath, VideoMuxerProgressCallback cb, void *userData);
+
+// Cut [startSeconds, endSeconds) of a recording into outputPath without
+// re-encoding, endSeconds <= 0 keeps the rest. The clip starts at the IDR
+// before startSeconds; with exactStart = 1 an edit list hides the frames
+// before startSeconds (mp4/mov only). Runs on the calling thread.
+// Returns 1 on success.
+#ifdef __cplusplus
+extern "C"
+#endif
+int videoFileTrim(const char *inputPath, const char *outputPath, double startSeconds, double endSeconds,
+                  int exactStart, VideoMuxerProgressCallback cb, void *userData);
+
+// Join count recordings of the same session into outputPath without
+// re-encoding. Fails before writing if their codec parameters differ.
+// Runs on the calling thread. Returns 1 on success.
+#ifdef __cplusplus
+extern "C"
+#endif
+int videoFileConcat(const char **inputPaths, int count, const char *outputPath,
+                    VideoMuxerProgressCallback cb, void *userData);
+
+// Write the same recording to another file as well, starting at the next
+// IDR, e.g. a short clip next to a long recording. The container follows
+// the extension and the I/O settings of the muxer. maxSeconds 0 records
+// until the sink is removed. Returns the sink id, -1 for a wrong handle.
+#ifdef __cplusplus
+extern "C"
+#endif
+int videoMuxerAddFileSink(int hd, const char *filePath, int maxSeconds);
+
+// Same as videoMuxerSetHlsOutput for an additional output in dirPath.
+#ifdef __cplusplus
+extern "C"
+#endif
+int videoMuxerAddHlsSink(int hd, const char *dirPath, int segmentSeconds, int listSize, int fmp4);
+
+// Muxed bytes for a callback sink. isFragmentBoundary is 1 on the chunk
+// that starts a fragment, the chunks before the first one are the header.
+typedef void (*VideoMuxerDataCallback)(const uint8_t *data, int len, int isFragmentBoundary, void *userData);
+
+// Stream the recording to cb instead of a file, as fragmented mp4 with a
+// fragment per GOP, or MPEG-TS with mpegts = 1. Starts at the next IDR.
+// Returns the sink id, -1 for a wrong handle.
+#ifdef __cplusplus
+extern "C"
+#endif
+int videoMuxerAddCallbackSink(int hd, VideoMuxerDataCallback cb, int mpegts, void *userData);
+
+// Stop feeding a sink, its file is finalized in the background.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerRemoveSink(int hd, int sinkId);
+
+// A failing sink stops on its own without affecting the other outputs.
+#ifdef __cplusplus
+extern "C"
+#endif
+int videoMuxerSinkHasError(int hd, int sinkId);
+
+// Dashcam mode: keep the last seconds of the recording in memory (bounded
+// by maxBytes, 0 for no bound) and write nothing until
+// videoMuxerTriggerRecording. Call before writing the first frame.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerSetPreEventBuffer(int hd, int seconds, int64_t maxBytes);
+
+// Start the file with the buffered footage and keep recording live. Returns
+// at once, the footage is written on the muxer thread.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerTriggerRecording(int hd);
+
+// A thumbnail JPEG was written, seconds is its time in the recording.
+typedef void (*VideoMuxerThumbnailCallback)(const char *jpegPath, double seconds, void *userData);
+
+// Write thumb_<milliseconds>.jpg thumbnails of width pixels (0 keeps the
+// video width) into dirPath at the first IDR after every intervalSeconds.
+// Only IDRs are decoded, on a low priority thread; a thumbnail taking more
+// than budgetMs (0 for no limit) is dropped. Call before the first frame.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerSetThumbnails(int hd, const char *dirPath, double intervalSeconds, int width, int budgetMs,
+                             VideoMuxerThumbnailCallback cb, void *userData);
+
+// Same for a finished recording, runs on the calling thread. Returns the
+// number of thumbnails written, -1 if the file can't be read.
+#ifdef __cplusplus
+extern "C"
+#endif
+int videoFileThumbnails(const char *filePath, const char *dirPath, double intervalSeconds, int width, int budgetMs,
+                        VideoMuxerThumbnailCallback cb, void *userData);
+
+// Time-lapse: keep only every keepEveryNthIdr-th IDR, no audio, and play
+// the kept frames at playbackFps (0 uses the camera frame rate). Call
+// before the first frame.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerSetTimeLapse(int hd, int keepEveryNthIdr, int playbackFps);
+
+// Also record a low resolution MPEG-4 proxy of width pixels (0 for 480)
+// at bitRate (0 for 600 kbps) into proxyPath, e.g. for scrubbing on slow
+// devices. Transcoded on a low priority thread, frames are dropped rather
+// than slow down the recording. Call before the first frame.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerSetProxy(int hd, const char *proxyPath, int width, int bitRate);
+
+// Latencies in microseconds. buckets[i] counts the ones in [2^i, 2^(i+1)),
+// buckets[0] also those under 1 and the last bucket everything longer.
+#define VIDEO_MUXER_LATENCY_BUCKETS 20
+typedef struct VideoMuxerLatency {
+    uint64_t count;
+    uint64_t totalUs;
+    uint64_t maxUs;
+    uint64_t buckets[VIDEO_MUXER_LATENCY_BUCKETS];
+} VideoMuxerLatency;
+
+// Percentiles over the last 4096 frames, count and maxUs cover them all.
+typedef struct VideoMuxerPercentiles {
+    uint64_t count;
+    uint64_t p50Us;
+    uint64_t p99Us;
+    uint64_t maxUs;
+} VideoMuxerPercentiles;
+
+typedef struct VideoMuxerStats {
+    // Frames handed to videoMuxerWrite*, dropped ones included.
+    uint64_t videoFramesIn;
+    uint64_t videoBytesIn;
+    // Paused, waiting for an IDR, skipped by the time-lapse or over the
+    // queue bound.
+    uint64_t videoFramesDropped;
+    uint64_t audioFramesIn;
+    uint64_t audioBytesIn;
+    uint64_t audioFramesDropped;
+    // Packets at least one output took.
+    uint64_t videoPacketsOut;
+    uint64_t videoBytesOut;
+    uint64_t audioPacketsOut;
+    uint64_t audioBytesOut;
+    // Frames waiting for the muxer thread, now and at most.
+    uint32_t videoQueueDepth;
+    uint32_t videoQueueHighWater;
+    uint32_t audioQueueDepth;
+    uint32_t audioQueueHighWater;
+    // Audio time minus video time at the last audio packet.
+    int64_t avDriftMs;
+    // Packets an output failed on or refused while in error.
+    uint64_t writeErrors;
+    // AAC encoding of one frame, and one packet written into one output.
+    VideoMuxerLatency encodeLatency;
+    VideoMuxerLatency writeLatency;
+    // From writeVideoFrames to the primary output taking the frame, and to
+    // the write of the file buffer holding it. The second doesn't include an
+    // fsync (see videoMuxerSetSyncPolicy), and a buffer only goes out once
+    // full, so it grows with videoMuxerSetIOBufferSize over the bitrate.
+    VideoMuxerPercentiles ingestToWriteLatency;
+    VideoMuxerPercentiles ingestToDiskLatency;
+    // Thumbnails dropped for taking longer than the budgetMs given to
+    // videoMuxerSetThumbnails.
+    uint64_t thumbnailsOverBudget;
+    // Packets the proxy of videoMuxerSetProxy skipped, whole GOPs at a
+    // time, so as not to hold up the recording.
+    uint64_t proxyPacketsDropped;
+} VideoMuxerStats;
+
+// Fills stats with the counters of the muxer since it was created. Reading
+// them never blocks the recording. Returns 0 for an unknown handle.
+#ifdef __cplusplus
+extern "C"
+#endif
+int videoMuxerGetStats(int hd, VideoMuxerStats *stats);
+
+// Diagnostics of every muxer go through one queue and reach the callback
+// on a thread of its own, never on the one writing frames. Messages below
+// minLevel are discarded where they are logged. A null callback restores
+// the default of printing to stdout and stderr.
+#define VIDEO_MUXER_LOG_DEBUG   0
+#define VIDEO_MUXER_LOG_INFO    1
+#define VIDEO_MUXER_LOG_WARNING 2
+#define VIDEO_MUXER_LOG_ERROR   3
+typedef void (*VideoMuxerLogCallback)(int level, const char *message, void *userData);
+
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerSetLogCallback(VideoMuxerLogCallback cb, int minLevel, void *userData);
+
+// Hands every message logged so far to the callback before returning.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerFlushLog(void);
+
+// Records the time every frame spends in each stage (enqueue, SPS/PPS,
+// AAC encoding, muxing, file writes) per thread while enabled. Returns 0
+// when the library was built without VCAMSHARE_TRACE.
+#ifdef __cplusplus
+extern "C"
+#endif
+int videoMuxerSetTracing(int enable);
+
+// Writes the recorded stages as Chrome trace event JSON, for Perfetto or
+// chrome://tracing, and starts over. Returns 1 on success.
+#ifdef __cplusplus
+extern "C"
+#endif
+int videoMuxerDumpTrace(const char *jsonPath);
+
+// Bound the frames waiting for the muxer thread when the storage can't keep
+// up. Over it, video is dropped up to the next IDR and audio a chunk at a
+// time. 0, the default, queues without bound.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerSetMaxQueuedFrames(int hd, int frames);
+
+#define VIDEO_MUXER_EVENT_ERROR          0  // value is the negative AVERROR code
+#define VIDEO_MUXER_EVENT_FILE_OPENED    1
+#define VIDEO_MUXER_EVENT_FILE_FINALIZED 2  // value is 1 if closed cleanly, 0 if damaged
+#define VIDEO_MUXER_EVENT_LOW_DISK       3  // value is the predicted seconds left
+typedef void (*VideoMuxerEventCallback)(int event, const char *filePath, int64_t value, void *userData);
+
+// Events of the primary output, delivered in order on a background thread
+// so checkVideoMuxerError doesn't need polling. Call before the first frame.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerSetEventCallback(int hd, VideoMuxerEventCallback cb, void *userData);
+
+// After a write error, finalize the damaged file and carry on into a new
+// one at the next IDR, named like a rotated file, up to maxRecoveries times.
+// checkVideoMuxerError only reports the error that is left once they are
+// used up. Call before the first frame.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerSetRecovery(int hd, int maxRecoveries);
+
+// Watch the free space where the recording goes, off the recording thread.
+// VIDEO_MUXER_EVENT_LOW_DISK reports the predicted seconds left once under
+// warnSeconds and each time they halve. At floorBytes the oldest recordings
+// in reclaimDir are deleted first, if given (a rec.mp4.keep file protects
+// rec.mp4); when that doesn't free enough the file is finalized while its
+// trailer still fits. floorBytes 0 turns it off. Call before the first frame.
+#ifdef __cplusplus
+extern "C"
+#endif
+void videoMuxerSetDiskGovernor(int hd, int64_t floorBytes, int warnSeconds, const char *reclaimDir);
+
 
 #endif
@@ -1,7 +1,11 @@
 
 #include "video_muxer.h"
+#include "logger.h"
+#include "tracer.h"
 #include "utils.h"
+#include "background_worker.h"
 #include <math.h>
+#include <chrono>
 
 extern "C" {
 #define __STDC_CONSTANT_MACROS
@@ -20,6 +24,16 @@ extern "C" {
 
 static constexpr int AUDIO_FRAME_SIZE = 1024;
 
+// Id of the output given to the constructor.
+static constexpr int PRIMARY_SINK = 0;
+// A longer GOP than this isn't kept while paused, resume waits for an IDR.
+static constexpr size_t PAUSED_GOP_MAX_BYTES = 16 << 20;
+
+static uint64_t elapsedUs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
 static char *const get_error_text(const int error) {
     static char error_buffer[255];
     av_strerror(error, error_buffer, sizeof(error_buffer));
@@ -31,7 +45,7 @@ namespace vcamshare {
     void VideoMuxer::logPacket(const AVFormatContext *fmt_ctx, const AVPacket *pkt) {
         AVRational *time_base = &fmt_ctx->streams[pkt->stream_index]->time_base;
 
-        printf("pts:%s pts_time:%s dts:%s dts_time:%s duration:%s duration_time:%s stream_index:%d\n",
+        logDebug("pts:%s pts_time:%s dts:%s dts_time:%s duration:%s duration_time:%s stream_index:%d",
             av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, time_base),
             av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, time_base),
             av_ts2str(pkt->duration), av_ts2timestr(pkt->duration, time_base),
@@ -43,7 +57,13 @@ namespace vcamshare {
         mHeight = h;
         mVideoFrameRate = videoFrameRate;
         mFilePath = filePath;
-        outputCtx = nullptr;
+        mNextSinkId = PRIMARY_SINK + 1;
+        mEncodersReady = false;
+        mWritingSinks = false;
+        mPreEventSeconds = 0;
+        mPreEventBytes = 0;
+        mRecordingTriggered = false;
+        mReplayPending = false;
         videoSt.enc = nullptr;
         videoSt.dts = 0;
         mLastAudioDts = 0;
@@ -51,36 +71,57 @@ namespace vcamshare {
         audioSt.frame = nullptr;
         mPaused = false;
         mHasIDR = false;
-        mFrameWritten = false;
-        mError = false;
+        mResumeFromCachedGop = false;
+        mPausedGopBytes = 0;
+        mThumbnailInterval = 0;
+        mTimeLapseEvery = 0;
+        mTimeLapseFps = 0;
+        mTimeLapseIdrCount = 0;
+        mLastThumbnailDts = AV_NOPTS_VALUE;
         mSyncAudioDts = false;
+        mMaxQueuedFrames = 0;
+        mSkipToIdr = false;
+        mDiskFull = false;
+        mGovernorOptions.floorBytes = 0;
 
         mStopReadingThread = false;
         mFrameReadThread = std::thread([this] () {
+            VCAM_TRACE_THREAD_NAME("muxer");
             while(!mStopReadingThread) {
-                std::vector<uint8_t> videoFrame;
-                std::vector<float> audioFrame;
+                QueuedFrame videoFrame;
+                QueuedAudio audioFrame;
+                bool replay = false;
                 {
                     std::unique_lock<std::mutex> l(mMutx);
 
-                    if(!mVideoFramesQueue.empty()) {
+                    if(mReplayPending) {
+                        mReplayPending = false;
+                        replay = true;
+                    } else if(!mVideoFramesQueue.empty()) {
                         videoFrame = std::move(mVideoFramesQueue.front());
                         mVideoFramesQueue.pop();
+                        mStats.videoQueueDepth = mVideoFramesQueue.size();
                     } else if (!mAudioRawFramesQueue.empty()) {
                         audioFrame = std::move(mAudioRawFramesQueue.front());
                         mAudioRawFramesQueue.pop();
+                        mStats.audioQueueDepth = mAudioRawFramesQueue.size();
                     } else {
                         mCv.wait(l);
                         continue;
                     }
                 }
 
-                if(!videoFrame.empty()) {
-                    writeVideoFramesToFile(videoFrame.data(), videoFrame.size());
+                if(replay) {
+                    openPrimarySink();
                 }
 
-                if(!audioFrame.empty()) {
-                    writeRawAudioFramesToFile(audioFrame.data(), audioFrame.size());
+                if(!videoFrame.data.empty()) {
+                    writeVideoFramesToFile(videoFrame.data.data(), videoFrame.data.size(),
+                                           videoFrame.ingestUs, videoFrame.frameId);
+                }
+
+                if(!audioFrame.data.empty()) {
+                    writeRawAudioFramesToFile(audioFrame.data.data(), audioFrame.data.size(), audioFrame.frameId);
                 }
             }
         });
@@ -91,79 +132,175 @@ namespace vcamshare {
     }
 
     void VideoMuxer::open(uint8_t *extraData, int extraLen) {
-        if(outputCtx) return;
-
-        int ret;
-
-        std::cout << "video file: " << mFilePath << std::endl;
-        mFrameWritten = false;
-        mError = false;
+        if(videoSt.enc) return;
 
         videoSt.dts = 0;
         audioSt.dts = 0;
 
-        avformat_alloc_output_context2(&outputCtx, NULL, NULL, mFilePath.c_str());
-        if (!outputCtx) {
-            std::cerr << "Failed to open file: " << mFilePath << std::endl;
-            goto end;
+        if(!openEncoders(extraData, extraLen)) {
+            logError("Something wrong in the end section.");
+            closeEncoders();
+            return;
         }
 
-        if(!addStream(&videoSt, outputCtx, &videoCodec, AV_CODEC_ID_H264, extraData, extraLen)) {
-            goto end;
+        bool waitForTrigger;
+        {
+            std::unique_lock<std::mutex> l(mSinksMutx);
+            if(mPreEventSeconds > 0 && !mRecordingTriggered) {
+                mPreEventRing = std::unique_ptr<PacketRing>(
+                    new PacketRing(mPreEventSeconds, mPreEventBytes, videoSt.enc->time_base));
+            }
+            for(auto &it : mSinks) {
+                it.second->attach(videoSt.enc, audioSt.enc);
+            }
+            mEncodersReady = true;
+            waitForTrigger = mPreEventRing != nullptr;
         }
 
-        if(!addStream(&audioSt, outputCtx, &audioCodec, AV_CODEC_ID_AAC, nullptr, 0)) { //
-            goto end;
+        if(!waitForTrigger) {
+            openPrimarySink();
         }
 
-        // Support ADTS encoding
-        if(!openAudioEncoder(audioCodec)) {
-            goto end;
+        if(!mProxyPath.empty()) {
+            mProxy = std::unique_ptr<ProxyTranscoder>(new ProxyTranscoder(mProxyPath, mProxyOptions));
+            if(!mProxy->open(videoSt.enc)) {
+                mProxy.reset();
+            }
         }
 
-        if(audioSt.enc) {
-            mAudioRawBuffer.clear();
-            mAudioRawBuffer.reserve(audioSt.enc->frame_size);
-        } else {
-            goto end;
+        if(mThumbnailInterval > 0) {
+            AVCodecParameters *par = avcodec_parameters_alloc();
+            auto thumbnailer = std::make_shared<Thumbnailer>(mThumbnailOptions);
+            if(!par || avcodec_parameters_from_context(par, videoSt.enc) < 0 || !thumbnailer->open(par)) {
+                logWarning("Thumbnails disabled.");
+                thumbnailer.reset();
+            }
+            avcodec_parameters_free(&par);
+            // stats() reads it from other threads.
+            std::atomic_store(&mThumbnailer, thumbnailer);
+            mThumbnailBusy = std::make_shared<std::atomic<bool>>(false);
+            mLastThumbnailDts = AV_NOPTS_VALUE;
         }
 
-        av_dump_format(outputCtx, 0, mFilePath.c_str(), 1);
+        if(mGovernorOptions.floorBytes > 0) {
+            startGovernor();
+        }
+    }
 
-        if (!(outputCtx->oformat->flags & AVFMT_NOFILE)) {
-            ret = avio_open(&outputCtx->pb, mFilePath.c_str(), AVIO_FLAG_WRITE);
-            if (ret < 0) {
-                std::cerr << "Could not open output context." << std::endl;
-                goto end;
+    void VideoMuxer::startGovernor() {
+        mGovernor = std::unique_ptr<DiskGovernor>(new DiskGovernor(mFilePath, mGovernorOptions, mOptions.ioBackend, [this] () {
+            return uint64_t(mStats.videoBytesOut + mStats.audioBytesOut);
+        }));
+
+        mGovernor->setOpenFiles([this] () {
+            std::vector<std::string> paths;
+            std::unique_lock<std::mutex> l(mSinksMutx);
+            for(auto &it : mSinks) {
+                std::string path = it.second->openFilePath();
+                if(!path.empty()) paths.push_back(path);
             }
+            return paths;
+        });
+
+        auto onEvent = mOptions.onEvent;
+        std::string filePath = mFilePath;
+        mGovernor->start([onEvent, filePath] (int64_t secondsLeft) {
+            if(!onEvent) return;
+            BackgroundWorker::events().post([onEvent, filePath, secondsLeft] () {
+                onEvent(MuxerSink::Event::LowDisk, filePath, secondsLeft);
+            });
+        }, [this] () {
+            // The trailer still fits, anything later would cut the file short.
+            std::unique_lock<std::mutex> l(mSinksMutx);
+            mDiskFull = true;
+            whenSinksIdle([this] () {
+                auto it = mSinks.find(PRIMARY_SINK);
+                if(it != mSinks.end()) {
+                    it->second->finish();
+                }
+            });
+        });
+    }
+
+    // Called with mSinksMutx held. Runs action now, or on the muxer thread
+    // once it is done writing, still under mSinksMutx.
+    void VideoMuxer::whenSinksIdle(std::function<void()> action) {
+        if(mWritingSinks) {
+            mDeferred.push_back(action);
+        } else {
+            action();
         }
+    }
 
-        ret = avformat_write_header(outputCtx, NULL);
-        std::cout << "Header written: " << ret << std::endl;
+    // Called on the muxer thread, or once it stopped.
+    void VideoMuxer::openPrimarySink() {
+        std::unique_ptr<PacketRing> ring;
+        {
+            std::unique_lock<std::mutex> l(mSinksMutx);
+            // Only a trigger gets here with the ring, live packets go
+            // straight to the sink from then on.
+            ring = std::move(mPreEventRing);
+            if(!mEncodersReady || mSinks.count(PRIMARY_SINK) || mDiskFull) return;
+        }
 
-        if (ret < 0) {
-            char mess[256];
-            av_strerror(ret, mess, 256);
-            std::cerr << mess << std::endl;
-            goto end;
+        // Nothing else sees the sink yet, the replay needs no lock.
+        std::shared_ptr<MuxerSink> sink(new MuxerSink(mFilePath, mOptions));
+        sink->attach(videoSt.enc, audioSt.enc);
+        sink->setLatencyCallback([this] (uint64_t latencyUs) {
+            mStats.ingestToDisk.record(latencyUs);
+        });
+        if(ring) {
+            // The ring starts at an IDR, so the sink opens on its first packet.
+            ring->forEach([&sink] (const AVPacket *pkt, bool video) {
+                sink->writePacket(pkt, video);
+            });
         }
 
-        return;
+        std::unique_lock<std::mutex> l(mSinksMutx);
+        // The governor may have hit the floor during the replay.
+        if(mDiskFull) sink->finish();
+        mSinks[PRIMARY_SINK] = sink;
+    }
 
-        end:
-        std::cerr << "Something wrong in the end section." << std::endl;
-        close();
+    bool VideoMuxer::openEncoders(uint8_t *extraData, int extraLen) {
+        if(!addEncoder(&videoSt, &videoCodec, AV_CODEC_ID_H264, extraData, extraLen)) {
+            return false;
+        }
+
+        // A time-lapse has no sound to go with it.
+        if(mTimeLapseEvery > 0) {
+            return true;
+        }
+
+        if(!addEncoder(&audioSt, &audioCodec, AV_CODEC_ID_AAC, nullptr, 0)) { //
+            return false;
+        }
+
+        // Support ADTS encoding
+        if(!openAudioEncoder(audioCodec)) {
+            return false;
+        }
+
+        mAudioRawBuffer.clear();
+        mAudioRawBuffer.reserve(audioSt.enc->frame_size);
+        return true;
     }
     
     bool VideoMuxer::isOpen() {
-        return outputCtx != nullptr;
+        return videoSt.enc != nullptr;
     }
 
     bool VideoMuxer::hasError() {
-        return mError;
+        return sinkHasError(PRIMARY_SINK);
     }
 
     void VideoMuxer::close() {
+        // Stopped first, it finalizes through mSinksMutx.
+        if(mGovernor) {
+            mGovernor->stop();
+            mGovernor.reset();
+        }
+
         mStopReadingThread = true;
         {
             std::unique_lock<std::mutex> l(mMutx);
@@ -174,11 +311,27 @@ namespace vcamshare {
             mFrameReadThread.join();    
         }
 
-        if(outputCtx && mFrameWritten && !mError) {
-            int rs = av_write_trailer(outputCtx);
-            std::cout << "trailer written: " << rs << std::endl;
+        // A trigger the muxer thread didn't get to still gets its file.
+        if(mReplayPending) {
+            mReplayPending = false;
+            openPrimarySink();
         }
+        {
+            std::unique_lock<std::mutex> l(mSinksMutx);
+            for(auto &it : mSinks) {
+                it.second->close();
+            }
+            mEncodersReady = false;
+            mPreEventRing.reset();
+        }
+        if(mProxy) {
+            mProxy->close();
+            mProxy.reset();
+        }
+        closeEncoders();
+    }
 
+    void VideoMuxer::closeEncoders() {
         /* Close each codec. */
         if(videoSt.enc) {
             avcodec_free_context(&videoSt.enc);
@@ -194,25 +347,242 @@ namespace vcamshare {
             av_frame_free(&audioSt.frame);
             audioSt.frame = nullptr;
         }
+    }
+
+    int VideoMuxer::addSink(const std::string &filePath, const MuxerSink::Options &options) {
+        std::unique_lock<std::mutex> l(mSinksMutx);
+        int sinkId = mNextSinkId ++;
+        std::shared_ptr<MuxerSink> sink(new MuxerSink(filePath, options));
+        if(mEncodersReady) {
+            sink->attach(videoSt.enc, audioSt.enc);
+        }
+        mSinks[sinkId] = sink;
+        return sinkId;
+    }
+
+    void VideoMuxer::removeSink(int sinkId) {
+        std::unique_lock<std::mutex> l(mSinksMutx);
+        auto it = mSinks.find(sinkId);
+        if(it == mSinks.end()) return;
+        std::shared_ptr<MuxerSink> sink = it->second;
+        mSinks.erase(it);
+
+        // The muxer thread may still be writing to it.
+        whenSinksIdle([sink] () {
+            BackgroundWorker::shared().post([sink] () {
+                sink->close();
+            });
+        });
+    }
+
+    // mSinksMutx is never held across a write, and the flag itself is atomic.
+    bool VideoMuxer::sinkHasError(int sinkId) {
+        std::shared_ptr<MuxerSink> sink;
+        {
+            std::unique_lock<std::mutex> l(mSinksMutx);
+            auto it = mSinks.find(sinkId);
+            if(it == mSinks.end()) return false;
+            sink = it->second;
+        }
+        return sink->hasError();
+    }
+
+    void VideoMuxer::setPreEventBuffer(int seconds, int64_t maxBytes) {
+        std::unique_lock<std::mutex> l(mSinksMutx);
+        mPreEventSeconds = seconds < 0 ? 0 : seconds;
+        mPreEventBytes = maxBytes < 0 ? 0 : maxBytes;
+    }
+
+    void VideoMuxer::triggerRecording() {
+        {
+            std::unique_lock<std::mutex> l(mSinksMutx);
+            if(mRecordingTriggered) return;
+            mRecordingTriggered = true;
+        }
+        // The replay is seconds of packet writes, kept off the caller's thread.
+        std::unique_lock<std::mutex> l(mMutx);
+        mReplayPending = true;
+        mCv.notify_all();
+    }
 
-        /* close output */
-        if (outputCtx && !(outputCtx->oformat->flags & AVFMT_NOFILE)) {
-            avio_closep(&outputCtx->pb);
+    void VideoMuxer::setThumbnails(const std::string &outputDir, double intervalSeconds,
+                                   const Thumbnailer::Options &options,
+                                   std::function<void(const std::string &, double)> onThumbnail) {
+        mThumbnailDir = outputDir;
+        mThumbnailInterval = intervalSeconds < 0 ? 0 : intervalSeconds;
+        mThumbnailOptions = options;
+        mThumbnailCallback = onThumbnail;
+    }
+
+    // Runs on the muxer thread with the IDR that is about to be written.
+    void VideoMuxer::postThumbnail(const AVPacket *pkt) {
+        if(!mThumbnailer) return;
+
+        double seconds = pkt->dts * av_q2d(videoSt.enc->time_base);
+        if(mLastThumbnailDts != AV_NOPTS_VALUE
+            && (pkt->dts - mLastThumbnailDts) * av_q2d(videoSt.enc->time_base) < mThumbnailInterval) {
+            return;
         }
+        // Never queue up behind a slow thumbnail.
+        if(mThumbnailBusy->exchange(true)) return;
+        mLastThumbnailDts = pkt->dts;
 
-        if(outputCtx) {
-            avformat_free_context(outputCtx);
-            outputCtx = nullptr;
+        std::shared_ptr<AVPacket> idr(av_packet_clone(pkt), [] (AVPacket *p) {
+            av_packet_free(&p);
+        });
+        if(!idr) {
+            *mThumbnailBusy = false;
+            return;
         }
+
+        auto thumbnailer = mThumbnailer;
+        auto busy = mThumbnailBusy;
+        auto callback = mThumbnailCallback;
+        std::string path = thumbnailPath(mThumbnailDir, seconds);
+        BackgroundWorker::shared().post([thumbnailer, busy, callback, idr, path, seconds] () {
+            if(thumbnailer->writeJpeg(idr.get(), path) && callback) {
+                callback(path, seconds);
+            }
+            *busy = false;
+        });
     }
 
     void VideoMuxer::pause() {
+        mPausedGop.clear();
+        mPausedGopBytes = 0;
         mPaused = true;
         mHasIDR = false;
     }
 
     void VideoMuxer::resume() {
+        if(!mPausedGop.empty()) {
+            // Queued ahead of the live frames, which resume right after.
+            std::unique_lock<std::mutex> l(mMutx);
+            // Their latency counts from here, the caller let go of them long ago.
+            int64_t now = MuxerStats::nowUs();
+            for(auto &frame : mPausedGop) {
+                mVideoFramesQueue.push(QueuedFrame{ std::move(frame), now, -1 });
+            }
+            MuxerStats::setDepth(mStats.videoQueueDepth, mStats.videoQueueHighWater, mVideoFramesQueue.size());
+            mCv.notify_all();
+            mHasIDR = true;
+        }
+        mPausedGop.clear();
+        mPausedGopBytes = 0;
         mPaused = false;
+
+        if(!mHasIDR && mKeyframeRequest) {
+            mKeyframeRequest();
+        }
+    }
+
+    void VideoMuxer::setProxy(const std::string &filePath, const ProxyTranscoder::Options &options) {
+        mProxyPath = filePath;
+        mProxyOptions = options;
+    }
+
+    void VideoMuxer::setTimeLapse(int keepEveryNthIdr, int playbackFps) {
+        mTimeLapseEvery = keepEveryNthIdr < 0 ? 0 : keepEveryNthIdr;
+        mTimeLapseFps = playbackFps > 0 ? playbackFps : mVideoFrameRate;
+        mTimeLapseIdrCount = 0;
+    }
+
+    // Dropped before the frame is copied, so skipped frames cost nothing.
+    bool VideoMuxer::keepForTimeLapse(uint8_t * const data) {
+        if(vcamshare::isNonIDR(data)) return false;
+        return mTimeLapseIdrCount ++ % mTimeLapseEvery == 0;
+    }
+
+    void VideoMuxer::setResumeFromCachedGop(bool enable) {
+        mResumeFromCachedGop = enable;
+    }
+
+    void VideoMuxer::setKeyframeRequestCallback(std::function<void()> callback) {
+        mKeyframeRequest = callback;
+    }
+
+    void VideoMuxer::cachePausedFrame(uint8_t * const data, int len) {
+        if(!vcamshare::isNonIDR(data)) {
+            mPausedGop.clear();
+            mPausedGopBytes = 0;
+        } else if(mPausedGop.empty()) {
+            return;
+        }
+
+        mPausedGopBytes += len;
+        if(mPausedGopBytes > PAUSED_GOP_MAX_BYTES) {
+            mPausedGop.clear();
+            mPausedGopBytes = 0;
+            return;
+        }
+        mPausedGop.push_back(std::vector<uint8_t>(data, data + len));
+    }
+
+    void VideoMuxer::setIOBufferSize(int bytes) {
+        mOptions.ioBufferSize = bytes < 0 ? 0 : bytes;
+    }
+
+    void VideoMuxer::setPreallocate(bool preallocate) {
+        mOptions.preallocate = preallocate;
+    }
+
+    void VideoMuxer::setSyncPolicy(FileWriter::SyncPolicy policy, int64_t syncBytes) {
+        mOptions.syncPolicy = policy;
+        mOptions.syncBytes = syncBytes;
+    }
+
+    void VideoMuxer::setIoBackend(std::shared_ptr<IoBackend> backend) {
+        mOptions.ioBackend = backend;
+    }
+
+    void VideoMuxer::setMaxQueuedFrames(int frames) {
+        mMaxQueuedFrames = frames > 0 ? frames : 0;
+    }
+
+    void VideoMuxer::setEventCallback(MuxerSink::EventCallback callback) {
+        mOptions.onEvent = callback;
+    }
+
+    void VideoMuxer::setRecovery(int maxRecoveries) {
+        mOptions.maxRecoveries = maxRecoveries > 0 ? maxRecoveries : 0;
+    }
+
+    void VideoMuxer::setDiskGovernor(const DiskGovernor::Options &options) {
+        mGovernorOptions = options;
+    }
+
+    void VideoMuxer::setHlsOutput(int segmentSeconds, int listSize, bool fmp4) {
+        mOptions.format = MuxerSink::Format::Hls;
+        mOptions.hlsSegmentSeconds = segmentSeconds > 0 ? segmentSeconds : 2;
+        mOptions.hlsListSize = listSize < 0 ? 0 : listSize;
+        mOptions.hlsFmp4 = fmp4;
+    }
+
+    void VideoMuxer::setMpegTsOutput(int pcrPeriodMs, int patPeriodMs) {
+        mOptions.format = MuxerSink::Format::MpegTs;
+        mOptions.tsPcrPeriodMs = pcrPeriodMs < 0 ? 0 : pcrPeriodMs;
+        mOptions.tsPatPeriodMs = patPeriodMs < 0 ? 0 : patPeriodMs;
+    }
+
+    void VideoMuxer::setRotation(int seconds, int64_t bytes) {
+        mOptions.rotateSeconds = seconds < 0 ? 0 : seconds;
+        mOptions.rotateBytes = bytes < 0 ? 0 : bytes;
+    }
+
+    void VideoMuxer::setFastStart(bool enable, std::function<void(const std::string &, float)> progress) {
+        mOptions.fastStart = enable;
+        mOptions.fastStartProgress = progress;
+    }
+
+    MuxerSink::Options VideoMuxer::options() {
+        return mOptions;
+    }
+
+    MuxerStats::Snapshot VideoMuxer::stats() {
+        MuxerStats::Snapshot s = mStats.snapshot();
+        auto thumbnailer = std::atomic_load(&mThumbnailer);
+        if(thumbnailer) s.thumbnailsOverBudget = thumbnailer->overBudgetCount();
+        return s;
     }
 
     int VideoMuxer::audioSampleRate() {
@@ -261,18 +631,46 @@ namespace vcamshare {
     }
 
     bool VideoMuxer::writeVideoFrames(uint8_t * const data, int len) {
-        if(mPaused) return false;
+        // The count doubles as the frame's id in the trace.
+        int64_t frameId = int64_t(mStats.videoFramesIn.fetch_add(1, std::memory_order_relaxed));
+        MuxerStats::add(mStats.videoBytesIn, len);
+        VCAM_TRACE_SCOPE("enqueue_video", frameId);
+
+        if(mPaused) {
+            if(mResumeFromCachedGop) cachePausedFrame(data, len);
+            MuxerStats::add(mStats.videoFramesDropped, 1);
+            return false;
+        }
+
+        if(mTimeLapseEvery > 0 && !keepForTimeLapse(data)) {
+            MuxerStats::add(mStats.videoFramesDropped, 1);
+            return false;
+        }
 
         if(!mHasIDR) {
             mHasIDR = !vcamshare::isNonIDR(data);
-            if(!mHasIDR) return false;
+            if(!mHasIDR) {
+                MuxerStats::add(mStats.videoFramesDropped, 1);
+                return false;
+            }
         }
 
-        std::vector<uint8_t> d(data, data + len);
+        bool idr = !vcamshare::isNonIDR(data);
+        QueuedFrame d{ std::vector<uint8_t>(data, data + len), MuxerStats::nowUs(), frameId };
 
         {
             std::unique_lock<std::mutex> l(mMutx);
+            if(mMaxQueuedFrames > 0) {
+                if(idr) mSkipToIdr = false;
+                // The frames up to the next IDR can't be decoded without this one.
+                if(!mSkipToIdr && mVideoFramesQueue.size() >= mMaxQueuedFrames) mSkipToIdr = true;
+                if(mSkipToIdr) {
+                    MuxerStats::add(mStats.videoFramesDropped, 1);
+                    return false;
+                }
+            }
             mVideoFramesQueue.push(std::move(d));
+            MuxerStats::setDepth(mStats.videoQueueDepth, mStats.videoQueueHighWater, mVideoFramesQueue.size());
             mCv.notify_all();
         }
 
@@ -284,19 +682,33 @@ namespace vcamshare {
     }
 
     bool VideoMuxer::writeRawAudioFrames(float * const rawData, int len, bool isMute) {
-        if(mPaused) return false;
-        if(!mHasIDR) return false;
+        int64_t frameId = int64_t(mStats.audioFramesIn.fetch_add(1, std::memory_order_relaxed));
+        MuxerStats::add(mStats.audioBytesIn, len * sizeof(float));
+        VCAM_TRACE_SCOPE("enqueue_audio", frameId);
+
+        if(mPaused || mTimeLapseEvery > 0 || !mHasIDR) {
+            MuxerStats::add(mStats.audioFramesDropped, 1);
+            return false;
+        }
 
         auto expectAudioDts = calculateAudioDtsFromVideoDts(videoSt.dts);
         if(audioSt.dts > expectAudioDts && isMute) {
+            MuxerStats::add(mStats.audioFramesDropped, 1);
             return false;
         }
 
-        std::vector<float> d(rawData, rawData + len);
+        QueuedAudio d{ std::vector<float>(rawData, rawData + len), frameId };
 
         {
             std::unique_lock<std::mutex> l(mMutx);
+            if(mMaxQueuedFrames > 0 && mAudioRawFramesQueue.size() >= mMaxQueuedFrames) {
+                // The next chunk picks up at the video time again.
+                mSyncAudioDts = true;
+                MuxerStats::add(mStats.audioFramesDropped, 1);
+                return false;
+            }
             mAudioRawFramesQueue.push(std::move(d));
+            MuxerStats::setDepth(mStats.audioQueueDepth, mStats.audioQueueHighWater, mAudioRawFramesQueue.size());
             mCv.notify_all();
         }
 
@@ -304,12 +716,13 @@ namespace vcamshare {
     }
 
     bool VideoMuxer::writeAudioFrames(uint8_t * const data, int len) {
-        if(mPaused) return false;
-        if(!mHasIDR) return false;
+        MuxerStats::add(mStats.audioFramesIn, 1);
+        MuxerStats::add(mStats.audioBytesIn, len);
 
-        if(isOpen()) {
+        if(!mPaused && mTimeLapseEvery == 0 && mHasIDR && isOpen()) {
             return addFrames(data, len, false);
         }
+        MuxerStats::add(mStats.audioFramesDropped, 1);
         return false;
     }
 
@@ -322,8 +735,12 @@ namespace vcamshare {
         return dts;
     }
 
-    bool VideoMuxer::writeVideoFramesToFile(uint8_t * const data, int len) {
-        uint8_t *frame = fillSpsPps(data, len);
+    bool VideoMuxer::writeVideoFramesToFile(uint8_t * const data, int len, int64_t ingestUs, int64_t frameId) {
+        uint8_t *frame;
+        {
+            VCAM_TRACE_SCOPE("fill_sps_pps", frameId);
+            frame = fillSpsPps(data, len);
+        }
 
         if(!isOpen()) {
             if (mSpsPps.empty()) {
@@ -332,7 +749,7 @@ namespace vcamshare {
             open(mSpsPps.data(), mSpsPps.size());
 
             if(!isOpen()) {
-                std::cerr << "Failed to open Muxer!" << std::endl;
+                logError("Failed to open Muxer!");
             }
         }
 
@@ -342,7 +759,7 @@ namespace vcamshare {
             // }
             // addFrames(frame, len - (frame - data), true);
             
-            return addFrames(data, len, true);
+            return addFrames(data, len, true, ingestUs, frameId);
         }
 
         return false;
@@ -364,14 +781,15 @@ namespace vcamshare {
         }
     }
 
-    bool VideoMuxer::writeRawAudioFramesToFile(float * const rawData, int len) {
-        if(!isOpen()) return false;
+    // An AAC frame carries the id of the chunk that completed it.
+    bool VideoMuxer::writeRawAudioFramesToFile(float * const rawData, int len, int64_t frameId) {
+        if(!isOpen() || !audioSt.enc) return false;
 
         int frameSize = audioSt.enc->frame_size;
         int channels = audioSt.enc->channels;
         // std::cout << "frameSize: " << frameSize << std::endl;
 
-        std::function<void(float* batchData)> cb = [this, frameSize, channels] (float* batchData) {
+        std::function<void(float* batchData)> cb = [this, frameSize, channels, frameId] (float* batchData) {
             AVFrame *frame = audioSt.frame;
             if (frame) {
                 int ret = av_frame_make_writable(frame);
@@ -383,8 +801,8 @@ namespace vcamshare {
                 }
 
                 AVPacket pkt = { 0 };
-                encodeAudio(audioSt.enc, frame, &pkt, [this] (AVPacket *pkt) {
-                    addFrames(pkt, false);
+                encodeAudio(audioSt.enc, frame, &pkt, frameId, [this, frameId] (AVPacket *pkt) {
+                    addFrames(pkt, false, -1, frameId);
                 });
                 av_packet_unref(&pkt);
             }
@@ -394,11 +812,7 @@ namespace vcamshare {
         return true;
     }
 
-    bool VideoMuxer::addFrames(AVPacket *pkt, bool video) {
-        if(mError) {
-            return false;
-        }
-
+    bool VideoMuxer::addFrames(AVPacket *pkt, bool video, int64_t ingestUs, int64_t frameId) {
         OutputStream *stream = video ? &videoSt : &audioSt;
 
         if (video) {
@@ -429,23 +843,63 @@ namespace vcamshare {
             }
         }
 
-        av_packet_rescale_ts(pkt, stream->enc->time_base, stream->st->time_base);
-        pkt->stream_index = stream->st->index;
+        // Every sink writes its own reference, a failing one doesn't hold up the others.
+        bool written = false;
+        {
+            if(video && (pkt->flags & AV_PKT_FLAG_KEY)) {
+                postThumbnail(pkt);
+            }
+            if(video && mProxy && !mProxy->push(pkt)) {
+                MuxerStats::add(mStats.proxyPacketsDropped, 1);
+            }
+
+            {
+                std::unique_lock<std::mutex> l(mSinksMutx);
+                if(mPreEventRing) {
+                    mPreEventRing->push(pkt, video);
+                }
+                mWriteSinks.assign(mSinks.begin(), mSinks.end());
+                mWritingSinks = true;
+            }
+            for(auto &it : mWriteSinks) {
+                bool primary = it.first == PRIMARY_SINK;
+                int64_t errors = it.second->errorCount();
+                auto start = std::chrono::steady_clock::now();
+                bool ok = it.second->writePacket(pkt, video, primary ? ingestUs : -1, frameId);
+                mStats.writeLatency.record(elapsedUs(start));
+                if(ok) {
+                    written = true;
+                    if(primary && ingestUs >= 0) {
+                        mStats.ingestToWrite.record(MuxerStats::nowUs() - ingestUs);
+                    }
+                } else if(it.second->hasError() || it.second->errorCount() != errors) {
+                    MuxerStats::add(mStats.writeErrors, 1);
+                }
+            }
 
-        // logPacket(outputCtx, pkt);
+            std::unique_lock<std::mutex> l(mSinksMutx);
+            mWriteSinks.clear();
+            mWritingSinks = false;
+            for(auto &action : mDeferred) {
+                action();
+            }
+            mDeferred.clear();
+        }
 
-        int ret = av_interleaved_write_frame(outputCtx, pkt);
-        if(ret == 0) {
-            mFrameWritten = true;
-        } else {
-            mError = true;
+        if(written) {
+            MuxerStats::add(video ? mStats.videoPacketsOut : mStats.audioPacketsOut, 1);
+            MuxerStats::add(video ? mStats.videoBytesOut : mStats.audioBytesOut, pkt->size);
+        }
+        if(!video && audioSt.enc) {
+            double drift = pkt->dts * av_q2d(audioSt.enc->time_base) - videoSt.dts * av_q2d(videoSt.enc->time_base);
+            mStats.avDriftMs = int64_t(drift * 1000);
         }
 
         stream->dts ++;
-        return ret == 0;
+        return written;
     }
 
-    bool VideoMuxer::addFrames(uint8_t * const data, int len, bool video) {
+    bool VideoMuxer::addFrames(uint8_t * const data, int len, bool video, int64_t ingestUs, int64_t frameId) {
         int ret = -1;
 
         int append = video ? AV_INPUT_BUFFER_PADDING_SIZE : 0;
@@ -456,17 +910,16 @@ namespace vcamshare {
         AVPacket pkt = { 0 };
         int rs = av_packet_from_data(&pkt, (uint8_t *)avdata, len + AV_INPUT_BUFFER_PADDING_SIZE);
         if(rs == 0) {
-            addFrames(&pkt, video);
+            addFrames(&pkt, video, ingestUs, frameId);
         } else {
-            std::cerr << "Failed to create AVPacket" << std::endl;
+            logError("Failed to create AVPacket");
         }
 
         av_packet_unref(&pkt);
         return rs == 0;
     }
 
-    bool VideoMuxer::addStream(OutputStream *ost, 
-                                AVFormatContext *oc,
+    bool VideoMuxer::addEncoder(OutputStream *ost,
                                 const AVCodec **codec,
                                 enum AVCodecID codec_id,
                                 uint8_t *extra,
@@ -483,28 +936,22 @@ namespace vcamshare {
         }
         
         if (!(*codec)) {
-            fprintf(stderr, "Could not find encoder for '%s'\n",
+            logError("Could not find encoder for '%s'",
                     avcodec_get_name(codec_id));
             return false;
         }
 
-        ost->st = avformat_new_stream(oc, NULL); //*codec
-        if (!ost->st) {
-            fprintf(stderr, "Could not allocate stream\n");
-            return false;
-        }
-        ost->st->id = oc->nb_streams-1;
         c = avcodec_alloc_context3(*codec);
 
         if (!c) {
-            fprintf(stderr, "Could not alloc an encoding context\n");
+            logError("Could not alloc an encoding context");
             return false;
         }
         ost->enc = c;
 
         switch ((*codec)->type) {
             case AVMEDIA_TYPE_AUDIO:
-                std::cout << "add audio stream " << std::endl;
+                logInfo("add audio stream");
                 c->bit_rate    = AUDIO_BIT_RATE;
 
                 // The sample format must be float.
@@ -523,7 +970,7 @@ namespace vcamshare {
                     }
                 }
                 if (c->sample_rate == 0) {
-                    std::cerr << "Failed to get audio sample rate." << std::endl;
+                    logError("Failed to get audio sample rate.");
                     return false;
                 }
 
@@ -546,12 +993,10 @@ namespace vcamshare {
                 c->profile = FF_PROFILE_AAC_LOW; //FF_PROFILE_AAC_MAIN; //FF_PROFILE_AAC_LOW;
                 c->thread_count = 2; // multi-core encoding.
                 c->thread_type = FF_THREAD_SLICE; //FF_THREAD_FRAME;
-
-                c->time_base = ost->st->time_base;
                 break;
 
             case AVMEDIA_TYPE_VIDEO:
-                std::cout << "add video stream " << std::endl;
+                logInfo("add video stream");
                 // avcodec_get_context_defaults3(c, *codec);
                 c->codec_id = codec_id;
 
@@ -564,8 +1009,7 @@ namespace vcamshare {
                 * of which frame timestamps are represented. For fixed-fps content,
                 * timebase should be 1/framerate and timestamp increments should be
                 * identical to 1. */
-                ost->st->time_base = (AVRational){ 1, mVideoFrameRate };
-                c->time_base       = ost->st->time_base;
+                c->time_base       = (AVRational){ 1, mTimeLapseEvery > 0 ? mTimeLapseFps : mVideoFrameRate };
 
                 c->gop_size      = 30; /* emit one intra frame every twelve frames at most */
                 c->pix_fmt       = STREAM_PIX_FMT;
@@ -588,24 +1032,16 @@ namespace vcamshare {
                     * the motion of the chroma plane does not match the luma plane. */
                     c->mb_decision = 2;
                 }
-                c->time_base       = ost->st->time_base;
                 break;
 
             default:
                 break;
         }
 
-        /* Some formats want stream headers to be separate. */
-        if (oc->oformat->flags & AVFMT_GLOBALHEADER) {
-            c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-        }
-
-        int ret = avcodec_parameters_from_context(ost->st->codecpar, c);
-
-        if (ret < 0) {
-            fprintf(stderr, "Could not copy the stream parameters\n");
-            return false;
-        }
+        /* The encoders are shared by every file written, so always keep the
+         * stream headers separate. The mpegts muxer rebuilds ADTS headers
+         * from the extradata. */
+        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
         return true;
     }
@@ -625,7 +1061,7 @@ namespace vcamshare {
 
         av_dict_free(&opt);
         if (ret < 0) {
-            std::cerr << "Could not open audio codec" << std::endl;
+            logError("Could not open audio codec");
             
             return false;
         }
@@ -637,7 +1073,6 @@ namespace vcamshare {
 
         c->frame_size = nb_samples;
         c->time_base = (AVRational){ 1, c->sample_rate / c->frame_size };
-        audioSt.st->time_base = audioSt.enc->time_base;
 
         audioSt.frame     = allocAudioFrame(c->sample_fmt, c->channel_layout,
                                         c->sample_rate, nb_samples);
@@ -645,14 +1080,6 @@ namespace vcamshare {
             return false;
         }
 
-        /* copy the stream parameters to the muxer */
-        ret = avcodec_parameters_from_context(audioSt.st->codecpar, c);
-
-        if (ret < 0) {
-            std::cerr << "Could not copy the stream parameters" << std::endl;
-            return false;
-        }
-
         return true;
     }
 
@@ -663,7 +1090,7 @@ namespace vcamshare {
         int ret;
 
         if (!frame) {
-            fprintf(stderr, "Error allocating an audio frame\n");
+            logError("Error allocating an audio frame");
             return nullptr;
         }
 
@@ -680,7 +1107,7 @@ namespace vcamshare {
         if (nb_samples) {
             ret = av_frame_get_buffer(frame, 0);
             if (ret < 0) {
-                fprintf(stderr, "Error allocating an audio buffer\n");
+                logError("Error allocating an audio buffer");
                 return nullptr;
             }
         }
@@ -688,15 +1115,20 @@ namespace vcamshare {
         return frame;
     }
 
-    bool VideoMuxer::encodeAudio(AVCodecContext *ctx, AVFrame *frame, AVPacket *pkt,
+    bool VideoMuxer::encodeAudio(AVCodecContext *ctx, AVFrame *frame, AVPacket *pkt, int64_t frameId,
                 std::function<void(AVPacket*)> callback) {
         int ret;
 
+        // The callback writes the packets, only the codec itself is timed.
+        VCAM_TRACE_SCOPE("aac_encode", frameId);
+        auto start = std::chrono::steady_clock::now();
+        uint64_t encodeUs = 0;
+
         /* send the frame for encoding */
         ret = avcodec_send_frame(ctx, frame);
         if (ret < 0) {
             char * errorMess = get_error_text(ret);
-            std::cerr << "Error encoding Audio:" << errorMess << std::endl;
+            logError("Error encoding Audio:%s", errorMess);
             return false;
         }
 
@@ -704,15 +1136,18 @@ namespace vcamshare {
         * number of them */
         while (ret >= 0) {
             ret = avcodec_receive_packet(ctx, pkt);
+            encodeUs += elapsedUs(start);
             if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-                return true;
+                break;
             else if (ret < 0) {
-                std::cerr << "Error encoding audio frame." << std::endl;
+                logError("Error encoding audio frame.");
                 return false;
             }
             callback(pkt);
             av_packet_unref(pkt);
+            start = std::chrono::steady_clock::now();
         }
+        mStats.encodeLatency.record(encodeUs);
         return true;
     }
 }
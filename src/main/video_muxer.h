@@ -5,6 +5,20 @@
 #include <vector>
 #include <queue>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <map>
+#include <atomic>
+
+#include "file_writer.h"
+#include "muxer_sink.h"
+#include "packet_ring.h"
+#include "thumbnailer.h"
+#include "proxy_transcoder.h"
+#include "muxer_stats.h"
+#include "disk_governor.h"
 
 extern "C" {
 #include <libavutil/timestamp.h>
@@ -18,7 +32,6 @@ extern "C" {
 namespace vcamshare {
 
     typedef struct OutputStream {
-        AVStream *st;
         AVCodecContext *enc;
 
         AVFrame *frame;
@@ -32,6 +45,87 @@ namespace vcamshare {
 
         void pause();
         void resume();
+        // Also write a small MPEG-4 copy of the whole session to filePath,
+        // transcoded on a low priority thread that drops GOPs rather than
+        // hold up the recording. Set before the first frame.
+        void setProxy(const std::string &filePath, const ProxyTranscoder::Options &options);
+        // Record only every keepEveryNthIdr-th IDR and drop everything else,
+        // audio included, playing the kept frames back at playbackFps.
+        // Rotation and sink durations then count playback time. Set before
+        // the first frame, 0 turns it off.
+        void setTimeLapse(int keepEveryNthIdr, int playbackFps);
+        // Keep the latest GOP while paused so resume restarts from its IDR
+        // instead of waiting for the next one.
+        void setResumeFromCachedGop(bool enable);
+        // Called on resume when there is no IDR to restart from, so the
+        // producer can force one.
+        void setKeyframeRequestCallback(std::function<void()> callback);
+
+        // Size of the buffers used to batch file writes, 0 to write through avio_open.
+        // Takes effect when the output is opened.
+        void setIOBufferSize(int bytes);
+        // Reserve file space ahead of the writes, released again on close.
+        void setPreallocate(bool preallocate);
+        void setSyncPolicy(FileWriter::SyncPolicy policy, int64_t syncBytes);
+        // Storage for the files of the primary output, null for the system
+        // calls. Takes effect when the output is opened.
+        void setIoBackend(std::shared_ptr<IoBackend> backend);
+        // Hold at most this many frames in each queue in front of the muxer
+        // thread, 0 (the default) for no bound. Over it, video is dropped up
+        // to the next IDR and audio a chunk at a time, resynced to the video
+        // after.
+        void setMaxQueuedFrames(int frames);
+        // Move the moov to the front of finished mp4 files on the background
+        // worker. progress gets the file path and a value in [0, 1], or -1 on failure.
+        void setFastStart(bool enable, std::function<void(const std::string &, float)> progress);
+        // Start a new file at the first IDR after the current one reached
+        // seconds or bytes, 0 disables either. The files after the first are
+        // named like rec_1.mp4, rec_2.mp4.
+        void setRotation(int seconds, int64_t bytes);
+        // Write an HLS playlist (index.m3u8) and segments into the directory
+        // given as the path, so the recording can be played while it grows.
+        // listSize 0 keeps every segment in the playlist.
+        void setHlsOutput(int segmentSeconds, int listSize, bool fmp4);
+        // Write MPEG-TS whatever the extension. The PCR and PAT/PMT intervals
+        // bound how much a reader has to scan after a cut, 0 keeps the defaults.
+        void setMpegTsOutput(int pcrPeriodMs, int patPeriodMs);
+        // Errors, files opened and finalized and low disk space of the
+        // primary output, see MuxerSink::EventCallback.
+        void setEventCallback(MuxerSink::EventCallback callback);
+        // Instead of stopping at the first write error, finalize the damaged
+        // file and continue into a new one at the next IDR, up to
+        // maxRecoveries times.
+        void setRecovery(int maxRecoveries);
+        // Watch the free space under the primary output from the first
+        // frame on: LowDisk events as it runs out, and at options.floorBytes
+        // reclaim or finalize the file cleanly. floorBytes 0 turns it off.
+        void setDiskGovernor(const DiskGovernor::Options &options);
+        // The options the setters above build, used by the primary output.
+        MuxerSink::Options options();
+        // Counters since construction, cheap enough to poll from any thread.
+        MuxerStats::Snapshot stats();
+
+        // Additional outputs fed from the same ingest, each opened at the next
+        // IDR. Returns an id for removeSink, the primary output is 0.
+        int addSink(const std::string &filePath, const MuxerSink::Options &options);
+        // Stops feeding the sink and finalizes it on the background worker.
+        void removeSink(int sinkId);
+        bool sinkHasError(int sinkId);
+
+        // Keep the last seconds of encoded packets in memory, bounded by
+        // maxBytes (0 for no bound), and hold off the primary output until
+        // triggerRecording(). Set before the first frame.
+        void setPreEventBuffer(int seconds, int64_t maxBytes);
+        // Start the primary output with the buffered GOPs, then carry on live.
+        // Returns at once, the muxer thread writes the GOPs before the next frame.
+        void triggerRecording();
+
+        // Write a JPEG of the first IDR after every intervalSeconds into
+        // outputDir, decoded on the background worker. A thumbnail is
+        // skipped while the previous one is still in progress.
+        void setThumbnails(const std::string &outputDir, double intervalSeconds,
+                           const Thumbnailer::Options &options,
+                           std::function<void(const std::string &, double)> onThumbnail);
 
         // expected data stream 00 00 00 01 xx xx xx xx
         bool writeVideoFrames(uint8_t * const data, int len);
@@ -50,21 +144,43 @@ namespace vcamshare {
         uint8_t *fillSpsPps(uint8_t * const data, int len);
         std::vector<uint8_t> getSpsPps();
     private:
+        // A frame waiting for the muxer thread and when it came in.
+        // frameId is the count the frame came in as, which follows it
+        // through the trace, -1 for none.
+        struct QueuedFrame {
+            std::vector<uint8_t> data;
+            int64_t ingestUs;
+            int64_t frameId;
+        };
+        struct QueuedAudio {
+            std::vector<float> data;
+            int64_t frameId;
+        };
+
         void logPacket(const AVFormatContext *fmt_ctx, const AVPacket *pkt);
 
         void open(uint8_t *extraData, int extraLen);
-        bool writeVideoFramesToFile(uint8_t * const data, int len);
-        bool writeRawAudioFramesToFile(float * const data, int len);
+        bool openEncoders(uint8_t *extraData, int extraLen);
+        void closeEncoders();
+        void openPrimarySink();
+        void whenSinksIdle(std::function<void()> action);
+        void startGovernor();
+        void cachePausedFrame(uint8_t * const data, int len);
+        bool keepForTimeLapse(uint8_t * const data);
+        void postThumbnail(const AVPacket *pkt);
 
-        bool addFrames(uint8_t * const data, int len, bool video);
-        bool addFrames(AVPacket *pkt, bool video);
-        bool addStream(OutputStream *ost, AVFormatContext *oc,
+        bool writeVideoFramesToFile(uint8_t * const data, int len, int64_t ingestUs, int64_t frameId);
+        bool writeRawAudioFramesToFile(float * const data, int len, int64_t frameId);
+
+        bool addFrames(uint8_t * const data, int len, bool video, int64_t ingestUs = -1, int64_t frameId = -1);
+        bool addFrames(AVPacket *pkt, bool video, int64_t ingestUs = -1, int64_t frameId = -1);
+        bool addEncoder(OutputStream *ost,
                             const AVCodec **codec,
                             enum AVCodecID codec_id,
                             uint8_t *extra,
                             int extra_len);
         bool openAudioEncoder(const AVCodec *codec);
-        bool encodeAudio(AVCodecContext *ctx, AVFrame *frame, AVPacket *pkt,
+        bool encodeAudio(AVCodecContext *ctx, AVFrame *frame, AVPacket *pkt, int64_t frameId,
                 std::function<void(AVPacket *)> callback);
         void fillAudioBuffer(float * const data, int len, int batch, std::function<void(float*)>);
         AVFrame *allocAudioFrame(enum AVSampleFormat sample_fmt,
@@ -72,7 +188,6 @@ namespace vcamshare {
                                   int sample_rate, int nb_samples);
         int64_t calculateAudioDtsFromVideoDts(int videoDts);
 
-        AVFormatContext *outputCtx;
         const AVCodec *videoCodec;
         const AVCodec *audioCodec;
         OutputStream videoSt;
@@ -80,19 +195,64 @@ namespace vcamshare {
 
         int mWidth, mHeight;
         std::string mFilePath;
+        MuxerSink::Options mOptions;
+
+        std::map<int, std::shared_ptr<MuxerSink>> mSinks;
+        // The muxer thread writes to a copy of mSinks outside mSinksMutx, so
+        // a slow disk doesn't hold up the calls polling for errors. Anything
+        // else touching a sink meanwhile waits in mDeferred.
+        std::vector<std::pair<int, std::shared_ptr<MuxerSink>>> mWriteSinks;
+        bool mWritingSinks;
+        std::vector<std::function<void()>> mDeferred;
+        int mNextSinkId;
+        bool mEncodersReady;
+        std::unique_ptr<PacketRing> mPreEventRing;
+        int mPreEventSeconds;
+        int64_t mPreEventBytes;
+        bool mRecordingTriggered;
+        // Set by triggerRecording() for the muxer thread, guarded by mMutx.
+        bool mReplayPending;
+        // The governor finalized the primary output, it isn't opened again.
+        bool mDiskFull;
+        std::mutex mSinksMutx;
 
         std::vector<uint8_t> mSpsPps;
         std::vector<float> mAudioRawBuffer;
 
-        std::queue<std::vector<uint8_t>> mVideoFramesQueue;
-        std::queue<std::vector<float>> mAudioRawFramesQueue;
+        std::queue<QueuedFrame> mVideoFramesQueue;
+        std::queue<QueuedAudio> mAudioRawFramesQueue;
         std::thread mFrameReadThread;
         bool mStopReadingThread;
         std::condition_variable mCv;
         std::mutex mMutx;
         int64_t mLastAudioDts;
-        bool mPaused, mHasIDR, mFrameWritten, mError, mSyncAudioDts;
+        size_t mMaxQueuedFrames;
+        bool mSkipToIdr;
+        bool mPaused, mHasIDR, mSyncAudioDts;
+        bool mResumeFromCachedGop;
+        std::vector<std::vector<uint8_t>> mPausedGop;
+        size_t mPausedGopBytes;
+        std::function<void()> mKeyframeRequest;
+
+        std::string mProxyPath;
+        ProxyTranscoder::Options mProxyOptions;
+        std::unique_ptr<ProxyTranscoder> mProxy;
+
+        int mTimeLapseEvery;
+        int mTimeLapseFps;
+        int64_t mTimeLapseIdrCount;
+
+        std::string mThumbnailDir;
+        double mThumbnailInterval;
+        Thumbnailer::Options mThumbnailOptions;
+        std::function<void(const std::string &, double)> mThumbnailCallback;
+        std::shared_ptr<Thumbnailer> mThumbnailer;
+        std::shared_ptr<std::atomic<bool>> mThumbnailBusy;
+        int64_t mLastThumbnailDts;
+        DiskGovernor::Options mGovernorOptions;
+        std::unique_ptr<DiskGovernor> mGovernor;
         int mVideoFrameRate;
+        MuxerStats mStats;
 
     };
 }
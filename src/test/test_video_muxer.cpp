@@ -5,15 +5,51 @@
 #include <sstream>
 #include <string>
 #include <thread>
+#include <mutex>
+#include <set>
+#include <vector>
 #include <chrono>
+#include <cstdio>
+#include <sys/stat.h>
+#include <utime.h>
 
 #include <boost/test/included/unit_test.hpp>
 #include "../main/video_muxer.h"
+#include "../main/file_writer.h"
+#include "../main/faststart.h"
+#include "../main/background_worker.h"
+#include "../main/remuxer.h"
+#include "../main/packet_ring.h"
+#include "../main/thumbnailer.h"
+#include "../main/muxer_stats.h"
+#include "../main/logger.h"
+#include "../main/tracer.h"
 #include "../main/utils.h"
+#include "../main/disk_governor.h"
 #include "../main/vcamshare.h"
+#include "../tools/fixture_file.h"
+#include "../tools/fault_io_backend.h"
 
 
+// The binary fixture the build converts next to a text one, read straight
+// from the mapping.
+static bool readFixtureFile(const std::string &filePath, std::function<void(const uint8_t*, int)> frameHandler) {
+  vcamshare::FixtureFile fixture;
+  if(!fixture.open(filePath + ".vcfx") && !fixture.open(filePath)) return false;
+
+  for(auto &frame : fixture.frames()) {
+    if(frameHandler) frameHandler(frame.data, frame.size);
+  }
+  return true;
+}
+
 static void readH264File(std::string filePath, std::function<void(uint8_t*, int)> frameHandler) {
+  if(readFixtureFile(filePath, [&frameHandler] (const uint8_t *data, int len) {
+    if(frameHandler) frameHandler(const_cast<uint8_t *>(data), len);
+  })) {
+    return;
+  }
+
   std::ifstream source;
   source.open(filePath);
   if(source) {
@@ -49,6 +85,12 @@ static void readH264File(std::string filePath, std::function<void(uint8_t*, int)
 }
 
 static void readAudioFile(std::string filePath, std::function<void(float*, int)> frameHandler) {
+  if(readFixtureFile(filePath, [&frameHandler] (const uint8_t *data, int len) {
+    if(frameHandler) frameHandler(reinterpret_cast<float *>(const_cast<uint8_t *>(data)), len / sizeof(float));
+  })) {
+    return;
+  }
+
   std::ifstream source;
   source.open(filePath);
   if(source) {
@@ -78,6 +120,50 @@ static void readAudioFile(std::string filePath, std::function<void(float*, int)>
   }
 }
 
+static int countVideoPackets(const std::string &filePath) {
+  AVFormatContext *ctx = nullptr;
+  if(avformat_open_input(&ctx, filePath.c_str(), nullptr, nullptr) < 0) return -1;
+
+  int count = 0;
+  AVPacket *pkt = av_packet_alloc();
+  while(av_read_frame(ctx, pkt) >= 0) {
+    if(ctx->streams[pkt->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) count ++;
+    av_packet_unref(pkt);
+  }
+  av_packet_free(&pkt);
+  avformat_close_input(&ctx);
+  return count;
+}
+
+// Video packets an edit list hides: the demuxer still returns them, flagged.
+static int countDiscardedVideoPackets(const std::string &filePath) {
+  AVFormatContext *ctx = nullptr;
+  if(avformat_open_input(&ctx, filePath.c_str(), nullptr, nullptr) < 0) return -1;
+
+  int count = 0;
+  AVPacket *pkt = av_packet_alloc();
+  while(av_read_frame(ctx, pkt) >= 0) {
+    if(ctx->streams[pkt->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO
+        && (pkt->flags & AV_PKT_FLAG_DISCARD)) count ++;
+    av_packet_unref(pkt);
+  }
+  av_packet_free(&pkt);
+  avformat_close_input(&ctx);
+  return count;
+}
+
+// Records the fixture into target, so a suite doesn't depend on what
+// another one left in /tmp.
+static void recordH264File(const std::string &source, const std::string &target, int rotateSeconds = 0) {
+  int hd = createVideoMuxer(1920, 1080, 30, target.c_str());
+  if(rotateSeconds > 0) videoMuxerSetRotation(hd, rotateSeconds, 0);
+  readH264File(source, [hd] (uint8_t *data, int len) {
+    writeVideoFrames(hd, data, len);
+  });
+  closeVideoMuxer(hd);
+  // Rotated files are finalized on the background worker.
+  vcamshare::BackgroundWorker::shared().drain();
+}
 
 
 BOOST_AUTO_TEST_SUITE(MuxerTest)
@@ -99,6 +185,615 @@ BOOST_AUTO_TEST_SUITE_END()
 
 
 
+BOOST_AUTO_TEST_SUITE(MuxerRotationTest)
+
+BOOST_AUTO_TEST_CASE(mt_muxing_rotation_test)
+{
+  const std::string target = "/tmp/hdpro_rotation.mp4";
+  const std::string source = "hdpro.h264";
+  std::remove("/tmp/hdpro_rotation_1.mp4");
+
+  int hd = createVideoMuxer(1920, 1080, 30, target.c_str());
+  videoMuxerSetRotation(hd, 1, 0);
+
+  int written = 0;
+  readH264File(source, [hd, &written] (uint8_t *data, int len) {
+    written += writeVideoFrames(hd, data, len);
+  });
+
+  closeVideoMuxer(hd);
+  vcamshare::BackgroundWorker::shared().drain();
+
+  BOOST_TEST(written > 0);
+  BOOST_TEST(std::ifstream(target).good());
+  BOOST_TEST(std::ifstream("/tmp/hdpro_rotation_1.mp4").good());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
+BOOST_AUTO_TEST_SUITE(MuxerHlsTest)
+
+BOOST_AUTO_TEST_CASE(mt_muxing_hls_test)
+{
+  const std::string target = "/tmp/hdpro_hls";
+  const std::string source = "hdpro.h264";
+  int hd = createVideoMuxer(1920, 1080, 30, target.c_str());
+  videoMuxerSetHlsOutput(hd, 1, 0, 1);
+
+  readH264File(source, [hd] (uint8_t *data, int len) {
+    writeVideoFrames(hd, data, len);
+  });
+
+  closeVideoMuxer(hd);
+
+  std::ifstream playlist(target + "/index.m3u8");
+  std::string content((std::istreambuf_iterator<char>(playlist)), std::istreambuf_iterator<char>());
+  BOOST_TEST(content.find("#EXTM3U") == 0u);
+  BOOST_TEST(content.find("segment_00000.m4s") != std::string::npos);
+  BOOST_TEST(std::ifstream(target + "/init.mp4").good());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
+BOOST_AUTO_TEST_SUITE(MuxerMpegTsTest)
+
+BOOST_AUTO_TEST_CASE(mt_muxing_mpegts_test)
+{
+  const std::string target = "/tmp/hdpro.ts";
+  const std::string source = "hdpro.h264";
+  int hd = createVideoMuxer(1920, 1080, 30, target.c_str());
+  videoMuxerSetMpegTsOutput(hd, 20, 100);
+
+  readH264File(source, [hd] (uint8_t *data, int len) {
+    writeVideoFrames(hd, data, len);
+  });
+
+  closeVideoMuxer(hd);
+
+  std::ifstream in(target, std::ios::binary | std::ios::ate);
+  BOOST_TEST(in.tellg() > 0);
+  BOOST_TEST(in.tellg() % 188 == 0);
+
+  BOOST_TEST(vcamshare::remuxFile(target, "/tmp/hdpro_from_ts.mp4", nullptr));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
+BOOST_AUTO_TEST_SUITE(TrimTest)
+
+BOOST_AUTO_TEST_CASE(trim_snaps_to_keyframe)
+{
+  const std::string source = "/tmp/hdpro_trim_source.mp4";
+  const std::string target = "/tmp/hdpro_trim.mp4";
+  const std::string exact = "/tmp/hdpro_trim_exact.mp4";
+  recordH264File("hdpro.h264", source);
+  int total = countVideoPackets(source);
+
+  // 1.1 s is off the IDRs, the snapped clip starts earlier.
+  BOOST_TEST(vcamshare::trimFile(source, target, 1.1, 2.1, vcamshare::TrimMode::SnapToKeyframe, nullptr));
+  int trimmed = countVideoPackets(target);
+  // One second at 30 fps, plus the frames back to the IDR.
+  BOOST_TEST(trimmed >= 30);
+  BOOST_TEST(trimmed < total);
+  BOOST_TEST(countDiscardedVideoPackets(target) == 0);
+
+  BOOST_TEST(vcamshare::trimFile(source, exact, 1.1, 2.1, vcamshare::TrimMode::EditList, nullptr));
+  BOOST_TEST(countVideoPackets(exact) == trimmed);
+  // The edit list hides the frames from the IDR up to 1.1 s.
+  int hidden = countDiscardedVideoPackets(exact);
+  BOOST_TEST(hidden > 0);
+  BOOST_TEST(trimmed - hidden >= 29);
+  BOOST_TEST(trimmed - hidden <= 31);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
+BOOST_AUTO_TEST_SUITE(ConcatTest)
+
+BOOST_AUTO_TEST_CASE(concat_rotated_files)
+{
+  const std::string first = "/tmp/hdpro_concat_source.mp4";
+  const std::string second = "/tmp/hdpro_concat_source_1.mp4";
+  const std::string target = "/tmp/hdpro_concat.mp4";
+  std::remove(second.c_str());
+  recordH264File("hdpro.h264", first, 1);
+  BOOST_TEST(countVideoPackets(second) > 0);
+
+  BOOST_TEST(vcamshare::concatFiles({ first, second }, target, nullptr));
+  BOOST_TEST(countVideoPackets(target) == countVideoPackets(first) + countVideoPackets(second));
+}
+
+BOOST_AUTO_TEST_CASE(concat_rejects_other_parameters)
+{
+  const std::string other = "/tmp/hdpro_720.mp4";
+  int hd = createVideoMuxer(1280, 720, 30, other.c_str());
+  readH264File("hdpro.h264", [hd] (uint8_t *data, int len) {
+    writeVideoFrames(hd, data, len);
+  });
+  closeVideoMuxer(hd);
+  const std::string hd1080 = "/tmp/hdpro_concat_1080.mp4";
+  recordH264File("hdpro.h264", hd1080);
+
+  std::remove("/tmp/hdpro_concat_mixed.mp4");
+  BOOST_TEST(!vcamshare::concatFiles({ hd1080, other }, "/tmp/hdpro_concat_mixed.mp4", nullptr));
+  BOOST_TEST(!std::ifstream("/tmp/hdpro_concat_mixed.mp4").good());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
+BOOST_AUTO_TEST_SUITE(ThumbnailTest)
+
+static bool isJpeg(const std::string &filePath) {
+  std::ifstream in(filePath, std::ios::binary);
+  unsigned char soi[2] = { 0 };
+  in.read(reinterpret_cast<char *>(soi), 2);
+  return soi[0] == 0xFF && soi[1] == 0xD8;
+}
+
+BOOST_AUTO_TEST_CASE(thumbnails_from_file)
+{
+  const std::string dir = "/tmp";
+  const std::string source = "/tmp/hdpro_thumbs_source.mp4";
+  recordH264File("hdpro.h264", source);
+  std::vector<std::string> paths;
+
+  int written = vcamshare::thumbnailsFromFile(source, dir, 1.0, vcamshare::Thumbnailer::Options(),
+    [&paths] (const std::string &path, double seconds) {
+      paths.push_back(path);
+    });
+
+  BOOST_TEST(written > 0);
+  BOOST_TEST(paths.size() == size_t(written));
+  BOOST_TEST(paths.front() == vcamshare::thumbnailPath(dir, 0));
+  for(auto &path : paths) {
+    BOOST_TEST(isJpeg(path));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(mt_muxing_thumbnails_test)
+{
+  std::vector<std::string> paths;
+  vcamshare::VideoMuxer muxer(1920, 1080, 30, "/tmp/hdpro_thumbs.mp4");
+  muxer.setThumbnails("/tmp", 1.0, vcamshare::Thumbnailer::Options(),
+    [&paths] (const std::string &path, double seconds) {
+      paths.push_back(path);
+    });
+
+  readH264File("hdpro.h264", [&muxer] (uint8_t *data, int len) {
+    muxer.writeVideoFrames(data, len);
+  });
+
+  muxer.close();
+  vcamshare::BackgroundWorker::shared().drain();
+
+  BOOST_TEST(!paths.empty());
+  BOOST_TEST(isJpeg(paths.front()));
+}
+
+BOOST_AUTO_TEST_CASE(thumbnails_over_budget_are_dropped)
+{
+  std::vector<std::string> paths;
+  vcamshare::VideoMuxer muxer(1920, 1080, 30, "/tmp/hdpro_thumbs_budget.mp4");
+  vcamshare::Thumbnailer::Options options;
+  // A full size 1080p IDR takes longer than that to decode.
+  options.width = 0;
+  options.budgetMs = 1;
+  muxer.setThumbnails("/tmp", 1.0, options,
+    [&paths] (const std::string &path, double seconds) {
+      paths.push_back(path);
+    });
+
+  readH264File("hdpro.h264", [&muxer] (uint8_t *data, int len) {
+    muxer.writeVideoFrames(data, len);
+  });
+
+  muxer.close();
+  vcamshare::BackgroundWorker::shared().drain();
+
+  BOOST_TEST(paths.empty());
+  BOOST_TEST(muxer.stats().thumbnailsOverBudget > 0u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
+BOOST_AUTO_TEST_SUITE(MuxerTimeLapseTest)
+
+BOOST_AUTO_TEST_CASE(mt_muxing_time_lapse_test)
+{
+  const std::string target = "/tmp/hdpro_time_lapse.mp4";
+  int hd = createVideoMuxer(1920, 1080, 30, target.c_str());
+  videoMuxerSetTimeLapse(hd, 2, 10);
+
+  int idrs = 0;
+  readH264File("hdpro.h264", [hd, &idrs] (uint8_t *data, int len) {
+    if(!vcamshare::isNonIDR(data)) idrs ++;
+    writeVideoFrames(hd, data, len);
+  });
+  closeVideoMuxer(hd);
+
+  int kept = countVideoPackets(target);
+  BOOST_TEST(kept > 0);
+  BOOST_TEST(kept <= (idrs + 1) / 2);
+
+  AVFormatContext *ctx = nullptr;
+  BOOST_TEST(avformat_open_input(&ctx, target.c_str(), nullptr, nullptr) == 0);
+  if(ctx) {
+    BOOST_TEST(ctx->nb_streams == 1u);
+    // Every kept IDR plays for a tenth of a second, the last one maybe not.
+    AVStream *st = ctx->streams[0];
+    double seconds = st->duration * av_q2d(st->time_base);
+    BOOST_TEST(seconds <= kept / 10.0 + 0.01);
+    BOOST_TEST(seconds >= (kept - 1) / 10.0 - 0.01);
+    avformat_close_input(&ctx);
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
+BOOST_AUTO_TEST_SUITE(MuxerProxyTest)
+
+BOOST_AUTO_TEST_CASE(mt_muxing_proxy_test)
+{
+  const std::string proxy = "/tmp/hdpro_proxy.mp4";
+  int hd = createVideoMuxer(1920, 1080, 30, "/tmp/hdpro_with_proxy.mp4");
+  videoMuxerSetProxy(hd, proxy.c_str(), 320, 0);
+
+  readH264File("hdpro.h264", [hd] (uint8_t *data, int len) {
+    writeVideoFrames(hd, data, len);
+  });
+  closeVideoMuxer(hd);
+
+  AVFormatContext *ctx = nullptr;
+  BOOST_TEST(avformat_open_input(&ctx, proxy.c_str(), nullptr, nullptr) == 0);
+  if(ctx) {
+    avformat_find_stream_info(ctx, nullptr);
+    BOOST_TEST(ctx->streams[0]->codecpar->codec_id == AV_CODEC_ID_MPEG4);
+    BOOST_TEST(ctx->streams[0]->codecpar->width == 320);
+    avformat_close_input(&ctx);
+  }
+  BOOST_TEST(countVideoPackets(proxy) > 0);
+}
+
+BOOST_AUTO_TEST_CASE(slow_proxy_drops_gops_not_frames)
+{
+  const std::string primary = "/tmp/hdpro_with_small_proxy.mp4";
+  const std::string proxy = "/tmp/hdpro_small_proxy.mp4";
+  vcamshare::VideoMuxer muxer(1920, 1080, 30, primary);
+  vcamshare::ProxyTranscoder::Options options;
+  // Fed as fast as the file can be read, a 1080p transcode can't keep up.
+  options.maxQueuedPackets = 1;
+  muxer.setProxy(proxy, options);
+
+  readH264File("hdpro.h264", [&muxer] (uint8_t *data, int len) {
+    muxer.writeVideoFrames(data, len);
+  });
+  muxer.close();
+
+  auto s = muxer.stats();
+  BOOST_TEST(s.proxyPacketsDropped > 0u);
+  // The primary file keeps every packet.
+  BOOST_TEST(countVideoPackets(primary) == int(s.videoPacketsOut));
+  BOOST_TEST(countVideoPackets(proxy) > 0);
+  BOOST_TEST(countVideoPackets(proxy) < countVideoPackets(primary));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
+BOOST_AUTO_TEST_SUITE(MuxerStatsTest)
+
+BOOST_AUTO_TEST_CASE(latency_histogram_buckets)
+{
+  vcamshare::LatencyHistogram histogram;
+  histogram.record(0);
+  histogram.record(1);
+  histogram.record(3);
+  histogram.record(1000);
+  histogram.record(uint64_t(1) << 40);
+
+  auto s = histogram.snapshot();
+  BOOST_TEST(s.count == 5);
+  BOOST_TEST(s.maxUs == (uint64_t(1) << 40));
+  BOOST_TEST(s.buckets[0] == 2);
+  BOOST_TEST(s.buckets[1] == 1);
+  BOOST_TEST(s.buckets[9] == 1);
+  BOOST_TEST(s.buckets[vcamshare::LatencyHistogram::BUCKETS - 1] == 1);
+}
+
+BOOST_AUTO_TEST_CASE(latency_window_percentiles)
+{
+  vcamshare::LatencyWindow window;
+  BOOST_TEST(window.snapshot().p99Us == 0);
+
+  for(int i = 1; i <= 100; i ++) {
+    window.record(i);
+  }
+  auto s = window.snapshot();
+  BOOST_TEST(s.count == 100);
+  BOOST_TEST(s.p50Us == 50);
+  BOOST_TEST(s.p99Us == 99);
+  BOOST_TEST(s.maxUs == 100);
+
+  // Old samples fall out of the window, the maximum stays.
+  for(int i = 0; i < vcamshare::LatencyWindow::WINDOW; i ++) {
+    window.record(7);
+  }
+  s = window.snapshot();
+  BOOST_TEST(s.p99Us == 7);
+  BOOST_TEST(s.maxUs == 100);
+}
+
+BOOST_AUTO_TEST_CASE(mt_muxing_stats_test)
+{
+  vcamshare::VideoMuxer muxer(1920, 1080, 30, "/tmp/hdpro_stats.mp4");
+  readH264File("hdpro.h264", [&muxer] (uint8_t *data, int len) {
+    muxer.writeVideoFrames(data, len);
+  });
+  muxer.close();
+
+  auto s = muxer.stats();
+  BOOST_TEST(s.videoFramesIn > 0u);
+  BOOST_TEST(s.videoPacketsOut > 0);
+  BOOST_TEST(s.videoPacketsOut + s.videoFramesDropped <= s.videoFramesIn);
+  BOOST_TEST(s.videoQueueHighWater >= 1u);
+  BOOST_TEST(s.writeLatency.count >= s.videoPacketsOut);
+  BOOST_TEST(s.writeErrors == 0);
+
+  // Closing flushes the last buffer, so every frame written reached the file.
+  BOOST_TEST(s.ingestToWrite.count == s.videoPacketsOut);
+  BOOST_TEST(s.ingestToDisk.count == s.ingestToWrite.count);
+  BOOST_TEST(s.ingestToDisk.p50Us <= s.ingestToDisk.p99Us);
+  BOOST_TEST(s.ingestToDisk.p99Us <= s.ingestToDisk.maxUs);
+  BOOST_TEST(s.ingestToDisk.maxUs >= s.ingestToWrite.p50Us);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
+BOOST_AUTO_TEST_SUITE(LoggerTest)
+
+BOOST_AUTO_TEST_CASE(messages_reach_the_sink_in_order)
+{
+  vcamshare::Logger logger;
+  std::vector<std::string> messages;
+  logger.setSink([&messages] (vcamshare::LogLevel level, const char *message) {
+    messages.push_back(message);
+  });
+  logger.setLevel(vcamshare::LogLevel::Info);
+
+  logger.log(vcamshare::LogLevel::Debug, "hidden");
+  logger.log(vcamshare::LogLevel::Info, "frame %d", 1);
+  logger.log(vcamshare::LogLevel::Error, "frame %d", 2);
+  logger.flush();
+
+  BOOST_TEST(messages.size() == 2);
+  if(messages.size() == 2) {
+    BOOST_TEST(messages[0] == "frame 1");
+    BOOST_TEST(messages[1] == "frame 2");
+  }
+}
+
+BOOST_AUTO_TEST_CASE(full_ring_drops_and_counts)
+{
+  vcamshare::Logger logger;
+  std::atomic<int> received(0);
+  logger.setSink([&received] (vcamshare::LogLevel level, const char *message) {
+    received ++;
+  });
+
+  const int total = vcamshare::Logger::CAPACITY * 4;
+  for(int i = 0; i < total; i ++) {
+    logger.log(vcamshare::LogLevel::Warning, "message %d", i);
+  }
+  logger.flush();
+
+  BOOST_TEST(received + logger.droppedCount() == uint64_t(total));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
+BOOST_AUTO_TEST_SUITE(TracerTest)
+
+BOOST_AUTO_TEST_CASE(trace_events_dumped_as_json)
+{
+  const std::string path = "/tmp/muxer_trace.json";
+  auto &tracer = vcamshare::Tracer::shared();
+  tracer.setEnabled(true);
+  tracer.setThreadName("test");
+  {
+    vcamshare::TraceScope scope("test_stage", 7);
+  }
+  tracer.setEnabled(false);
+  {
+    vcamshare::TraceScope scope("not_recorded", 8);
+  }
+  BOOST_TEST(tracer.dump(path));
+  tracer.clear();
+
+  std::ifstream file(path);
+  std::string json((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  BOOST_TEST(json.find("\"name\":\"test_stage\"") != std::string::npos);
+  BOOST_TEST(json.find("\"frame\":7") != std::string::npos);
+  BOOST_TEST(json.find("\"name\":\"test\"") != std::string::npos);
+  BOOST_TEST(json.find("not_recorded") == std::string::npos);
+  remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(thread_buffers_only_while_tracing)
+{
+  const std::string path = "/tmp/muxer_trace_threads.json";
+  auto &tracer = vcamshare::Tracer::shared();
+  auto dumped = [&tracer, &path] () {
+    BOOST_TEST(tracer.dump(path));
+    std::ifstream file(path);
+    return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  };
+
+  // A named thread that never records while enabled gets no buffer.
+  std::thread([] () {
+    vcamshare::Tracer::shared().setThreadName("idle_thread");
+    vcamshare::TraceScope scope("idle_stage", 1);
+  }).join();
+  BOOST_TEST(dumped().find("idle_thread") == std::string::npos);
+
+  tracer.setEnabled(true);
+  std::thread([] () {
+    vcamshare::Tracer::shared().setThreadName("ended_thread");
+    vcamshare::TraceScope scope("ended_stage", 2);
+  }).join();
+  tracer.setEnabled(false);
+
+  // The events of a thread that ended are dumped once, then its buffer goes.
+  BOOST_TEST(dumped().find("ended_stage") != std::string::npos);
+  BOOST_TEST(dumped().find("ended_thread") == std::string::npos);
+  tracer.clear();
+  remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
+BOOST_AUTO_TEST_SUITE(MuxerSinkTest)
+
+BOOST_AUTO_TEST_CASE(mt_muxing_sink_test)
+{
+  const std::string target = "/tmp/hdpro_sinks.mp4";
+  const std::string clip = "/tmp/hdpro_clip.mp4";
+  const std::string source = "hdpro.h264";
+  std::remove(clip.c_str());
+
+  vcamshare::VideoMuxer muxer(1920, 1080, 30, target);
+  vcamshare::MuxerSink::Options options;
+  options.maxSeconds = 1;
+  int clipSink = muxer.addSink(clip, options);
+  int brokenSink = muxer.addSink("/tmp/no_such_dir/hdpro.mp4", vcamshare::MuxerSink::Options());
+
+  readH264File(source, [&muxer] (uint8_t *data, int len) {
+    muxer.writeVideoFrames(data, len);
+  });
+
+  muxer.close();
+  vcamshare::BackgroundWorker::shared().drain();
+
+  BOOST_TEST(!muxer.hasError());
+  BOOST_TEST(!muxer.sinkHasError(clipSink));
+  BOOST_TEST(muxer.sinkHasError(brokenSink));
+  BOOST_TEST(std::ifstream(clip).good());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
+BOOST_AUTO_TEST_SUITE(MuxerCallbackSinkTest)
+
+BOOST_AUTO_TEST_CASE(mt_muxing_callback_sink_test)
+{
+  const std::string source = "hdpro.h264";
+  std::vector<uint8_t> stream;
+  int fragments = 0;
+
+  vcamshare::VideoMuxer muxer(1920, 1080, 30, "/tmp/hdpro_callback.mp4");
+  vcamshare::MuxerSink::Options options;
+  options.onData = [&stream, &fragments] (const uint8_t *data, int len, bool isFragmentBoundary) {
+    if(isFragmentBoundary) fragments ++;
+    stream.insert(stream.end(), data, data + len);
+  };
+  muxer.addSink("callback", options);
+
+  readH264File(source, [&muxer] (uint8_t *data, int len) {
+    muxer.writeVideoFrames(data, len);
+  });
+
+  muxer.close();
+
+  std::string content(stream.begin(), stream.end());
+  BOOST_TEST(content.find("ftyp") == 4);
+  BOOST_TEST(content.find("moof") != std::string::npos);
+  BOOST_TEST(fragments > 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
+BOOST_AUTO_TEST_SUITE(MuxerPreEventTest)
+
+BOOST_AUTO_TEST_CASE(packet_ring_keeps_whole_gops)
+{
+  vcamshare::PacketRing ring(1, 0, (AVRational){ 1, 30 });
+
+  for(int i = 0; i < 300; i ++) {
+    AVPacket *pkt = av_packet_alloc();
+    av_new_packet(pkt, 100);
+    pkt->dts = pkt->pts = i;
+    if(i % 20 == 0) pkt->flags |= AV_PKT_FLAG_KEY;
+    ring.push(pkt, true);
+    av_packet_free(&pkt);
+  }
+
+  // Frames 260-299 span 1.3 s, dropping the GOP at 260 would leave 0.63 s.
+  int first = -1, count = 0;
+  ring.forEach([&first, &count] (const AVPacket *pkt, bool video) {
+    if(first < 0) first = pkt->dts;
+    count ++;
+  });
+  BOOST_TEST(first == 260);
+  BOOST_TEST(count == 40);
+  BOOST_TEST(ring.bytes() == 4000);
+}
+
+BOOST_AUTO_TEST_CASE(mt_muxing_pre_event_test)
+{
+  const std::string target = "/tmp/hdpro_pre_event.mp4";
+  const std::string source = "hdpro.h264";
+  std::vector<std::vector<uint8_t>> frames;
+  readH264File(source, [&frames] (uint8_t *data, int len) {
+    frames.push_back(std::vector<uint8_t>(data, data + len));
+  });
+
+  vcamshare::VideoMuxer muxer(1920, 1080, 30, target);
+  muxer.setPreEventBuffer(1, 0);
+
+  size_t half = frames.size() / 2;
+  for(size_t i = 0; i < frames.size(); i ++) {
+    if(i == half) {
+      // Let the muxer thread catch up so the ring holds the first half.
+      std::this_thread::sleep_for(std::chrono::milliseconds(500));
+      muxer.triggerRecording();
+    }
+    muxer.writeVideoFrames(frames[i].data(), frames[i].size());
+  }
+
+  muxer.close();
+
+  BOOST_TEST(!muxer.hasError());
+  BOOST_TEST(countVideoPackets(target) > int(frames.size() - half));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
 BOOST_AUTO_TEST_SUITE(MuxerPauseTest)
 
 BOOST_AUTO_TEST_CASE(mt_muxing_pause_test)
@@ -126,6 +821,407 @@ BOOST_AUTO_TEST_CASE(mt_muxing_pause_test)
   closeVideoMuxer(hd);
 }
 
+BOOST_AUTO_TEST_CASE(mt_muxing_resume_cached_gop_test)
+{
+  const std::string source = "drain.h264";
+  vcamshare::VideoMuxer muxer(1920, 1080, 30, "/tmp/drain_resume.mp4");
+  muxer.setResumeFromCachedGop(true);
+  int keyframeRequests = 0;
+  muxer.setKeyframeRequestCallback([&keyframeRequests] () {
+    keyframeRequests ++;
+  });
+
+  int frameIdx = 0;
+  bool resumedFrameWritten = false;
+  readH264File(source, [&] (uint8_t *data, int len) {
+    if(frameIdx == 50) {
+      muxer.pause();
+    } else if(frameIdx == 125) {
+      muxer.resume();
+      // Accepted right away, a P frame decodes from the kept GOP.
+      resumedFrameWritten = muxer.writeVideoFrames(data, len);
+      frameIdx ++;
+      return;
+    }
+    muxer.writeVideoFrames(data, len);
+    frameIdx ++;
+  });
+
+  muxer.close();
+
+  BOOST_TEST(resumedFrameWritten);
+  BOOST_TEST(keyframeRequests == 0);
+  BOOST_TEST(!muxer.hasError());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
+BOOST_AUTO_TEST_SUITE(MuxerFaultTest)
+
+// close() doesn't wait for the queued frames, a slow disk leaves some behind.
+static void waitForQueues(vcamshare::VideoMuxer &muxer) {
+  for(int i = 0; i < 1000; i ++) {
+    auto s = muxer.stats();
+    if(s.videoQueueDepth == 0 && s.audioQueueDepth == 0) break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(slow_storage_keeps_queues_bounded)
+{
+  const std::string target = "/tmp/hdpro_slow_storage.mp4";
+  auto backend = std::make_shared<vcamshare::FaultIoBackend>();
+  vcamshare::FaultIoBackend::Faults faults;
+  faults.spikeEvery = 4;
+  faults.spikeMs = 50;
+  faults.maxWriteBytes = 8192;
+  faults.bytesPerSecond = 2 << 20;
+  backend->setFaults(faults);
+
+  vcamshare::VideoMuxer muxer(1920, 1080, 30, target);
+  muxer.setIoBackend(backend);
+  muxer.setIOBufferSize(32768);
+  muxer.setMaxQueuedFrames(8);
+  readH264File("hdpro.h264", [&muxer] (uint8_t *data, int len) {
+    muxer.writeVideoFrames(data, len);
+  });
+  waitForQueues(muxer);
+  muxer.close();
+
+  auto s = muxer.stats();
+  BOOST_TEST(s.videoQueueHighWater <= 8u);
+  BOOST_TEST(s.videoFramesDropped > 0);
+  BOOST_TEST(backend->shortWriteCount() > 0);
+  BOOST_TEST(!muxer.hasError());
+  // Whole GOPs were dropped, what is left still plays.
+  BOOST_TEST(countVideoPackets(target) == int(s.videoPacketsOut));
+}
+
+BOOST_AUTO_TEST_CASE(fragment_policy_syncs_every_gop)
+{
+  const std::string target = "/tmp/hdpro_fragment_sync.mp4";
+  auto backend = std::make_shared<vcamshare::FaultIoBackend>();
+
+  vcamshare::VideoMuxer muxer(1920, 1080, 30, target);
+  muxer.setIoBackend(backend);
+  muxer.setSyncPolicy(vcamshare::FileWriter::SyncPolicy::Fragment, 0);
+  readH264File("hdpro.h264", [&muxer] (uint8_t *data, int len) {
+    muxer.writeVideoFrames(data, len);
+  });
+  waitForQueues(muxer);
+  muxer.close();
+
+  BOOST_TEST(!muxer.hasError());
+  // One sync for each IDR after the first and one on close, the clip
+  // has several GOPs.
+  BOOST_TEST(backend->syncCount() > 2);
+}
+
+BOOST_AUTO_TEST_CASE(error_polling_does_not_wait_for_the_disk)
+{
+  const std::string target = "/tmp/hdpro_stalled_storage.mp4";
+  auto backend = std::make_shared<vcamshare::FaultIoBackend>();
+  vcamshare::FaultIoBackend::Faults faults;
+  faults.spikeEvery = 1;
+  faults.spikeMs = 200;
+  backend->setFaults(faults);
+
+  vcamshare::VideoMuxer muxer(1920, 1080, 30, target);
+  muxer.setIoBackend(backend);
+  muxer.setIOBufferSize(32768);
+  int64_t maxPollUs = 0;
+  int frames = 0;
+  readH264File("hdpro.h264", [&muxer, &maxPollUs, &frames] (uint8_t *data, int len) {
+    if(frames ++ >= 150) return;
+    muxer.writeVideoFrames(data, len);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    auto start = std::chrono::steady_clock::now();
+    muxer.hasError();
+    int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    maxPollUs = std::max(maxPollUs, us);
+  });
+  muxer.close();
+
+  // Each write stalls 200 ms, the muxer thread sits in one most of the time.
+  BOOST_TEST(maxPollUs < 50000);
+  BOOST_TEST(!muxer.hasError());
+}
+
+BOOST_AUTO_TEST_CASE(full_disk_fails_and_next_recording_recovers)
+{
+  auto backend = std::make_shared<vcamshare::FaultIoBackend>();
+  vcamshare::FaultIoBackend::Faults faults;
+  faults.spaceBytes = 256 * 1024;
+  backend->setFaults(faults);
+
+  {
+    vcamshare::VideoMuxer muxer(1920, 1080, 30, "/tmp/hdpro_full_disk.mp4");
+    muxer.setIoBackend(backend);
+    muxer.setIOBufferSize(65536);
+    muxer.setPreallocate(true);
+    readH264File("hdpro.h264", [&muxer] (uint8_t *data, int len) {
+      muxer.writeVideoFrames(data, len);
+    });
+    waitForQueues(muxer);
+
+    BOOST_TEST(muxer.hasError());
+    BOOST_TEST(muxer.stats().writeErrors > 0);
+    BOOST_TEST(backend->failedWriteCount() > 0);
+    // Returns although the trailer can't be written.
+    muxer.close();
+  }
+
+  // Space freed, the next recording on the same storage is unaffected.
+  backend->setFaults(vcamshare::FaultIoBackend::Faults());
+  const std::string target = "/tmp/hdpro_after_full_disk.mp4";
+  vcamshare::VideoMuxer muxer(1920, 1080, 30, target);
+  muxer.setIoBackend(backend);
+  readH264File("hdpro.h264", [&muxer] (uint8_t *data, int len) {
+    muxer.writeVideoFrames(data, len);
+  });
+  waitForQueues(muxer);
+  muxer.close();
+
+  BOOST_TEST(!muxer.hasError());
+  BOOST_TEST(countVideoPackets(target) > 0);
+}
+
+BOOST_AUTO_TEST_CASE(recovers_into_a_new_file_after_a_write_error)
+{
+  std::vector<std::vector<uint8_t>> frames;
+  readH264File("hdpro.h264", [&frames] (uint8_t *data, int len) {
+    frames.push_back(std::vector<uint8_t>(data, data + len));
+  });
+
+  auto backend = std::make_shared<vcamshare::FaultIoBackend>();
+  vcamshare::FaultIoBackend::Faults faults;
+  faults.spaceBytes = 256 * 1024;
+  backend->setFaults(faults);
+
+  std::mutex eventsMutx;
+  std::vector<std::pair<vcamshare::MuxerSink::Event, std::string>> events;
+  vcamshare::VideoMuxer muxer(1920, 1080, 30, "/tmp/hdpro_recover.mp4");
+  muxer.setIoBackend(backend);
+  muxer.setIOBufferSize(65536);
+  // The first file costs one, the files tried while the disk is full don't.
+  muxer.setRecovery(2);
+  muxer.setEventCallback([&] (vcamshare::MuxerSink::Event event, const std::string &filePath, int64_t value) {
+    std::unique_lock<std::mutex> l(eventsMutx);
+    events.push_back(std::make_pair(event, filePath));
+  });
+
+  for(size_t i = 0; i < frames.size() / 2; i ++) {
+    muxer.writeVideoFrames(frames[i].data(), frames[i].size());
+  }
+  waitForQueues(muxer);
+  BOOST_TEST(muxer.stats().writeErrors > 0);
+  BOOST_TEST(!muxer.hasError());
+
+  backend->setFaults(vcamshare::FaultIoBackend::Faults());
+  for(size_t i = frames.size() / 2; i < frames.size(); i ++) {
+    muxer.writeVideoFrames(frames[i].data(), frames[i].size());
+  }
+  waitForQueues(muxer);
+  muxer.close();
+  vcamshare::BackgroundWorker::shared().drain();
+  vcamshare::BackgroundWorker::events().drain();
+
+  BOOST_TEST(!muxer.hasError());
+  int errors = 0, opened = 0, finalized = 0;
+  std::set<std::string> paths;
+  std::string lastFile;
+  for(auto &event : events) {
+    if(event.first == vcamshare::MuxerSink::Event::Error) errors ++;
+    if(event.first == vcamshare::MuxerSink::Event::FileOpened) {
+      opened ++;
+      paths.insert(event.second);
+    }
+    if(event.first == vcamshare::MuxerSink::Event::FileFinalized) {
+      finalized ++;
+      lastFile = event.second;
+    }
+  }
+  BOOST_TEST(errors > 0);
+  BOOST_TEST(opened >= 2);
+  BOOST_TEST(finalized == opened);
+  // The file written after the space came back is intact.
+  BOOST_TEST(lastFile != "/tmp/hdpro_recover.mp4");
+  BOOST_TEST(countVideoPackets(lastFile) > 0);
+  // Files that took no frame were removed and their path tried again.
+  BOOST_TEST(paths.size() <= 3u);
+  for(auto &path : paths) {
+    if(path == "/tmp/hdpro_recover.mp4") continue;
+    BOOST_TEST(countVideoPackets(path) > 0);
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
+BOOST_AUTO_TEST_SUITE(DiskGovernorTest)
+
+static void writeAgedFile(const std::string &path, int64_t size, int ageSeconds) {
+  std::ofstream out(path, std::ios::binary);
+  out << std::string(size, 'x');
+  out.close();
+  struct utimbuf times;
+  times.actime = times.modtime = time(nullptr) - ageSeconds;
+  utime(path.c_str(), &times);
+}
+
+static bool exists(const std::string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0;
+}
+
+BOOST_AUTO_TEST_CASE(reclaims_the_oldest_unprotected_recordings)
+{
+  const std::string dir = "/tmp/governor_reclaim";
+  mkdir(dir.c_str(), 0755);
+  writeAgedFile(dir + "/a.mp4", 100000, 3 * 3600);
+  writeAgedFile(dir + "/a.mp4.keep", 0, 3 * 3600);
+  writeAgedFile(dir + "/b.mp4", 100000, 2 * 3600);
+  writeAgedFile(dir + "/c.ts", 100000, 3600);
+  writeAgedFile(dir + "/notes.txt", 100000, 4 * 3600);
+  // Could still be in the works.
+  writeAgedFile(dir + "/d.mp4", 100000, 0);
+
+  auto backend = std::make_shared<vcamshare::FaultIoBackend>();
+  vcamshare::FaultIoBackend::Faults faults;
+  faults.spaceBytes = 0;
+  backend->setFaults(faults);
+
+  vcamshare::DiskGovernor::Options options;
+  options.floorBytes = 50000;
+  options.reclaimDir = dir;
+  vcamshare::DiskGovernor governor(dir + "/rec.mp4", options, backend, nullptr);
+  BOOST_TEST(governor.reclaim(50000) == 100000);
+
+  BOOST_TEST(exists(dir + "/a.mp4"));
+  BOOST_TEST(!exists(dir + "/b.mp4"));
+  BOOST_TEST(exists(dir + "/c.ts"));
+  BOOST_TEST(exists(dir + "/d.mp4"));
+  BOOST_TEST(exists(dir + "/notes.txt"));
+  BOOST_TEST(backend->freeSpace(dir) == 100000);
+}
+
+BOOST_AUTO_TEST_CASE(never_reclaims_the_recording_in_progress)
+{
+  const std::string dir = "/tmp/governor_own_files";
+  mkdir(dir.c_str(), 0755);
+  // A paused recording, untouched for hours, in the directory reclaimed.
+  writeAgedFile(dir + "/rec.mp4", 100000, 3 * 3600);
+  writeAgedFile(dir + "/rec_1.mp4", 100000, 3 * 3600);
+  writeAgedFile(dir + "/old.mp4", 100000, 2 * 3600);
+
+  auto backend = std::make_shared<vcamshare::FaultIoBackend>();
+  vcamshare::FaultIoBackend::Faults faults;
+  faults.spaceBytes = 0;
+  backend->setFaults(faults);
+
+  vcamshare::DiskGovernor::Options options;
+  options.floorBytes = 50000;
+  options.reclaimDir = dir;
+  vcamshare::DiskGovernor governor(dir + "/rec.mp4", options, backend, nullptr);
+  governor.setOpenFiles([&dir] () {
+    return std::vector<std::string>{ dir + "//rec_1.mp4" };
+  });
+  BOOST_TEST(governor.reclaim(1 << 30) == 100000);
+
+  BOOST_TEST(exists(dir + "/rec.mp4"));
+  BOOST_TEST(exists(dir + "/rec_1.mp4"));
+  BOOST_TEST(!exists(dir + "/old.mp4"));
+  remove((dir + "/rec.mp4").c_str());
+  remove((dir + "/rec_1.mp4").c_str());
+  rmdir(dir.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(finalizes_before_the_disk_is_full)
+{
+  const std::string target = "/tmp/hdpro_governed.mp4";
+  auto backend = std::make_shared<vcamshare::FaultIoBackend>();
+  vcamshare::FaultIoBackend::Faults faults;
+  faults.spaceBytes = 2 << 20;
+  backend->setFaults(faults);
+
+  std::mutex eventsMutx;
+  std::vector<std::pair<vcamshare::MuxerSink::Event, int64_t>> events;
+  vcamshare::DiskGovernor::Options options;
+  // Reached after a couple of write buffers, the trailer has plenty of room.
+  options.floorBytes = faults.spaceBytes - 150000;
+  options.sampleMs = 20;
+
+  vcamshare::VideoMuxer muxer(1920, 1080, 30, target);
+  muxer.setIoBackend(backend);
+  muxer.setIOBufferSize(65536);
+  muxer.setDiskGovernor(options);
+  muxer.setEventCallback([&] (vcamshare::MuxerSink::Event event, const std::string &filePath, int64_t value) {
+    std::unique_lock<std::mutex> l(eventsMutx);
+    events.push_back(std::make_pair(event, value));
+  });
+  readH264File("hdpro.h264", [&muxer] (uint8_t *data, int len) {
+    muxer.writeVideoFrames(data, len);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  });
+  muxer.close();
+  vcamshare::BackgroundWorker::shared().drain();
+  vcamshare::BackgroundWorker::events().drain();
+
+  bool floorReported = false, finalizedCleanly = false;
+  for(auto &event : events) {
+    if(event.first == vcamshare::MuxerSink::Event::LowDisk && event.second == 0) floorReported = true;
+    if(event.first == vcamshare::MuxerSink::Event::FileFinalized) finalizedCleanly = event.second == 1;
+  }
+  BOOST_TEST(floorReported);
+  BOOST_TEST(finalizedCleanly);
+  BOOST_TEST(!muxer.hasError());
+  BOOST_TEST(backend->failedWriteCount() == 0);
+  BOOST_TEST(countVideoPackets(target) > 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
+BOOST_AUTO_TEST_SUITE(FixtureFileTest)
+
+BOOST_AUTO_TEST_CASE(write_and_map_frames)
+{
+  const std::string path = "/tmp/fixture_test.vcfx";
+  const uint8_t idr[] = { 0, 0, 0, 1, 0x65, 0x88, 0x84 };
+  const float samples[] = { 0.5f, -0.25f, 0.125f };
+
+  vcamshare::FixtureFile::Writer writer;
+  BOOST_TEST(writer.open(path, vcamshare::FixtureFile::Video));
+  BOOST_TEST(writer.write(idr, sizeof(idr), vcamshare::FixtureFile::FLAG_KEYFRAME, 0));
+  BOOST_TEST(writer.write(samples, sizeof(samples), 0, 33333));
+  BOOST_TEST(writer.finish());
+
+  BOOST_TEST(vcamshare::isFixtureFile(path));
+  vcamshare::FixtureFile fixture;
+  BOOST_TEST(fixture.open(path));
+  BOOST_TEST(fixture.kind() == vcamshare::FixtureFile::Video);
+  BOOST_TEST(fixture.frames().size() == 2);
+  if(fixture.frames().size() == 2) {
+    auto &first = fixture.frames()[0];
+    BOOST_TEST(first.size == int(sizeof(idr)));
+    BOOST_TEST(memcmp(first.data, idr, sizeof(idr)) == 0);
+    BOOST_TEST(first.flags == vcamshare::FixtureFile::FLAG_KEYFRAME);
+
+    // Padding keeps the second payload float aligned.
+    auto &second = fixture.frames()[1];
+    BOOST_TEST(reinterpret_cast<uintptr_t>(second.data) % sizeof(float) == 0);
+    BOOST_TEST(reinterpret_cast<const float *>(second.data)[2] == 0.125f);
+    BOOST_TEST(second.timestampUs == 33333);
+  }
+  fixture.close();
+  remove(path.c_str());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
 
@@ -230,6 +1326,170 @@ BOOST_AUTO_TEST_SUITE_END()
 
 
 
+BOOST_AUTO_TEST_SUITE(FileWriterTest)
+
+BOOST_AUTO_TEST_CASE(buffered_write_and_seek)
+{
+  using namespace vcamshare;
+  const std::string target = "/tmp/file_writer.bin";
+  // A small buffer so the writes span several flushes.
+  FileWriter writer {16384};
+  BOOST_TEST(writer.open(target));
+
+  AVIOContext *pb = writer.avioContext();
+  std::vector<uint8_t> data(200000);
+  for (size_t i = 0; i < data.size(); i ++) {
+    data[i] = i % 251;
+  }
+  avio_write(pb, data.data(), data.size());
+
+  // Patch the head like the mp4 muxer does with the mdat size.
+  avio_seek(pb, 0, SEEK_SET);
+  avio_w8(pb, 0xff);
+  avio_seek(pb, data.size(), SEEK_SET);
+  avio_w8(pb, 0xee);
+  BOOST_TEST(writer.close());
+
+  std::ifstream in(target, std::ios::binary);
+  std::vector<uint8_t> rs((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  data[0] = 0xff;
+  data.push_back(0xee);
+  BOOST_TEST(rs == data);
+
+  auto stats = writer.stats();
+  BOOST_TEST(stats.bytesWritten >= data.size());
+  BOOST_TEST(stats.maxWriteSize == 16384);
+}
+
+BOOST_AUTO_TEST_CASE(preallocate_and_sync)
+{
+  using namespace vcamshare;
+  const std::string target = "/tmp/file_writer_sync.bin";
+  FileWriter writer {1 << 20};
+  writer.setPreallocate(true);
+  writer.setSyncPolicy(FileWriter::SyncPolicy::Bytes, 1 << 20);
+  BOOST_TEST(writer.open(target));
+
+  std::vector<uint8_t> data(3 * (1 << 20) + 10, 7);
+  avio_write(writer.avioContext(), data.data(), data.size());
+  BOOST_TEST(writer.close());
+
+  // Preallocated space is released on close.
+  std::ifstream in(target, std::ios::binary | std::ios::ate);
+  BOOST_TEST(in.tellg() == data.size());
+  // So are the blocks reserved past the end of the data.
+  struct stat st;
+  BOOST_TEST(stat(target.c_str(), &st) == 0);
+  int64_t allocated = int64_t(st.st_blocks) * 512;
+  BOOST_TEST(allocated < int64_t(data.size()) + int64_t(st.st_blksize));
+  BOOST_TEST(writer.stats().syncCount >= 3);
+}
+
+BOOST_AUTO_TEST_CASE(short_writes_and_full_disk)
+{
+  using namespace vcamshare;
+  auto backend = std::make_shared<FaultIoBackend>();
+  FaultIoBackend::Faults faults;
+  faults.maxWriteBytes = 1000;
+  backend->setFaults(faults);
+
+  const std::string target = "/tmp/file_writer_short.bin";
+  FileWriter writer {16384};
+  writer.setIoBackend(backend);
+  BOOST_TEST(writer.open(target));
+  std::vector<uint8_t> data(100000);
+  for (size_t i = 0; i < data.size(); i ++) {
+    data[i] = i % 253;
+  }
+  avio_write(writer.avioContext(), data.data(), data.size());
+  BOOST_TEST(writer.close());
+
+  // Every write came back short and was carried on.
+  std::ifstream in(target, std::ios::binary);
+  std::vector<uint8_t> rs((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  BOOST_TEST(rs == data);
+  BOOST_TEST(backend->shortWriteCount() > 0);
+
+  faults.spaceBytes = 50000;
+  backend->setFaults(faults);
+  FileWriter full {16384};
+  full.setIoBackend(backend);
+  BOOST_TEST(full.open("/tmp/file_writer_full.bin"));
+  avio_write(full.avioContext(), data.data(), data.size());
+  BOOST_TEST(!full.close());
+  BOOST_TEST(full.hasError());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
+BOOST_AUTO_TEST_SUITE(FastStartTest)
+
+static void appendAtom(std::vector<uint8_t> &out, const char *type, const std::vector<uint8_t> &body) {
+  uint32_t size = body.size() + 8;
+  uint8_t header[] = {uint8_t(size >> 24), uint8_t(size >> 16), uint8_t(size >> 8), uint8_t(size),
+                      uint8_t(type[0]), uint8_t(type[1]), uint8_t(type[2]), uint8_t(type[3])};
+  out.insert(out.end(), header, header + 8);
+  out.insert(out.end(), body.begin(), body.end());
+}
+
+static std::vector<uint8_t> atom(const char *type, const std::vector<uint8_t> &body) {
+  std::vector<uint8_t> out;
+  appendAtom(out, type, body);
+  return out;
+}
+
+static uint32_t be32(const uint8_t *p) {
+  return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+BOOST_AUTO_TEST_CASE(moov_moved_and_offsets_patched)
+{
+  const std::string target = "/tmp/faststart.mp4";
+
+  std::vector<uint8_t> file;
+  appendAtom(file, "ftyp", {'i', 's', 'o', 'm', 0, 0, 2, 0});
+  std::vector<uint8_t> media(100);
+  for (size_t i = 0; i < media.size(); i ++) media[i] = i;
+  uint32_t mdatData = file.size() + 8;
+  appendAtom(file, "mdat", media);
+
+  std::vector<uint8_t> stco = {0, 0, 0, 0, 0, 0, 0, 2};
+  for (uint32_t offset : {mdatData, mdatData + 50}) {
+    stco.push_back(offset >> 24); stco.push_back(offset >> 16);
+    stco.push_back(offset >> 8); stco.push_back(offset);
+  }
+  auto moov = atom("moov", atom("trak", atom("mdia", atom("minf", atom("stbl", atom("stco", stco))))));
+  file.insert(file.end(), moov.begin(), moov.end());
+
+  {
+    std::ofstream out(target, std::ios::binary);
+    out.write((const char *)file.data(), file.size());
+  }
+
+  float lastProgress = 0;
+  BOOST_TEST(vcamshare::faststartFile(target, [&lastProgress] (float p) { lastProgress = p; }));
+  BOOST_TEST(lastProgress == 1.0f);
+
+  std::ifstream in(target, std::ios::binary);
+  std::vector<uint8_t> rs((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  BOOST_TEST(rs.size() == file.size());
+  BOOST_TEST(std::string((char *)&rs[20], 4) == "moov");
+  BOOST_TEST(std::string((char *)&rs[16 + moov.size() + 4], 4) == "mdat");
+
+  const uint8_t *entries = &rs[16 + moov.size() - 8];
+  BOOST_TEST(be32(entries) == mdatData + moov.size());
+  BOOST_TEST(rs[be32(entries + 4)] == 50);
+
+  // A second pass has nothing to do.
+  BOOST_TEST(vcamshare::faststartFile(target, nullptr));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+
 BOOST_AUTO_TEST_SUITE(vCamShareTest)
 
 BOOST_AUTO_TEST_CASE(isOpen)
@@ -245,6 +1505,73 @@ BOOST_AUTO_TEST_CASE(isOpen)
   BOOST_TEST(videoMuxerIsOpen(hd) == 1);
 }
 
+BOOST_AUTO_TEST_CASE(open_and_close_from_many_threads)
+{
+  const int threads = 16;
+  const int rounds = 20;
+  std::mutex mutx;
+  std::set<int> handles;
+  int stale = 0;
+  std::vector<std::thread> workers;
+  for(int t = 0; t < threads; t ++) {
+    workers.emplace_back([t, &mutx, &handles, &stale] () {
+      std::string path = "/tmp/concurrent_" + std::to_string(t) + ".mp4";
+      uint8_t data[] = {0, 0, 0, 1, 7, 6, 2, 0, 0, 0, 1, 8, 2, 3, 1, 5};
+      for(int i = 0; i < rounds; i ++) {
+        int hd = createVideoMuxer(1920, 1080, 30, path.c_str());
+        writeVideoFrames(hd, data, boost::range_detail::array_size(data));
+        checkVideoMuxerError(hd);
+        closeVideoMuxer(hd);
+        // A closed handle is gone, not recreated by looking it up. Boost.Test
+        // isn't thread safe, so this is only checked after the join.
+        bool gone = videoMuxerIsOpen(hd) == 0 &&
+                    writeVideoFrames(hd, data, boost::range_detail::array_size(data)) == 0;
+        std::lock_guard<std::mutex> lock(mutx);
+        handles.insert(hd);
+        if(!gone) stale ++;
+      }
+    });
+  }
+  for(auto &worker : workers) worker.join();
+
+  BOOST_TEST(handles.size() == size_t(threads * rounds));
+  BOOST_TEST(stale == 0);
+  for(int t = 0; t < threads; t ++) {
+    remove(("/tmp/concurrent_" + std::to_string(t) + ".mp4").c_str());
+  }
+}
+
+BOOST_AUTO_TEST_CASE(close_while_another_thread_polls)
+{
+  const std::string target = "/tmp/concurrent_poll.mp4";
+  for(int i = 0; i < 20; i ++) {
+    int hd = createVideoMuxer(1920, 1080, 30, target.c_str());
+    uint8_t data[] = {0, 0, 0, 1, 7, 6, 2, 0, 0, 0, 1, 8, 2, 3, 1, 5};
+    writeVideoFrames(hd, data, boost::range_detail::array_size(data));
+
+    // Polls keep running across the close, each one either sees the muxer
+    // alive or finds no handle.
+    std::atomic<bool> closed(false);
+    int polls = 0;
+    std::thread monitor([hd, &closed, &polls] () {
+      VideoMuxerStats stats;
+      while(!closed) {
+        videoMuxerGetStats(hd, &stats);
+        checkVideoMuxerError(hd);
+        polls ++;
+      }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    closeVideoMuxer(hd);
+    closed = true;
+    monitor.join();
+
+    BOOST_TEST(polls > 0);
+    BOOST_TEST(videoMuxerGetStats(hd, nullptr) == 0);
+  }
+  remove(target.c_str());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
 
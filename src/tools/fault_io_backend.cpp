@@ -0,0 +1,140 @@
+#include "fault_io_backend.h"
+#include <errno.h>
+#include <sys/stat.h>
+#include <thread>
+#include <algorithm>
+
+namespace vcamshare {
+
+    FaultIoBackend::Faults::Faults() {
+        spikeEvery = 0;
+        spikeMs = 0;
+        maxWriteBytes = 0;
+        bytesPerSecond = 0;
+        spaceBytes = -1;
+    }
+
+    FaultIoBackend::FaultIoBackend(std::shared_ptr<IoBackend> target) {
+        mTarget = target ? target : IoBackend::system();
+        mIdleAt = std::chrono::steady_clock::now();
+        mWriteCount = 0;
+        mShortWriteCount = 0;
+        mFailedWriteCount = 0;
+        mSyncCount = 0;
+    }
+
+    void FaultIoBackend::setFaults(const Faults &faults) {
+        std::unique_lock<std::mutex> l(mMutx);
+        mFaults = faults;
+    }
+
+    FaultIoBackend::Faults FaultIoBackend::faults() {
+        std::unique_lock<std::mutex> l(mMutx);
+        return mFaults;
+    }
+
+    int64_t FaultIoBackend::writeCount() {
+        return mWriteCount;
+    }
+
+    int64_t FaultIoBackend::shortWriteCount() {
+        return mShortWriteCount;
+    }
+
+    int64_t FaultIoBackend::failedWriteCount() {
+        return mFailedWriteCount;
+    }
+
+    int64_t FaultIoBackend::syncCount() {
+        return mSyncCount;
+    }
+
+    int FaultIoBackend::open(const std::string &filePath, int flags, mode_t mode) {
+        return mTarget->open(filePath, flags, mode);
+    }
+
+    ssize_t FaultIoBackend::pwrite(int fd, const void *buf, size_t len, int64_t offset) {
+        size_t n = len;
+        int spikeMs = 0;
+        auto until = std::chrono::steady_clock::now();
+        {
+            std::unique_lock<std::mutex> l(mMutx);
+            int64_t count = ++ mWriteCount;
+            if(mFaults.spaceBytes == 0) {
+                mFailedWriteCount ++;
+                errno = ENOSPC;
+                return -1;
+            }
+            if(mFaults.spaceBytes > 0) n = std::min<int64_t>(n, mFaults.spaceBytes);
+            if(mFaults.maxWriteBytes > 0) n = std::min<size_t>(n, mFaults.maxWriteBytes);
+            if(mFaults.spikeEvery > 0 && count % mFaults.spikeEvery == 0) spikeMs = mFaults.spikeMs;
+
+            if(mFaults.bytesPerSecond > 0) {
+                // Writes queue up behind each other like on the device.
+                mIdleAt = std::max(mIdleAt, until) + std::chrono::microseconds(int64_t(n) * 1000000 / mFaults.bytesPerSecond);
+                until = mIdleAt;
+            }
+        }
+
+        if(spikeMs > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(spikeMs));
+        }
+        std::this_thread::sleep_until(until);
+
+        ssize_t done = mTarget->pwrite(fd, buf, n, offset);
+        if(done < 0) {
+            mFailedWriteCount ++;
+            return done;
+        }
+        if(size_t(done) < len) {
+            mShortWriteCount ++;
+        }
+
+        std::unique_lock<std::mutex> l(mMutx);
+        if(mFaults.spaceBytes > 0) {
+            mFaults.spaceBytes = std::max<int64_t>(mFaults.spaceBytes - done, 0);
+        }
+        return done;
+    }
+
+    int FaultIoBackend::allocate(int fd, int64_t offset, int64_t len) {
+        {
+            std::unique_lock<std::mutex> l(mMutx);
+            if(mFaults.spaceBytes >= 0 && len > mFaults.spaceBytes) return ENOSPC;
+        }
+        return mTarget->allocate(fd, offset, len);
+    }
+
+    int FaultIoBackend::sync(int fd) {
+        mSyncCount ++;
+        return mTarget->sync(fd);
+    }
+
+    int FaultIoBackend::truncate(int fd, int64_t size) {
+        return mTarget->truncate(fd, size);
+    }
+
+    int FaultIoBackend::close(int fd) {
+        return mTarget->close(fd);
+    }
+
+    int64_t FaultIoBackend::freeSpace(const std::string &path) {
+        int64_t space = mTarget->freeSpace(path);
+        std::unique_lock<std::mutex> l(mMutx);
+        if(mFaults.spaceBytes >= 0 && (space < 0 || mFaults.spaceBytes < space)) {
+            space = mFaults.spaceBytes;
+        }
+        return space;
+    }
+
+    int FaultIoBackend::remove(const std::string &filePath) {
+        struct stat st;
+        int64_t size = stat(filePath.c_str(), &st) == 0 ? st.st_size : 0;
+        int ret = mTarget->remove(filePath);
+        if(ret == 0) {
+            std::unique_lock<std::mutex> l(mMutx);
+            if(mFaults.spaceBytes >= 0) mFaults.spaceBytes += size;
+        }
+        return ret;
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef VXMT_VCAM_SHARE_FAULT_IO_BACKEND
+#define VXMT_VCAM_SHARE_FAULT_IO_BACKEND
+
+#include <mutex>
+#include <chrono>
+#include <atomic>
+
+#include "../main/io_backend.h"
+
+namespace vcamshare {
+
+    // Storage that behaves like a worn SD card for the tests: writes that
+    // stall now and then, come back short, trickle at a capped rate or run
+    // out of space. Everything else is passed to the wrapped backend. The
+    // faults can be changed while files are being written.
+    class FaultIoBackend : public IoBackend {
+    public:
+        struct Faults {
+            // Every spikeEvery-th write waits spikeMs first, 0 for none.
+            int spikeEvery;
+            int spikeMs;
+            // Writes return after at most this many bytes, 0 for no limit.
+            int maxWriteBytes;
+            // Writes across all files take at least their size over this, 0 for no cap.
+            int64_t bytesPerSecond;
+            // Bytes left to write across all files, -1 for no limit. Writes
+            // past it come back short, then fail with ENOSPC, and so does
+            // an allocation that doesn't fit.
+            int64_t spaceBytes;
+            Faults();
+        };
+
+        explicit FaultIoBackend(std::shared_ptr<IoBackend> target = IoBackend::system());
+
+        void setFaults(const Faults &faults);
+        Faults faults();
+
+        int64_t writeCount();
+        int64_t shortWriteCount();
+        int64_t failedWriteCount();
+        int64_t syncCount();
+
+        int open(const std::string &filePath, int flags, mode_t mode) override;
+        ssize_t pwrite(int fd, const void *buf, size_t len, int64_t offset) override;
+        int allocate(int fd, int64_t offset, int64_t len) override;
+        int sync(int fd) override;
+        int truncate(int fd, int64_t size) override;
+        int close(int fd) override;
+        // The space budget when there is one, removing a file gives its size back.
+        int64_t freeSpace(const std::string &path) override;
+        int remove(const std::string &filePath) override;
+
+    private:
+        std::shared_ptr<IoBackend> mTarget;
+
+        std::mutex mMutx;
+        Faults mFaults;
+        std::chrono::steady_clock::time_point mIdleAt;
+
+        std::atomic<int64_t> mWriteCount;
+        std::atomic<int64_t> mShortWriteCount;
+        std::atomic<int64_t> mFailedWriteCount;
+        std::atomic<int64_t> mSyncCount;
+    };
+}
+
+#endif
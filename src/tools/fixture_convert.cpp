@@ -0,0 +1,89 @@
+// Converts the decimal text fixtures of src/test into binary fixtures.
+//
+//   fixture_convert [--fps N] [--sample-rate N] [--channels N] input output
+//
+// .raw inputs hold audio as one line of float samples per callback, every
+// other input one line of H.264 bytes per access unit. The text has no
+// timestamps, they are rebuilt from the frame rate or the sample count.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+
+#include "fixture_file.h"
+
+static bool endsWith(const std::string &s, const std::string &suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+int main(int argc, char **argv) {
+    int fps = 30;
+    int sampleRate = 44100;
+    int channels = 1;
+    std::vector<std::string> paths;
+
+    for(int i = 1; i < argc; i ++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(arg == "--fps" && hasValue) fps = atoi(argv[++ i]);
+        else if(arg == "--sample-rate" && hasValue) sampleRate = atoi(argv[++ i]);
+        else if(arg == "--channels" && hasValue) channels = atoi(argv[++ i]);
+        else paths.push_back(arg);
+    }
+    if(paths.size() != 2 || fps <= 0 || sampleRate <= 0 || channels <= 0) {
+        fprintf(stderr, "usage: %s [--fps N] [--sample-rate N] [--channels N] input output\n", argv[0]);
+        return 2;
+    }
+
+    std::ifstream source(paths[0]);
+    if(!source) {
+        fprintf(stderr, "Could not open %s\n", paths[0].c_str());
+        return 1;
+    }
+
+    bool audio = endsWith(paths[0], ".raw");
+    vcamshare::FixtureFile::Writer writer;
+    if(!writer.open(paths[1], audio ? vcamshare::FixtureFile::Audio : vcamshare::FixtureFile::Video)) {
+        fprintf(stderr, "Could not create %s\n", paths[1].c_str());
+        return 1;
+    }
+
+    int64_t frames = 0;
+    int64_t samples = 0;
+    std::string line;
+    bool ok = true;
+    while(ok && std::getline(source, line)) {
+        std::stringstream values(line);
+        if(audio) {
+            std::vector<float> chunk;
+            float value;
+            while(values >> value) chunk.push_back(value);
+            if(chunk.empty()) continue;
+
+            int64_t timestampUs = samples * 1000000 / sampleRate;
+            ok = writer.write(chunk.data(), chunk.size() * sizeof(float), 0, timestampUs);
+            samples += chunk.size() / channels;
+        } else {
+            std::vector<uint8_t> frame;
+            int value;
+            while(values >> value) frame.push_back(uint8_t(value));
+            if(frame.size() < 5) continue;
+
+            // Parameter sets lead the IDR access units of the camera.
+            int nalType = frame[4] & 0x1f;
+            uint32_t flags = nalType != 1 ? vcamshare::FixtureFile::FLAG_KEYFRAME : 0;
+            ok = writer.write(frame.data(), frame.size(), flags, frames * 1000000 / fps);
+        }
+        frames ++;
+    }
+
+    if(!ok || !writer.finish()) {
+        fprintf(stderr, "Could not write %s\n", paths[1].c_str());
+        remove(paths[1].c_str());
+        return 1;
+    }
+    printf("%s: %lld %s frames\n", paths[1].c_str(), (long long)frames, audio ? "audio" : "video");
+    return 0;
+}
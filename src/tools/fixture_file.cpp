@@ -0,0 +1,160 @@
+#include "fixture_file.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char MAGIC[4] = { 'V', 'C', 'F', 'X' };
+static constexpr uint16_t VERSION = 1;
+static constexpr size_t HEADER_SIZE = 16;
+static constexpr size_t FRAME_HEADER_SIZE = 16;
+
+static size_t padded(size_t size) {
+    return (size + 7) & ~size_t(7);
+}
+
+// The fixtures are little endian, like every host the tests run on.
+template <typename T>
+static T readValue(const uint8_t *p) {
+    T value;
+    memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+namespace vcamshare {
+
+    FixtureFile::FixtureFile() {
+        mMap = nullptr;
+        mMapSize = 0;
+        mKind = Video;
+    }
+
+    FixtureFile::~FixtureFile() {
+        close();
+    }
+
+    bool FixtureFile::open(const std::string &filePath) {
+        close();
+
+        int fd = ::open(filePath.c_str(), O_RDONLY);
+        if(fd < 0) return false;
+
+        struct stat st;
+        if(fstat(fd, &st) != 0 || size_t(st.st_size) < HEADER_SIZE) {
+            ::close(fd);
+            return false;
+        }
+        void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if(map == MAP_FAILED) return false;
+
+        mMap = static_cast<uint8_t *>(map);
+        mMapSize = st.st_size;
+        // The frames are read front to back.
+        madvise(mMap, mMapSize, MADV_SEQUENTIAL);
+
+        if(memcmp(mMap, MAGIC, sizeof(MAGIC)) != 0 || readValue<uint16_t>(mMap + 4) != VERSION) {
+            close();
+            return false;
+        }
+        mKind = Kind(readValue<uint16_t>(mMap + 6));
+        uint32_t count = readValue<uint32_t>(mMap + 8);
+        mFrames.reserve(count);
+
+        size_t pos = HEADER_SIZE;
+        for(uint32_t i = 0; i < count; i ++) {
+            if(pos + FRAME_HEADER_SIZE > mMapSize) break;
+            Frame frame;
+            frame.size = readValue<uint32_t>(mMap + pos);
+            frame.flags = readValue<uint32_t>(mMap + pos + 4);
+            frame.timestampUs = readValue<int64_t>(mMap + pos + 8);
+            frame.data = mMap + pos + FRAME_HEADER_SIZE;
+            if(pos + FRAME_HEADER_SIZE + frame.size > mMapSize) break;
+
+            mFrames.push_back(frame);
+            pos += FRAME_HEADER_SIZE + padded(frame.size);
+        }
+        if(mFrames.size() != count) {
+            fprintf(stderr, "%s is truncated\n", filePath.c_str());
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void FixtureFile::close() {
+        if(mMap) {
+            munmap(mMap, mMapSize);
+            mMap = nullptr;
+            mMapSize = 0;
+        }
+        mFrames.clear();
+    }
+
+    FixtureFile::Kind FixtureFile::kind() {
+        return mKind;
+    }
+
+    const std::vector<FixtureFile::Frame> &FixtureFile::frames() {
+        return mFrames;
+    }
+
+    FixtureFile::Writer::Writer() {
+        mFile = nullptr;
+        mCount = 0;
+    }
+
+    FixtureFile::Writer::~Writer() {
+        if(mFile) fclose(mFile);
+    }
+
+    bool FixtureFile::Writer::open(const std::string &filePath, Kind kind) {
+        mFile = fopen(filePath.c_str(), "wb");
+        if(!mFile) return false;
+
+        uint8_t header[HEADER_SIZE] = { 0 };
+        uint16_t version = VERSION;
+        uint16_t kindValue = kind;
+        memcpy(header, MAGIC, sizeof(MAGIC));
+        memcpy(header + 4, &version, 2);
+        memcpy(header + 6, &kindValue, 2);
+        return fwrite(header, 1, HEADER_SIZE, mFile) == HEADER_SIZE;
+    }
+
+    bool FixtureFile::Writer::write(const void *data, int size, uint32_t flags, int64_t timestampUs) {
+        if(!mFile || size < 0) return false;
+
+        uint8_t header[FRAME_HEADER_SIZE];
+        uint32_t size32 = size;
+        memcpy(header, &size32, 4);
+        memcpy(header + 4, &flags, 4);
+        memcpy(header + 8, &timestampUs, 8);
+        static const uint8_t zeros[8] = { 0 };
+        size_t pad = padded(size) - size;
+
+        bool ok = fwrite(header, 1, FRAME_HEADER_SIZE, mFile) == FRAME_HEADER_SIZE
+            && fwrite(data, 1, size, mFile) == size_t(size)
+            && fwrite(zeros, 1, pad, mFile) == pad;
+        if(ok) mCount ++;
+        return ok;
+    }
+
+    bool FixtureFile::Writer::finish() {
+        if(!mFile) return false;
+        bool ok = fseek(mFile, 8, SEEK_SET) == 0 && fwrite(&mCount, 4, 1, mFile) == 1;
+        ok = fclose(mFile) == 0 && ok;
+        mFile = nullptr;
+        return ok;
+    }
+
+    bool isFixtureFile(const std::string &filePath) {
+        char magic[sizeof(MAGIC)];
+        FILE *file = fopen(filePath.c_str(), "rb");
+        if(!file) return false;
+        bool ok = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+        fclose(file);
+        return ok;
+    }
+}
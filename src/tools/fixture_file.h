@@ -0,0 +1,67 @@
+#ifndef VXMT_VCAM_SHARE_FIXTURE_FILE
+#define VXMT_VCAM_SHARE_FIXTURE_FILE
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <stdint.h>
+#include <stdio.h>
+
+namespace vcamshare {
+
+    // Binary fixtures for the tests and benchmarks, little endian:
+    //
+    //   header  "VCFX", u16 version, u16 kind, u32 frame count, u32 reserved
+    //   frame   u32 size, u32 flags, i64 timestamp in microseconds, payload
+    //
+    // Every frame is padded to 8 bytes, so audio payloads stay float aligned
+    // in the mapping. Video payloads are Annex B access units, audio ones
+    // interleaved float samples.
+    class FixtureFile {
+    public:
+        enum Kind { Video = 1, Audio = 2 };
+        static constexpr uint32_t FLAG_KEYFRAME = 1;
+
+        struct Frame {
+            const uint8_t *data;
+            int size;
+            uint32_t flags;
+            int64_t timestampUs;
+        };
+
+        FixtureFile();
+        ~FixtureFile();
+
+        // Maps the whole file and indexes its frames.
+        bool open(const std::string &filePath);
+        void close();
+
+        Kind kind();
+        const std::vector<Frame> &frames();
+
+        // Appends frames to a new fixture, patching the count on finish().
+        class Writer {
+        public:
+            Writer();
+            ~Writer();
+            bool open(const std::string &filePath, Kind kind);
+            bool write(const void *data, int size, uint32_t flags, int64_t timestampUs);
+            bool finish();
+
+        private:
+            FILE *mFile;
+            uint32_t mCount;
+        };
+
+    private:
+        uint8_t *mMap;
+        size_t mMapSize;
+        Kind mKind;
+        std::vector<Frame> mFrames;
+    };
+
+    // True when the file starts with the fixture magic.
+    bool isFixtureFile(const std::string &filePath);
+}
+
+#endif